@@ -1,6 +1,196 @@
 #include "jansson.h"
 #include <stdio.h>
 #include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <malloc.h>
+
+// Wall time in the main stages of a run, for gc-bench.  StageBegin() and StageEnd() 
+// bracket each stage, at the cost of two clock reads, and StageTimes() writes the 
+// totals to the file named by stagetimes in the control file.
+// With profile = 1, the stages also record CPU time, peak RSS, the heap in use, and 
+// the likelihood, eigen and P(t) counts, the pair kernel records the time each thread 
+// is busy, and ming2() reports its rounds, and ProfileOut() writes it all to 
+// run-profile.json.  These are read only when profiling.
+enum {StageInput, StagePatternWeight, StageFit, StagePostProb, StageConP, StagePairs, 
+      StageRegression, StageOutput, StageOutputJS, NStages};
+static char *stageName[NStages] = {"input", "PatternWeight", "fit", "PostProbFwdBwd", "conP_part1", 
+      "pairs", "calculateRegression", "output", "outputDataInJS"};
+static double stageStart[NStages], stageWall[NStages];
+static int stageCalls[NStages];
+
+#define PROFILE_MAXTHREADS 256
+static int profiling;
+static double profileStart, profileCPU0;
+static struct PROFILESTAGE {
+    double cpu0, cpu, peakRSS, heap, busy[PROFILE_MAXTHREADS];
+    int nfun0, neigen0, npmat0, nfun, neigen, npmat, nthreads;
+}  stageProf[NStages];
+static struct PROFILEROUND {
+    int round, nfun;
+    double f, start;
+}  *profileRound;
+static int nprofileRound, nprofileRoundAlloc;
+
+static double StageClock (void) {
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    return t.tv_sec + t.tv_usec*1e-6;
+}
+
+static double ProfileCPU (void) {
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+    return r.ru_utime.tv_sec + r.ru_utime.tv_usec*1e-6 + r.ru_stime.tv_sec + r.ru_stime.tv_usec*1e-6;
+}
+
+static double ProfilePeakRSS (void) {   // MB
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+#ifdef __APPLE__
+    return r.ru_maxrss/(1024.*1024);
+#else
+    return r.ru_maxrss/1024.;
+#endif
+}
+
+static double ProfileHeap (void) {      // MB in use, -1 if unknown
+#if defined(__GLIBC__) && (__GLIBC__>2 || (__GLIBC__==2 && __GLIBC_MINOR__>=33))
+    struct mallinfo2 m = mallinfo2();
+    return (m.uordblks + m.hblkhd)/(1024.*1024);
+#else
+    return -1;
+#endif
+}
+
+void StageBegin (int stage) {
+    stageStart[stage] = StageClock();
+    if (profiling) {
+        stageProf[stage].cpu0 = ProfileCPU();
+        stageProf[stage].nfun0 = NFunCall;
+        stageProf[stage].neigen0 = NEigenQ;
+        stageProf[stage].npmat0 = NPMatUVRoot;
+    }
+}
+
+void StageEnd (int stage) {
+    struct PROFILESTAGE *p = &stageProf[stage];
+
+    stageWall[stage] += StageClock() - stageStart[stage];
+    stageCalls[stage]++;
+    if (profiling) {
+        // the counters are reset at the start of each analysis
+        p->cpu += ProfileCPU() - p->cpu0;
+        p->nfun += (NFunCall>=p->nfun0 ? NFunCall-p->nfun0 : NFunCall);
+        p->neigen += (NEigenQ>=p->neigen0 ? NEigenQ-p->neigen0 : NEigenQ);
+        p->npmat += (NPMatUVRoot>=p->npmat0 ? NPMatUVRoot-p->npmat0 : NPMatUVRoot);
+        p->peakRSS = ProfilePeakRSS();
+        p->heap = max2(p->heap, ProfileHeap());
+    }
+}
+
+static double ThreadBusyBegin (void) {
+    return (profiling ? StageClock() : 0);
+}
+
+static void ThreadBusyEnd (int stage, double t0) {
+    // called by each thread in a parallel loop, for its own slot
+    int i = 0, nthreads = 1;
+    if (!profiling) return;
+#ifdef _OPENMP
+    i = omp_get_thread_num();
+    nthreads = omp_get_num_threads();
+#endif
+    if (i < PROFILE_MAXTHREADS) stageProf[stage].busy[i] += StageClock() - t0;
+    if (i == 0) stageProf[stage].nthreads = min2(nthreads, PROFILE_MAXTHREADS);
+}
+
+static void ProfileRound (int round, double f) {
+    // called by ming2() at the start of each round, with the time since ProfileBegin()
+    if (nprofileRound == nprofileRoundAlloc) {
+        nprofileRoundAlloc = max2(nprofileRoundAlloc*2, 256);
+        profileRound = (struct PROFILEROUND*)realloc(profileRound, nprofileRoundAlloc*sizeof(struct PROFILEROUND));
+        if (profileRound == NULL) error2("oom profileRound");
+    }
+    profileRound[nprofileRound].round = round;
+    profileRound[nprofileRound].f = f;
+    profileRound[nprofileRound].nfun = NFunCall;
+    profileRound[nprofileRound].start = StageClock() - profileStart;
+    nprofileRound++;
+}
+
+void ProfileBegin (void) {
+    profiling = 1;
+    profileStart = StageClock();
+    profileCPU0 = ProfileCPU();
+    MinimizationRound = ProfileRound;
+}
+
+void StageTimes (char *file) {
+    FILE *f = fopen(file, "w");
+    int i;
+
+    if (f == NULL) { printf("\ncan't write stage times to %s\n", file); return; }
+    fprintf(f, "Stage\tSeconds\tCalls\n");
+    for (i=0; i<NStages; i++)
+        fprintf(f, "%s\t%.6f\t%d\n", stageName[i], stageWall[i], stageCalls[i]);
+    fclose(f);
+}
+
+void ProfileOut (char *file) {
+    json_t *root = json_object(), *stages = json_array(), *rounds = json_array(), *s, *threads, *t;
+    struct PROFILESTAGE *p;
+    int i, j;
+
+    json_object_set_new(root, "program", json_string("grand-conv"));
+    json_object_set_new(root, "seqfile", json_string(com.seqf));
+    json_object_set_new(root, "ns", json_integer(com.ns));
+    json_object_set_new(root, "ls", json_integer(com.ls));
+    json_object_set_new(root, "npatt", json_integer(com.npatt));
+    json_object_set_new(root, "numOfThreads", json_integer(com.numOfThreads));
+    json_object_set_new(root, "wall", json_real(StageClock() - profileStart));
+    json_object_set_new(root, "cpu", json_real(ProfileCPU() - profileCPU0));
+    json_object_set_new(root, "peakRSS_MB", json_real(ProfilePeakRSS()));
+    json_object_set_new(root, "heap_MB", json_real(ProfileHeap()));
+    for (i=0; i<NStages; i++) {
+        if (stageCalls[i] == 0) continue;
+        p = &stageProf[i];
+        s = json_object();
+        json_object_set_new(s, "name", json_string(stageName[i]));
+        json_object_set_new(s, "calls", json_integer(stageCalls[i]));
+        json_object_set_new(s, "wall", json_real(stageWall[i]));
+        json_object_set_new(s, "cpu", json_real(p->cpu));
+        json_object_set_new(s, "lfun", json_integer(p->nfun));
+        json_object_set_new(s, "eigenQ", json_integer(p->neigen));
+        json_object_set_new(s, "PMat", json_integer(p->npmat));
+        json_object_set_new(s, "peakRSS_MB", json_real(p->peakRSS));
+        json_object_set_new(s, "heap_MB", json_real(p->heap));
+        if (p->nthreads) {
+            threads = json_array();
+            for (j=0; j<p->nthreads; j++) {
+                t = json_object();
+                json_object_set_new(t, "busy", json_real(p->busy[j]));
+                json_object_set_new(t, "idle", json_real(max2(0, stageWall[i] - p->busy[j])));
+                json_array_append_new(threads, t);
+            }
+            json_object_set_new(s, "threads", threads);
+        }
+        json_array_append_new(stages, s);
+    }
+    json_object_set_new(root, "stages", stages);
+    for (i=0; i<nprofileRound; i++) {
+        s = json_object();
+        json_object_set_new(s, "round", json_integer(profileRound[i].round));
+        json_object_set_new(s, "f", json_real(profileRound[i].f));
+        json_object_set_new(s, "start", json_real(profileRound[i].start));
+        json_object_set_new(s, "lfun", json_integer(profileRound[i].nfun));
+        json_array_append_new(rounds, s);
+    }
+    json_object_set_new(root, "ming2Rounds", rounds);
+    if (json_dump_file(root, file, JSON_INDENT(2)))
+        printf("\ncan't write the profile to %s\n", file);
+    json_decref(root);
+}
 
 void print_node(json_t *node, int level) {
     json_t * name = json_object_get(node,"name");
@@ -152,34 +342,29 @@ int cmpfunc (const void * x, const void * y){
 
 void calculateRegression(double *pDivergent, double *pAllConvergent, int numBranchPairs, double *k, double *b){
 
-    double *s = (double*)malloc(numBranchPairs*numBranchPairs*sizeof(double));
-    memset(s, 0, numBranchPairs*numBranchPairs*sizeof(double));
-    int i,j, counter = 0, cutoff = 0, index = 0;
-    double xdelta, ydelta;
+    StageBegin(StageRegression);
+    // The nonzero slopes over pairs i<=j go straight into vector, in the order of 
+    // the loops; there are at most numBranchPairs*(numBranchPairs+1)/2 of them.
+    size_t nslope = (size_t)numBranchPairs*(numBranchPairs+1)/2;
+    double *vector = (double*)malloc((nslope>0 ? nslope : 1)*sizeof(double));
+    int i,j, counter = 0, cutoff = 0;
+    double xdelta, ydelta, slope;
 
+    if (vector == NULL) error2("oom calculateRegression");
     for(i=0; i<numBranchPairs; i++){
         for(j=i; j<numBranchPairs; j++){
             xdelta = pDivergent[i]-pDivergent[j];
             ydelta = pAllConvergent[i]-pAllConvergent[j];
             if(xdelta==0 && ydelta==0){
-                s[i*numBranchPairs+j] = 0;
+                slope = 0;
             }else{
-                s[i*numBranchPairs+j] = ydelta/xdelta;
-                s[i*numBranchPairs+j] = (s[i*numBranchPairs+j]==-1) ? 0 : s[i*numBranchPairs+j];
+                slope = ydelta/xdelta;
+                slope = (slope==-1) ? 0 : slope;
             }
-            if(s[i*numBranchPairs+j] != 0) counter++;
-        }
-    }
-
-    double *vector = (double*)malloc(counter*sizeof(double));
-    for(i=0;i<numBranchPairs*numBranchPairs;i++){
-        if(s[i]!=0) {
-            vector[index]=s[i];
-            index++;
+            if(slope != 0) vector[counter++] = slope;
         }
     }
     qsort(vector, counter, sizeof(double), cmpfunc);
-    free(s);
 
     for(i=0; i<counter; i++){
         if(vector[i] >= -1){
@@ -205,6 +390,7 @@ void calculateRegression(double *pDivergent, double *pAllConvergent, int numBran
         *b = temp[numBranchPairs/2];
 
     free(temp);
+    StageEnd(StageRegression);
 }
 
 void outputDataInJS(int *node1, int *node2, double *pDivergent, double *pAllConvergent, 
@@ -212,6 +398,14 @@ void outputDataInJS(int *node1, int *node2, double *pDivergent, double *pAllConv
                     int numOfSelectedBranchPairs, int numBranchPairs, int lst,
                     double *postNumSub, int *siteClass){
 
+    // The data and pages go in UI/User, which gc-discover sets up.  Without it, 
+    // as for the genes in a batch run, there is nothing to visualize.
+    struct stat st;
+    if (stat("UI/User", &st) || !S_ISDIR(st.st_mode) || stat("UI/Template.html", &st)) {
+        free(siteSpecificMap);
+        return;
+    }
+
     // calculate regression slope and intercept
     double k, b;
     
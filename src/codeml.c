@@ -16,16 +16,35 @@
 */
 
 #include "paml.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if (defined __unix__ || defined __APPLE__)
+#include <unistd.h>
+#include <sys/wait.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
 
 // #define JDKLAB        1 // comment out this line to run normal codeML program
+/* NS, NGENE and NCATG size the tree, gene and site-class tables, and may be 
+   set when building, as in make NS=12000.  The sequences are allocated for 
+   the actual number of species.
+*/
+#ifndef NS
 #define NS            7000
+#endif
 #define NBRANCH       (NS*2-2)
 #define NNODE         (NS*2-1)
 #define MAXNSONS      100
+#ifndef NGENE
 #define NGENE         2000
+#endif
 #define LSPNAME       50
 #define NCODE         64
+#ifndef NCATG
 #define NCATG         40
+#endif
 #define NBTYPE        17
 
 #define NP            (NBRANCH*2+NGENE-1+2+NCODE+2)
@@ -34,13 +53,16 @@
 */
 extern char BASEs[],AAs[];
 extern int noisy, NFunCall, NEigenQ, NPMatUVRoot, *ancestor, GeneticCode[][64];
+extern void (*MinimizationRound)(int round, double f);
 extern double *SeqDistance;
 extern double SS,NN,Sd,Nd; /* kostas, SS=# of syn. sites, NN=# of non-syn. sites, Sd=# of syn. subs., Nd=# of non-syn. subs. as defined in DistanceMatNG86 in treesub.c */
 
+int  DataSet (FILE *fseq, FILE *fpair[], int getdistance);
 int  Forestry (FILE *fout);
 int  GetMemPUVR(int nc, int nUVR);
 int  sortwM3(double x[]);
 void DetailOutput(FILE *fout, double x[], double var[]);
+void OutParameterFile(int itree, double x[], double lnL, double tl);
 int  GetOptions (char *ctlf);
 int  testx (double x[], int np);
 int  SetxBound (int np, double xb[][2]);
@@ -60,6 +82,7 @@ int  InitializeCodon (FILE *fout, double space[]);
 int  AA2Codonf (double faa[20], double fcodon[]);
 int  DistanceMatAA (FILE *fout);
 int  GetDaa(FILE *fout, double daa[]);
+static int DaaFileRead(void);
 void getpcodonClass(double x[], double pcodonClass[]);
 int  SelectionCoefficients (FILE* fout, double kappa[], double ppi[], double omega);
 int  eigenQcodon(int mode, double blength, double *S, double *dS, double *dN,
@@ -79,7 +102,19 @@ int  lfunNSsites_M2M8(FILE* frst, double x[], int np);
 int  lfunNSsites_AC(FILE* frst, double x[], int np);
 double GetBranchRate(int igene, int ibrate, double x[], int *ix);
 int  GetPMatBranch(double Pt[], double x[], double t, int inode);
+int  GetPMatBranches(double P[], double x[], int nt, double t[], int inode[]);
 int  ConditionalPNode(int inode, int igene, double x[]);
+int  GetPMatBranchThreadSafe(void);
+int  FunThreads(int nthreads);
+int  ConditionalPNodeSiteClasses(int inode, int igene, double x[]);
+void ConPCache(int on);
+int  lfunGradientOK(void);
+int  lfunGradient(double x[], double *f, double dx[], int np);
+#ifdef JDKLAB
+size_t SizeConPPart1(void);
+size_t SizeConPByCat(void);
+int  MemoryPlan(void);
+#endif
 double CDFdN_dS(double x,double par[]);
 int  DiscreteNSsites(double par[]);
 char GetAASiteSpecies(int species, int sitepatt);
@@ -112,10 +147,10 @@ double CDFLogis( double x, double m, double s );
 //end of kostas functions
 
 struct common_info {
-   unsigned char *z[NS];
-   char *spname[NS], seqf[512],outf[512],treef[512],daafile[512], cleandata;
+   unsigned char **z;         /* z[nsalloc], see AllocSeqs() */
+   char **spname, seqf[512],outf[512],treef[512],daafile[512],paramf[512], cleandata;
    char oldconP[NNODE];       /* update conP for nodes? to save computation */
-   int seqtype, ns, ls, ngene, posG[NGENE+1], lgene[NGENE], npatt,*pose, readpattern;
+   int seqtype, ns, nsalloc, ls, ngene, posG[NGENE+1], lgene[NGENE], npatt,*pose, readpattern;
    int runmode,clock, verbose,print, codonf,aaDist,model,NSsites;
    int nOmega, nbtype, nOmegaType;  /* branch partition, AA pair (w) partition */
    int method, icode, ncode, Mgene, ndata, bootstrap;
@@ -126,12 +161,19 @@ struct common_info {
    double pi[NCODE], piG[NGENE][64], fb61[64];
    double f3x4[NGENE][12], *pf3x4, piAA[20];
    double freqK[NCATG], rK[NCATG], MK[NCATG*NCATG],daa[20*20], *conP, *fhK;
+   int numOfThreads;  /* threads for the likelihood calculation and the JDKLAB code */
    #ifdef JDKLAB
       int *selectedBranchPairs;
-      int numOfThreads, numOfSelectedBranchPairs, excludeTipTips;
-      double *conP0, *conP_part1, *conP_byCat, *conP_prior, *entropy;
+      int numOfSelectedBranchPairs, excludeTipTips;
+      double *conP0, *conP_part1, *conP_byCat;
+      double memoryBudget;  /* MB, 0 for no limit, see MemoryPlan() */
+      int blockSites;       /* sites per block in the convergence scan */
       char htmlFileName[512];
       char dtreef[512];
+      char genef[512];      /* list of alignments for a batch run, see BatchGenes() */
+      int nullReplicates, nullSeed;  /* see NullReplicates() */
+      char stagef[512];     /* stage times, see StageTimes() */
+      int profile;          /* run-profile.json, see ProfileOut() */
       int userDivDist;
    #endif
    double (*plfun)(double x[],int np);
@@ -139,6 +181,7 @@ struct common_info {
    double omega_fix;  /* fix the last w in the NSbranchB, NSbranch2 models 
           for lineages.  Useful for testing whether w>1 for some lineages. */
    int     conPSiteClass; /* conPSiteClass=0 if (method==0) and =1 if (method==1)?? */
+   int     conPSiteClassPar; /* =1 if fx_r() runs the rate classes in parallel, with separate conP */
    int     NnodeScale;
    char   *nodeScale;        /* nScale[ns-1] for interior nodes */
    double *nodeScaleF;       /* nScaleF[npatt] for scale factors */
@@ -155,7 +198,7 @@ struct TREEN {
    double branch, age, omega, *conP, label;
    double divDistance;
    #ifdef JDKLAB
-      double *conP_part1, *conP_byCat, *conP_prior, *entropy;
+      double *conP_part1, *conP_byCat;
       int nodeID;
       char *name;
    #endif
@@ -192,6 +235,11 @@ struct DATA { /* locus-specific data and tree information */
 }  data;
 
 extern double Small_Diff;
+extern int AlwaysCenter;
+extern int LazyAddition;
+extern int NFunProcesses;
+extern int (*FunProcessThreads)(int nthreads);
+extern int *DfunXmark;
 int Nsensecodon, FROM61[64], FROM64[64], FourFold[4][4];
 int ChangedInIteration;  /* 1: t changed, update P(t); 2: paras changed, update UVRoot */
 double *PMat, *U, *V, *Root, *_UU[NBTYPE+2], *_VV[NBTYPE+2], *_Root[NBTYPE+2];
@@ -245,12 +293,20 @@ int maxNSsitesModels=27;
 enum {FIT1=11, FIT2=12} SiteClassModels;
 enum {AAClasses=7 } aaDistModels;
 char *clockstr[]={"", "Global clock", "Local clock", "ClockCombined"};
+char *seqtypestr[3]={"CODONML", "AAML", "CODON2AAML"};
+char *Mgenestr[]={"diff. rate", "separate data", "diff. rate & pi", 
+                  "diff. rate & k&w", "diff. rate & pi & k&w"};
 enum {GlobalClock=1, LocalClock, ClockCombined} ClockModels;
 
 #define CODEML 1
 #include "treesub.c"
 #include "treespace.c"
 
+#ifdef JDKLAB
+int  BatchGenes (void);
+int  NullReplicates (double x[]);
+#endif
+
 
 /* variables for batch run of site models */
 int ncatG0=10, insmodel=0, nnsmodels=1, nsmodels[15]={0};
@@ -264,17 +320,14 @@ int main (int argc, char *argv[])
    char pairfs[6][32]={"2NG.dS","2NG.dN","2NG.t", "2ML.dS","2ML.dN","2ML.t"};
 
 #ifdef JDKLAB
-   char ctlf[96]="grand-conv.ctl", *pmodel, timestr[64];
+   char ctlf[96]="grand-conv.ctl";
 #endif
 
 #ifndef JDKLAB
-   char ctlf[96]="codeml.ctl", *pmodel, timestr[64];
+   char ctlf[96]="codeml.ctl";
 #endif
    
-   char *seqtypestr[3]={"CODONML", "AAML", "CODON2AAML"};
-   char *Mgenestr[]={"diff. rate", "separate data", "diff. rate & pi", 
-                     "diff. rate & k&w", "diff. rate & pi & k&w"};
-   int getdistance=1, i, k, s2=0, idata, nc, nUVR, cleandata0;
+   int getdistance=1, i, k, idata, nc, nUVR, cleandata0;
 
 
 #ifdef NSSITESBandits
@@ -298,7 +351,7 @@ scanf("%d", &KGaussLegendreRule);
    com.fix_alpha=1;   com.alpha=0.;   com.ncatG=4;   /* alpha=0 := inf */
    com.fix_rho=1;     com.rho=0.;
    com.getSE=0;       com.print=0;    com.verbose=1;  com.fix_blength=0;
-   com.method=0;      com.space=NULL;
+   com.method=0;      com.space=NULL;   com.numOfThreads=1;
 
    frub=gfopen("rub","w");
 	frst=gfopen("rst","w");
@@ -333,6 +386,13 @@ scanf("%d", &KGaussLegendreRule);
 
 
    GetOptions(ctlf);
+#ifdef JDKLAB
+   if(com.genef[0])
+      BatchGenes();   /* returns only in the process for each gene */
+   if(com.profile) ProfileBegin();
+#endif
+   NFunProcesses = com.numOfThreads;  /* finite differences in ming2() */
+   FunProcessThreads = FunThreads;
    cleandata0 = com.cleandata;
    if(com.runmode!=-2 && com.runmode!=-3) 
       finitials=fopen("in.codeml","r");
@@ -416,219 +476,8 @@ scanf("%d", &KGaussLegendreRule);
 
       com.cleandata = cleandata0;
 
-      /* ReadSeq may change seqtype*/
-      ReadSeq((com.verbose?fout:NULL), fseq, com.cleandata, 0);
-      SetMapAmbiguity();
-      
-      /* AllPatterns(fout); */
-
-      fprintf(frst1,"\t%d\t%d\t%d", com.ns, com.ls, com.npatt); 
-
-      if (com.ngene==1) 
-         com.Mgene = 0;
-      if(com.ngene>1) {
-         if(com.seqtype==1 && com.npi)
-            error2("codon models (estFreq) not implemented for ngene > 1");
-         if(com.runmode==-2 && com.Mgene!=1) error2("use Mgene=1 for runmode=-2?");
-         if(com.runmode==-3 && com.Mgene!=1) error2("use Mgene=1 for runmode=-3?");
-         if(com.model) error2("NSbranchsites with ngene.");
-         if(com.NSsites) error2("NSsites with ngene.");
-         if(com.aaDist>=FIT1)  /* because of pcodon0[] */
-            { error2("ngene for amino acid fitness models"); }
-      }
-
-      if(com.ndata==1) fclose(fseq);
-
-      i = (com.ns*2-1)*sizeof(struct TREEN);
-      if((nodes=(struct TREEN*)malloc(i))==NULL) error2("oom nodes");
-
-      pmodel=(com.seqtype==CODONseq?NSbranchmodels[com.model]:aamodels[com.model]);
-      fprintf(fout,"%s (in %s)  %s\n",seqtypestr[com.seqtype-1], pamlVerStr, com.seqf);
-      fprintf(fout,"Model: %s for branches, ", pmodel);
-      if(com.clock) fprintf(fout," %s ",clockstr[com.clock]);
-      if(com.seqtype==CODONseq||com.model==FromCodon) {
-         if(com.fix_kappa) fprintf(fout, " kappa = %.3f fixed\n", com.kappa);
-         if(com.fix_omega) fprintf(fout, " omega = %.3f fixed\n", com.omega);
-      }
-      if(com.seqtype==AAseq && (com.model==Empirical||com.model==Empirical_F))
-         fprintf (fout, " (%s) ", com.daafile);
-      if(com.seqtype==AAseq&&com.nrate) fprintf(fout,"(nrate:%d) ", com.nrate);
-      if(com.alpha && com.rho) fprintf (fout, "Auto-");
-      if(com.alpha) fprintf (fout, "dGamma (ncatG=%d) ", com.ncatG);
-      if(com.ngene>1)
-         fprintf (fout, " (%d genes: %s)  ", com.ngene, Mgenestr[com.Mgene]);
-
-      if(com.alpha==0)  com.nalpha=0;
-      else              com.nalpha=(com.nalpha?com.ngene:!com.fix_alpha);
-      if(com.Mgene==1) com.nalpha=!com.fix_alpha;
-      if(com.nalpha>1 && (!com.alpha || com.ngene==1 || com.fix_alpha))
-         error2("Malpha");
-      if(com.nalpha>1 && com.rho) error2("Malpha or rho");
-      if(com.nalpha>1) fprintf (fout,"(%d gamma)", com.nalpha);
-     
-      if(com.Mgene && com.ngene==1) error2("Mgene for one gene.");
-      if(com.seqtype==CODONseq) {
-         fprintf (fout, "\nCodon frequency model: %s\n", codonfreqs[com.codonf]);
-         if(com.alpha) 
-            fputs("Warning: Gamma model for codons.  See documentation.",fout);
-      }
-      if((com.seqtype==CODONseq||com.model==FromCodon) 
-         && (com.aaDist && com.aaDist<10 && com.aaDist!=AAClasses))
-         fprintf(fout,"%s, %s\n",com.daafile,(com.aaDist>0?"geometric":"linear"));
-
-      if(com.NSsites) {
-         fprintf(fout,"Site-class models: ");
-         if (nnsmodels==1) {
-            fprintf(fout," %s",NSsitesmodels[com.NSsites]);
-            if(com.NSsites>=NSdiscrete)fprintf(fout," (%d categories)",com.ncatG);
-         }
-         if(com.nparK) fprintf(fout," & HMM");
-         FPN(fout);
-         if(com.aaDist)
-            fprintf(fout,"\nFitness models: aaDist: %d\n",com.aaDist);
-      }
-      fprintf(fout,"ns = %3d  ls = %3d\n\n", com.ns, com.ls);
-
-      com.sspace = max2(5000000,3*com.ncode*com.ncode*sizeof(double));
-      if(com.NSsites) {
-         if(com.sspace < 2*com.ncode*com.ncode+4*com.npatt*sizeof(double))
-            com.sspace = 2*com.ncode*com.ncode+4*com.npatt*sizeof(double);
-      }
-      k = com.ns*(com.ns-1)/2;
-/*
-      com.sspace=max2(com.sspace,
-        (int)sizeof(double)*((com.ns*2-2)*(com.ns*2-2+4+k)+k));
-*/
-      if((com.space = (double*)realloc(com.space,com.sspace))==NULL) {
-         printf("\nfailed to get %9lu bytes for space", com.sspace);
-         error2("oom space");
-      }
-      if(getdistance) {
-         SeqDistance=(double*)realloc(SeqDistance, k*sizeof(double));
-         ancestor=(int*)realloc(ancestor, k*sizeof(int));
-         if(SeqDistance==NULL||ancestor==NULL) error2("oom distance&ancestor");
-         for(i=0; i<k; i++) SeqDistance[i] = -1;
-      }
-      if(com.seqtype==AAseq) {
-         InitializeBaseAA (fout);
-         if (com.model==FromCodon /* ||com.aaDist==AAClasses */)
-            AA2Codonf(com.pi, com.fb61);  /* get codon freqs from aa freqs */ 
-      }
-      else {  /* codon sequences */
-         if(com.sspace < max2(com.ngene+1,com.ns)*(64+12+4)*sizeof(double)) {
-            com.sspace = max2(com.ngene+1,com.ns)*(64+12+4)*sizeof(double);
-            if((com.space = (double*)realloc(com.space,com.sspace))==NULL)
-               error2("oom space for #c");
-         }
-         if (InitializeCodon(fout,com.space))
-            error2("giving up on stop codons");
-
-         if(com.Mgene==3)
-            for(i=0; i<com.ngene; i++)
-               xtoy(com.pi,com.piG[i],com.ncode);
-      }
-
-      if(getdistance) {
-         if(com.seqtype==CODONseq)
-            DistanceMatNG86(fout,fpair[0],fpair[1],fpair[2],0);
-         else
-            DistanceMatAA(fout);
-      }
-      fflush(fout);
+      DataSet(fseq, fpair, getdistance);
 
-      if(com.seqtype==AAseq && com.model==Poisson && !com.print) 
-         PatternWeightJC69like(fout);
-      if(com.alpha || com.NSsites) {
-         s2=com.npatt*com.ncatG*sizeof(double);
-         if((com.fhK=(double*)realloc(com.fhK,s2))==NULL) error2("oom fhK");
-      }
-
-
-/********/
-/*
-npositive += SlidingWindow(fout, fpair, com.space); 
-FPN(frst1); fflush(frst1);  
-continue;
-*/
-
-      if((com.runmode==-2 || com.runmode==-3) && com.Mgene!=1) {
-         if(com.seqtype==CODONseq) 
-            PairwiseCodon(fout,fpair[3],fpair[4],fpair[5],com.space);  
-         else
-            PairwiseAA(fout, fpair[0]);  
-      }
-      else {
-         com.sconP = 2L *com.ncode*com.npatt*sizeof(double);
-         /* to be increased later in GetInitials() */
-         /* com.sconP = (com.ns-1)*com.ncode*com.npatt*sizeof(double); */
-         com.conP = (double*)realloc(com.conP, com.sconP);
-
-         #ifdef JDKLAB
-            com.conP_part1 = (double*)malloc( (com.ns*2-1) * (com.ncode*com.ncode*(com.readpattern?com.npatt:com.ls)) * sizeof(double) ); 
-            com.conP_prior = (double*)malloc( (com.ns*2-1) * (com.ncode*com.ncode*(com.readpattern?com.npatt:com.ls)) * sizeof(double) ); 
-            com.conP_byCat = (double*)malloc(com.ncatG * (com.ns*2-1) * (com.ncode*com.ncode*(com.readpattern?com.npatt:com.ls)) * sizeof(double) ); 
-            com.entropy    = (double*)malloc( (com.sconP * sizeof(double) ));
-         #endif
-
-         //printf("\n%9u bytes for distance",com.ns*(com.ns-1)/2*sizeof(double));
-         //printf("\n%9u bytes for conP\n", com.sconP);
-         //printf ("%9z bytes for fhK\n%9z bytes for space\n", s2, com.sspace);
-         if(com.conP==NULL)
-            error2("oom conP");
-
-         if (nnsmodels>1) {
-            for(insmodel=0; insmodel<nnsmodels; insmodel++) {
-               com.NSsites = nsmodels[insmodel];
-               if(com.NSsites<=NSpselection) 
-                  com.ncatG = com.NSsites+1;
-               else if(com.NSsites==NSM2aRel || com.NSsites==NSdiscrete)
-                  com.ncatG = 3;
-               else if (com.NSsites==NSfreqs)
-                  com.ncatG=5;
-               else if (com.NSsites==NSbetaw||com.NSsites==NS02normal) 
-                  com.ncatG = ncatG0 + 1;
-               else
-                  com.ncatG = ncatG0;
-               if(com.NSsites==NSTgamma  || com.NSsites==NSTinvgamma)
-                  com.ncatG=KGaussLegendreRule;
-               if(com.NSsites==NSTgamma1 || com.NSsites==NSTinvgamma1)
-                  com.ncatG=KGaussLegendreRule+1;
-
-               com.nrate = com.nkappa=(com.hkyREV?5:!com.fix_kappa);
-               if(com.NSsites==0 || com.NSsites==NSbetaw)  com.nrate += !com.fix_omega;
-               else if(com.NSsites==NSnneutral)            com.nrate ++;
-               else if(com.NSsites==NSpselection || com.NSsites==NSM2aRel)
-                  com.nrate += 1+!com.fix_omega;
-               else if(com.NSsites==NSdiscrete)
-                  com.nrate += com.ncatG;
-
-               printf("\n\nModel %d: %s\n",com.NSsites, NSsitesmodels[com.NSsites]);
-               fprintf(fout,"\n\nModel %d: %s",com.NSsites,NSsitesmodels[com.NSsites]);
-               fprintf(frst,"\n\nModel %d: %s",com.NSsites,NSsitesmodels[com.NSsites]);
-               fprintf(frub,"\n\nModel %d: %s",com.NSsites,NSsitesmodels[com.NSsites]);
-               if(com.NSsites) fprintf(fout," (%d categories)",com.ncatG);
-               FPN(fout);
-
-#ifdef NSSITESBandits
-               com.fix_blength = (com.NSsites>0 ? 2 : 1);
-               if(com.NSsites>0) strcpy(com.treef,"M0tree");
-#endif
-               
-               Forestry(fout);
-               printf("\nTime used: %s\n", printtime(timestr));
-               fprintf(fout,"\nTime used: %s\n", printtime(timestr));
-            }
-         }
-         else {
-            if (com.Mgene==1)        MultipleGenes(fout, fpair, com.space);
-            else if (com.runmode==0) Forestry(fout);
-            else if (com.runmode==3) StepwiseAddition(fout, com.space);
-            else if (com.runmode>=4) Perturbation(fout,(com.runmode==4),com.space);
-            else                     StarDecomposition(fout, com.space);
-            printf("\nTime used: %s\n", printtime(timestr));
-            fprintf(fout,"\nTime used: %s\n", printtime(timestr));
-         }
-      }
       FPN(frst);  fflush(frst);  
       FPN(frst1); fflush(frst1);
       free(nodes);
@@ -655,11 +504,745 @@ fprintf(frst1, " false positive: %6d\n", npositive);
    FreeMemPUVR();
    free(com.pose);
    for(i=0; i<com.ns; i++) free(com.z[i]);
+#ifdef JDKLAB
+   if(com.stagef[0]) StageTimes(com.stagef);
+   if(com.profile) ProfileOut("run-profile.json");
+#endif
 
    return (0);
 }
 
 
+int DataSet (FILE *fseq, FILE *fpair[], int getdistance)
+{
+/* This reads one data set from fseq and analyses it, as set up by main() and 
+   the control file.  fpair[] are the files for pairwise distances.
+*/
+   char *pmodel, timestr[64];
+   int i, k, s2=0;
+
+   /* ReadSeq may change seqtype*/
+#ifdef JDKLAB
+   StageBegin(StageInput);
+#endif
+   ReadSeq((com.verbose?fout:NULL), fseq, com.cleandata, 0);
+#ifdef JDKLAB
+   StageEnd(StageInput);
+#endif
+   SetMapAmbiguity();
+   
+   /* AllPatterns(fout); */
+
+   fprintf(frst1,"\t%d\t%d\t%d", com.ns, com.ls, com.npatt); 
+
+   if (com.ngene==1) 
+      com.Mgene = 0;
+   if(com.ngene>1) {
+      if(com.seqtype==1 && com.npi)
+         error2("codon models (estFreq) not implemented for ngene > 1");
+      if(com.runmode==-2 && com.Mgene!=1) error2("use Mgene=1 for runmode=-2?");
+      if(com.runmode==-3 && com.Mgene!=1) error2("use Mgene=1 for runmode=-3?");
+      if(com.seqtype==CODONseq && com.model) error2("NSbranchsites with ngene.");
+      if(com.NSsites) error2("NSsites with ngene.");
+      if(com.aaDist>=FIT1)  /* because of pcodon0[] */
+         { error2("ngene for amino acid fitness models"); }
+   }
+
+   if(com.ndata==1) fclose(fseq);
+
+   i = (com.ns*2-1)*sizeof(struct TREEN);
+   if((nodes=(struct TREEN*)malloc(i))==NULL) error2("oom nodes");
+
+   pmodel=(com.seqtype==CODONseq?NSbranchmodels[com.model]:aamodels[com.model]);
+   fprintf(fout,"%s (in %s)  %s\n",seqtypestr[com.seqtype-1], pamlVerStr, com.seqf);
+   fprintf(fout,"Model: %s for branches, ", pmodel);
+   if(com.clock) fprintf(fout," %s ",clockstr[com.clock]);
+   if(com.seqtype==CODONseq||com.model==FromCodon) {
+      if(com.fix_kappa) fprintf(fout, " kappa = %.3f fixed\n", com.kappa);
+      if(com.fix_omega) fprintf(fout, " omega = %.3f fixed\n", com.omega);
+   }
+   if(com.seqtype==AAseq && (com.model==Empirical||com.model==Empirical_F))
+      fprintf (fout, " (%s) ", com.daafile);
+   if(com.seqtype==AAseq&&com.nrate) fprintf(fout,"(nrate:%d) ", com.nrate);
+   if(com.alpha && com.rho) fprintf (fout, "Auto-");
+   if(com.alpha) fprintf (fout, "dGamma (ncatG=%d) ", com.ncatG);
+   if(com.ngene>1)
+      fprintf (fout, " (%d genes: %s)  ", com.ngene, Mgenestr[com.Mgene]);
+
+   if(com.alpha==0)  com.nalpha=0;
+   else              com.nalpha=(com.nalpha?com.ngene:!com.fix_alpha);
+   if(com.Mgene==1) com.nalpha=!com.fix_alpha;
+   if(com.nalpha>1 && (!com.alpha || com.ngene==1 || com.fix_alpha))
+      error2("Malpha");
+   if(com.nalpha>1 && com.rho) error2("Malpha or rho");
+   if(com.nalpha>1) fprintf (fout,"(%d gamma)", com.nalpha);
+  
+   if(com.Mgene && com.ngene==1) error2("Mgene for one gene.");
+   if(com.seqtype==CODONseq) {
+      fprintf (fout, "\nCodon frequency model: %s\n", codonfreqs[com.codonf]);
+      if(com.alpha) 
+         fputs("Warning: Gamma model for codons.  See documentation.",fout);
+   }
+   if((com.seqtype==CODONseq||com.model==FromCodon) 
+      && (com.aaDist && com.aaDist<10 && com.aaDist!=AAClasses))
+      fprintf(fout,"%s, %s\n",com.daafile,(com.aaDist>0?"geometric":"linear"));
+
+   if(com.NSsites) {
+      fprintf(fout,"Site-class models: ");
+      if (nnsmodels==1) {
+         fprintf(fout," %s",NSsitesmodels[com.NSsites]);
+         if(com.NSsites>=NSdiscrete)fprintf(fout," (%d categories)",com.ncatG);
+      }
+      if(com.nparK) fprintf(fout," & HMM");
+      FPN(fout);
+      if(com.aaDist)
+         fprintf(fout,"\nFitness models: aaDist: %d\n",com.aaDist);
+   }
+   fprintf(fout,"ns = %3d  ls = %3d\n\n", com.ns, com.ls);
+
+   com.sspace = max2(5000000,3*com.ncode*com.ncode*sizeof(double));
+   if(com.NSsites) {
+      if(com.sspace < 2*com.ncode*com.ncode+4*com.npatt*sizeof(double))
+         com.sspace = 2*com.ncode*com.ncode+4*com.npatt*sizeof(double);
+   }
+   k = com.ns*(com.ns-1)/2;
+/*
+   com.sspace=max2(com.sspace,
+     (int)sizeof(double)*((com.ns*2-2)*(com.ns*2-2+4+k)+k));
+*/
+   if((com.space = (double*)realloc(com.space,com.sspace))==NULL) {
+      printf("\nfailed to get %9lu bytes for space", com.sspace);
+      error2("oom space");
+   }
+   if(getdistance) {
+      SeqDistance=(double*)realloc(SeqDistance, k*sizeof(double));
+      ancestor=(int*)realloc(ancestor, k*sizeof(int));
+      if(SeqDistance==NULL||ancestor==NULL) error2("oom distance&ancestor");
+      for(i=0; i<k; i++) SeqDistance[i] = -1;
+   }
+   if(com.seqtype==AAseq) {
+      InitializeBaseAA (fout);
+      if (com.model==FromCodon /* ||com.aaDist==AAClasses */)
+         AA2Codonf(com.pi, com.fb61);  /* get codon freqs from aa freqs */ 
+   }
+   else {  /* codon sequences */
+      if(com.sspace < max2(com.ngene+1,com.ns)*(64+12+4)*sizeof(double)) {
+         com.sspace = max2(com.ngene+1,com.ns)*(64+12+4)*sizeof(double);
+         if((com.space = (double*)realloc(com.space,com.sspace))==NULL)
+            error2("oom space for #c");
+      }
+      if (InitializeCodon(fout,com.space))
+         error2("giving up on stop codons");
+
+      if(com.Mgene==3)
+         for(i=0; i<com.ngene; i++)
+            xtoy(com.pi,com.piG[i],com.ncode);
+   }
+
+   if(getdistance) {
+      if(com.seqtype==CODONseq)
+         DistanceMatNG86(fout,fpair[0],fpair[1],fpair[2],0);
+      else
+         DistanceMatAA(fout);
+   }
+   fflush(fout);
+
+   if(com.seqtype==AAseq && com.model==Poisson && !com.print) 
+      PatternWeightJC69like(fout);
+   if(com.alpha || com.NSsites) {
+      s2=com.npatt*com.ncatG*sizeof(double);
+      if((com.fhK=(double*)realloc(com.fhK,s2))==NULL) error2("oom fhK");
+   }
+
+
+/********/
+/*
+npositive += SlidingWindow(fout, fpair, com.space); 
+FPN(frst1); fflush(frst1);  
+continue;
+*/
+
+   if((com.runmode==-2 || com.runmode==-3) && com.Mgene!=1) {
+      if(com.seqtype==CODONseq) 
+         PairwiseCodon(fout,fpair[3],fpair[4],fpair[5],com.space);  
+      else
+         PairwiseAA(fout, fpair[0]);  
+   }
+   else {
+      com.sconP = 2L *com.ncode*com.npatt*sizeof(double);
+      /* to be increased later in GetInitials() */
+      /* com.sconP = (com.ns-1)*com.ncode*com.npatt*sizeof(double); */
+      com.conP = (double*)realloc(com.conP, com.sconP);
+
+      //printf("\n%9u bytes for distance",com.ns*(com.ns-1)/2*sizeof(double));
+      //printf("\n%9u bytes for conP\n", com.sconP);
+      //printf ("%9z bytes for fhK\n%9z bytes for space\n", s2, com.sspace);
+      if(com.conP==NULL)
+         error2("oom conP");
+
+      if (nnsmodels>1) {
+         for(insmodel=0; insmodel<nnsmodels; insmodel++) {
+            com.NSsites = nsmodels[insmodel];
+            if(com.NSsites<=NSpselection) 
+               com.ncatG = com.NSsites+1;
+            else if(com.NSsites==NSM2aRel || com.NSsites==NSdiscrete)
+               com.ncatG = 3;
+            else if (com.NSsites==NSfreqs)
+               com.ncatG=5;
+            else if (com.NSsites==NSbetaw||com.NSsites==NS02normal) 
+               com.ncatG = ncatG0 + 1;
+            else
+               com.ncatG = ncatG0;
+            if(com.NSsites==NSTgamma  || com.NSsites==NSTinvgamma)
+               com.ncatG=KGaussLegendreRule;
+            if(com.NSsites==NSTgamma1 || com.NSsites==NSTinvgamma1)
+               com.ncatG=KGaussLegendreRule+1;
+
+            com.nrate = com.nkappa=(com.hkyREV?5:!com.fix_kappa);
+            if(com.NSsites==0 || com.NSsites==NSbetaw)  com.nrate += !com.fix_omega;
+            else if(com.NSsites==NSnneutral)            com.nrate ++;
+            else if(com.NSsites==NSpselection || com.NSsites==NSM2aRel)
+               com.nrate += 1+!com.fix_omega;
+            else if(com.NSsites==NSdiscrete)
+               com.nrate += com.ncatG;
+
+            printf("\n\nModel %d: %s\n",com.NSsites, NSsitesmodels[com.NSsites]);
+            fprintf(fout,"\n\nModel %d: %s",com.NSsites,NSsitesmodels[com.NSsites]);
+            fprintf(frst,"\n\nModel %d: %s",com.NSsites,NSsitesmodels[com.NSsites]);
+            fprintf(frub,"\n\nModel %d: %s",com.NSsites,NSsitesmodels[com.NSsites]);
+            if(com.NSsites) fprintf(fout," (%d categories)",com.ncatG);
+            FPN(fout);
+
+#ifdef NSSITESBandits
+            com.fix_blength = (com.NSsites>0 ? 2 : 1);
+            if(com.NSsites>0) strcpy(com.treef,"M0tree");
+#endif
+            
+            Forestry(fout);
+            printf("\nTime used: %s\n", printtime(timestr));
+            fprintf(fout,"\nTime used: %s\n", printtime(timestr));
+         }
+      }
+      else {
+         if (com.Mgene==1)        MultipleGenes(fout, fpair, com.space);
+         else if (com.runmode==0) Forestry(fout);
+         else if (com.runmode==3) StepwiseAddition(fout, com.space);
+         else if (com.runmode>=4) Perturbation(fout,(com.runmode==4),com.space);
+         else                     StarDecomposition(fout, com.space);
+         if(noisy>=2)
+            printf("\ncache hits %lu/%lu eigen %lu/%lu P(t)", eigenCache.hit, eigenCache.hit+eigenCache.miss,
+               pmatCache.hit, pmatCache.hit+pmatCache.miss);
+         printf("\nTime used: %s\n", printtime(timestr));
+         fprintf(fout,"\nTime used: %s\n", printtime(timestr));
+      }
+   }
+   return(0);
+}
+
+#ifdef JDKLAB
+
+/* Batch of genes.
+   With genelist = <file> in the control file, grand-conv analyses each of the 
+   alignments listed in the file, one per line, with an optional name for the 
+   gene after the file name (the default is the file name without directory 
+   and extension).  Each gene is analysed in a directory of its own named after 
+   it, using the options, the tree file and the branch pairs in the control 
+   file, in a forked process that inherits them and the amino acid rate matrix 
+   from this one, so these are read once.  Up to numOfThreads genes run at the 
+   same time, the largest first, and the branch totals for each gene are added 
+   to batch-branch-totals.out as it finishes.
+*/
+struct BATCHGENE {
+   char seqf[512], name[96];
+   double cost;
+};
+
+struct BATCHRUN {       /* the genes, as they finish */
+   struct BATCHGENE *genes;
+   FILE *fall;
+   int ngene, ndone, nfail;
+};
+
+static int BatchGeneCompare (const void *a, const void *b)
+{
+   double d = ((struct BATCHGENE*)b)->cost - ((struct BATCHGENE*)a)->cost;
+   return (d>0 ? 1 : (d<0 ? -1 : 0));
+}
+
+static int BatchGeneNameCompare (const void *a, const void *b)
+{
+   return strcmp(((struct BATCHGENE*)a)->name, ((struct BATCHGENE*)b)->name);
+}
+
+static void BatchPath (char *path, char *dir)
+{
+/* This puts dir in front of a relative path, so that the file is still found 
+   from the directory for the gene.
+*/
+   char s[1024];
+
+   if(path[0]=='\0' || path[0]=='/') return;
+   snprintf(s, 1024, "%s/%s", dir, path);
+   if(strlen(s)>=512) error2("path too long in BatchPath");
+   strcpy(path, s);
+}
+
+static void BatchBaseName (char *path)
+{
+/* This strips the directory from path, for the output files, which go into 
+   the directory for the gene.
+*/
+   char *p=strrchr(path, '/');
+
+   if(p) memmove(path, p+1, strlen(p+1)+1);
+}
+
+static double BatchGeneCost (char *seqf)
+{
+/* This predicts the cost of analysing seqf from ns and ls in the header.  The 
+   likelihood goes as ns*ls, and the convergence scan, which has ns^2 branch 
+   pairs, as ns*ns*ls.  Only the order matters, for scheduling.
+*/
+   FILE *f=fopen(seqf, "r");
+   int ns=0, ls=0;
+
+   if(f==NULL) return(0);
+   if(fscanf(f, "%d%d", &ns, &ls)!=2) ns = ls = 0;
+   fclose(f);
+   return((double)ns*ns*ls);
+}
+
+static void BatchBranchTotals (FILE *fall, char *name)
+{
+/* This adds the branch totals for the gene to the combined file, with the 
+   name of the gene in the first column.
+*/
+   char file[1024], line[1024];
+   FILE *f;
+   int header=1;
+
+   snprintf(file, 1024, "%s/branch-totals.out", name);
+   if((f=fopen(file, "r"))==NULL) return;
+   while(fgets(line, 1024, f)) {
+      if(header) { header=0;  continue; }
+      fprintf(fall, "%s\t%s", name, line);
+   }
+   fclose(f);
+   fflush(fall);
+}
+
+static void BatchGeneDone (int i, int ok, void *data)
+{
+/* This is called by ForkJobs() when gene i has finished.
+*/
+   struct BATCHRUN *b=(struct BATCHRUN*)data;
+   char *name=b->genes[i].name;
+
+   b->ndone++;
+   if(ok) {
+      BatchBranchTotals(b->fall, name);
+      printf("%6d/%d  %s\n", b->ndone, b->ngene, name);
+   }
+   else {
+      b->nfail++;
+      printf("%6d/%d  %s failed, see %s/screen.out\n", b->ndone, b->ngene, name, name);
+   }
+   fflush(stdout);
+}
+
+int BatchGenes (void)
+{
+/* This reads the list of genes in com.genef and runs them in forked processes.
+   It returns 0 in each forked process, after moving to the directory for the 
+   gene and setting com.seqf, and main() then does the analysis as for one 
+   gene.  This process waits for them and exits.
+*/
+   struct BATCHGENE *genes=NULL;
+   struct BATCHRUN run;
+   FILE *fgenes=gfopen(com.genef, "r"), *f;
+   char line[1024], file[512], name[96], cwd[512], *p;
+   int ngene=0, nalloc=0, i, nproc, nthreads;
+
+   if(com.ndata>1) error2("ndata > 1 with genelist");
+   while(fgets(line, 1024, fgenes)) {
+      if((p=strpbrk(line, "*#"))) *p = '\0';
+      name[0] = '\0';
+      if(sscanf(line, "%511s%95s", file, name)<1) continue;
+      if(ngene==nalloc) {
+         nalloc = max2(nalloc*2, 64);
+         genes = (struct BATCHGENE*)realloc(genes, nalloc*sizeof(struct BATCHGENE));
+         if(genes==NULL) error2("oom genes");
+      }
+      strcpy(genes[ngene].seqf, file);
+      if(name[0]=='\0') {
+         strncpy(name, ((p=strrchr(file,'/')) ? p+1 : file), 95);  name[95] = '\0';
+         if((p=strrchr(name, '.')) && p!=name) *p = '\0';
+      }
+      strcpy(genes[ngene].name, name);
+      genes[ngene].cost = BatchGeneCost(file);
+      ngene++;
+   }
+   fclose(fgenes);
+   if(ngene==0) error2("no genes in genelist");
+   qsort(genes, ngene, sizeof(struct BATCHGENE), BatchGeneNameCompare);
+   for(i=1; i<ngene; i++)   /* each gene has a directory of its own */
+      if(strcmp(genes[i].name, genes[i-1].name)==0) {
+         snprintf(line, 1024, "genes %s and %s in %s are both named %s; give each a name after the file", 
+            genes[i-1].seqf, genes[i].seqf, com.genef, genes[i].name);
+         error2(line);
+      }
+   qsort(genes, ngene, sizeof(struct BATCHGENE), BatchGeneCompare);
+
+   if(getcwd(cwd, 512)==NULL) error2("getcwd");
+   for(i=0; i<ngene; i++)
+      BatchPath(genes[i].seqf, cwd);
+   BatchPath(com.treef, cwd);
+   BatchPath(com.daafile, cwd);
+   BatchPath(com.dtreef, cwd);
+   BatchBaseName(com.outf);
+   BatchBaseName(com.paramf);
+   if((f=fopen(com.daafile, "r"))) {  /* read once, for all the genes */
+      fclose(f);
+      DaaFileRead();
+   }
+
+   nproc = min2(com.numOfThreads, ngene);
+   nthreads = max2(com.numOfThreads/nproc, 1);
+   printf("\n%d genes from %s, %d at a time with %d thread%s each\n", ngene, com.genef, 
+      nproc, nthreads, (nthreads>1 ? "s" : ""));
+   run.genes = genes;  run.ngene = ngene;  run.ndone = run.nfail = 0;
+   run.fall = gfopen("batch-branch-totals.out", "w");
+   fprintf(run.fall, "Gene\tBranch1\tBranch2\tE-Num-Diverge\tE-Num-Converge\n");
+
+   if((i=ForkJobs(ngene, nproc, BatchGeneDone, &run)) >= 0) {
+      mkdir(genes[i].name, 0755);
+      if(chdir(genes[i].name)) error2("chdir");
+      strcpy(com.seqf, genes[i].seqf);
+      com.numOfThreads = nthreads;
+      com.memoryBudget /= nproc;
+      freopen("screen.out", "w", stdout);
+      fclose(frub);   frub = gfopen("rub", "w");
+      fclose(frst);   frst = gfopen("rst", "w");
+      fclose(frst1);  frst1 = gfopen("rst1", "w");
+      free(genes);  fclose(run.fall);
+      return(0);
+   }
+
+   fclose(run.fall);
+   free(genes);
+   printf("\n%d genes done, %d failed.  Branch totals are in batch-branch-totals.out\n", 
+      ngene-run.nfail, run.nfail);
+   exit(run.nfail>0);
+}
+
+/* Null replicates.
+   With nullReplicates = N in the control file, N data sets are simulated 
+   after the convergence scan, under the fitted model: the tree and branch 
+   lengths, the substitution model, and the gamma rates or site classes.  
+   Convergence in these data sets arises only by chance.  The scan is then 
+   repeated on each data set, with the branch lengths, alpha, and (for M0) 
+   kappa and omega fixed at their estimates.  For each branch pair, the excess 
+   of convergent substitutions over the line fitted to convergent against 
+   divergent substitutions (as in the plot) is compared with its null 
+   distribution, which is accumulated as the replicates finish.  This gives 
+   an empirical p value in null-pvalues.out.  The data sets are simulated 
+   here, using the threads, and are analysed in forked processes, 
+   numOfThreads at a time, each in null/<replicate>.  The forked processes 
+   use one thread each, as the OpenMP runtime does not survive fork() once 
+   threads have been used.  Site h of replicate irep is drawn from its own 
+   stream (struct RNG) under nullSeed, so that the results do not depend on 
+   the number of processes or threads.
+*/
+
+static int NullSimulate (char *seqf, double x[], int irep)
+{
+/* This simulates com.ls sites down the tree, using P(t) from GetPMatBranches() 
+   for each site class, as in AncestralMarginal(), and writes them to seqf.  
+   Each site draws its class and then its states from stream (irep+1, h), and 
+   the sites in a class are simulated in parallel.  
+   Gaps and ambiguities in the data are copied to the same places in the 
+   simulated data, so that the two have the same amount of information.
+*/
+   int n=com.ncode, nnode=tree.nnode, ls=com.ls, K, ir, h, i, j, k, inode, s, hp;
+   int *order, *iNodes, *cls, *L;
+   unsigned char *z;
+   double *P, *t, *pic, *F, *freqK, one=1, r;
+   struct RNG rng;
+   char codon[4];
+   FILE *fseq;
+
+   K = ((com.alpha || com.NSsites) && com.ncatG>1 ? com.ncatG : 1);
+   freqK = (K>1 ? com.freqK : &one);
+   P = (double*)malloc(((size_t)nnode*(n*n+1)+n+K*4)*sizeof(double));
+   order = (int*)malloc((nnode*2+K+ls)*sizeof(int));
+   z = (unsigned char*)malloc((size_t)nnode*ls);
+   if(P==NULL || order==NULL || z==NULL) error2("oom NullSimulate");
+   t = P+(size_t)nnode*n*n;  pic = t+nnode;  F = pic+n;
+   iNodes = order+nnode;  L = iNodes+nnode;  cls = L+K;
+
+   for(i=0,order[0]=tree.root,k=1; i<k; i++)   /* fathers before sons */
+      for(j=0; j<nodes[order[i]].nson; j++)
+         order[k++] = nodes[order[i]].sons[j];
+   for(j=0,r=0; j<n; j++)
+      pic[j] = (r += com.pi[j]);
+   MultiNomialAliasSetTable(K, freqK, F, L, F+K);
+   for(h=0; h<ls; h++) {                       /* as MultiNomialAlias() */
+      RNGInit(&rng, com.nullSeed, ((unsigned long long)(irep+1)<<32) | h);
+      r = RNGUniform(&rng)*K;
+      k = (int)r;
+      cls[h] = (r-k<=F[k] ? k : L[k]);
+   }
+
+   for(ir=0; ir<K; ir++) {
+      if(K>1) SetPSiteClass(ir, x);
+      else    _rateSite = 1;
+      for(inode=0; inode<nnode; inode++) {
+         iNodes[inode] = inode;
+         t[inode] = (inode==tree.root ? 0 : nodes[inode].branch*_rateSite);
+         if(inode!=tree.root && com.clock && com.clock<5)
+            t[inode] *= GetBranchRate(0, (int)nodes[inode].label, x, NULL);
+      }
+      GetPMatBranches(P, x, nnode, t, iNodes);
+      for(i=0; i<nnode*n; i++)         /* cumulative rows */
+         for(j=1; j<n; j++)
+            P[i*n+j] += P[i*n+j-1];
+
+#ifdef _OPENMP
+      #pragma omp parallel for num_threads(com.numOfThreads) private(rng,r,j,k,inode,s) schedule(static)
+#endif
+      for(h=0; h<ls; h++) {
+         if(cls[h]!=ir) continue;
+         RNGInit(&rng, com.nullSeed, ((unsigned long long)(irep+1)<<32) | h);
+         RNGUniform(&rng);                     /* the class */
+         for(j=0,r=RNGUniform(&rng)*pic[n-1]; j<n-1 && r>pic[j]; j++) ;
+         z[tree.root*ls+h] = (unsigned char)j;
+         for(k=1; k<nnode; k++) {
+            inode = order[k];
+            s = z[nodes[inode].father*ls+h];
+            for(j=0,r=RNGUniform(&rng)*P[(inode*n+s)*n+n-1]; j<n-1 && r>P[(inode*n+s)*n+j]; j++) ;
+            z[inode*ls+h] = (unsigned char)j;
+         }
+      }
+   }
+
+   fseq = gfopen(seqf, "w");
+   fprintf(fseq, "%6d %6d\n", com.ns, ls*(com.seqtype==CODONseq ? 3 : 1));
+   for(i=0; i<com.ns; i++) {
+      fprintf(fseq, "%-*s  ", LSPNAME, com.spname[i]);
+      for(h=0; h<ls; h++) {
+         hp = (!com.readpattern ? com.pose[h] : h);
+         if(com.z[i][hp] >= n)
+            fputs((com.seqtype==CODONseq ? "---" : "-"), fseq);
+         else if(com.seqtype==CODONseq) 
+            fputs(getcodon(codon, FROM61[z[i*ls+h]]), fseq);
+         else
+            fputc(AAs[z[i*ls+h]], fseq);
+      }
+      FPN(fseq);
+   }
+   fclose(fseq);
+   free(P);  free(order);  free(z);
+   return(0);
+}
+
+static double *NullBranchTotals (char *file, int *npair, int **pairs)
+{
+/* This reads branch-totals.out, returning D[npair] and C[npair] (divergent 
+   and convergent) in one array, and the branch pairs in *pairs, or NULL if 
+   the file cannot be read.
+*/
+   FILE *f=fopen(file, "r");
+   char line[256];
+   int n=0, nalloc=1024, b1, b2;
+   double d, c, *DC, *DC1;
+
+   if(f==NULL) return(NULL);
+   DC = (double*)malloc(nalloc*2*sizeof(double));
+   *pairs = (int*)malloc(nalloc*2*sizeof(int));
+   if(DC==NULL || *pairs==NULL) error2("oom NullBranchTotals");
+   fgets(line, 256, f);
+   while(fgets(line, 256, f)) {
+      if(sscanf(line, "%d%d%lf%lf", &b1, &b2, &d, &c)!=4) continue;
+      if(n==nalloc) {
+         nalloc *= 2;
+         DC = (double*)realloc(DC, nalloc*2*sizeof(double));
+         *pairs = (int*)realloc(*pairs, nalloc*2*sizeof(int));
+         if(DC==NULL || *pairs==NULL) error2("oom NullBranchTotals");
+      }
+      DC[n*2] = d;  DC[n*2+1] = c;  (*pairs)[n*2] = b1;  (*pairs)[n*2+1] = b2;
+      n++;
+   }
+   fclose(f);
+   if((DC1=(double*)malloc(max2(n,1)*2*sizeof(double))) == NULL) error2("oom NullBranchTotals");
+   for(b1=0; b1<n; b1++) {   /* D[] and C[] */
+      DC1[b1] = DC[b1*2];
+      DC1[n+b1] = DC[b1*2+1];
+   }
+   free(DC);
+   *npair = n;
+   return(DC1);
+}
+
+static void NullReplicate (int irep, double x[], char *dir)
+{
+/* This is the forked process for replicate irep, in directory dir.  It 
+   analyses the simulated data set with the fitted parameters fixed, and then 
+   exits, leaving sim.phy and branch-totals.out.
+*/
+   FILE *fpair[6]={NULL};
+   DIR *d;
+   struct dirent *e;
+
+   if(chdir(dir)) error2("chdir");
+   freopen("screen.out", "w", stdout);
+
+   strcpy(com.seqf, "sim.phy");
+   com.fix_blength = 2;
+   if(com.alpha)  com.fix_alpha = 1;
+   com.nalpha = 0;
+   if(com.seqtype==CODONseq && com.NSsites==0 && com.model==0) {
+      com.fix_kappa = com.fix_omega = 1;
+   }
+   com.nullReplicates = com.paramf[0] = com.genef[0] = 0;
+   com.ndata = 1;
+   com.runmode = 0;
+   com.print = max2(com.print, 1);
+   BatchBaseName(com.outf);
+   if(finitials) { fclose(finitials);  finitials = NULL; }
+   fclose(fout);   fout = gfopen(com.outf, "w");
+   fclose(frub);   frub = gfopen("rub", "w");
+   fclose(frst);   frst = gfopen("rst", "w");
+   fclose(frst1);  frst1 = gfopen("rst1", "w");
+
+   DataSet(gfopen(com.seqf, "r"), fpair, 0);
+   fflush(NULL);
+
+   if((d=opendir(".")) != NULL) {   /* keep the data and the totals only */
+      while((e=readdir(d)) != NULL)
+         if(strcmp(e->d_name, "sim.phy") && strcmp(e->d_name, "branch-totals.out") 
+            && strcmp(e->d_name, "screen.out") && e->d_name[0]!='.')
+            remove(e->d_name);
+      closedir(d);
+   }
+   exit(0);
+}
+
+struct NULLSUM {       /* the null replicates, as they finish */
+   int npair, *pairs, nrep, nok, nfail, *count;
+   double *excess, *mean, *M2;
+};
+
+static void NullReplicateDone (int irep, int ok, void *data)
+{
+/* This is called by ForkJobs() when replicate irep has finished.  It counts 
+   the branch pairs for which the replicate has at least the excess in the 
+   data, and adds the excesses to the running means and sums of squares 
+   (Welford's update).
+*/
+   struct NULLSUM *s=(struct NULLSUM*)data;
+   char file[64];
+   int npair1, *pairs1, j;
+   double *DC1=NULL, k1, b1, d, delta;
+
+   snprintf(file, 64, "null/%d/branch-totals.out", irep+1);
+   if(ok)
+      DC1 = NullBranchTotals(file, &npair1, &pairs1);
+   if(DC1 && npair1==s->npair && memcmp(s->pairs, pairs1, s->npair*2*sizeof(int))==0) {
+      s->nok++;
+      calculateRegression(DC1, DC1+s->npair, s->npair, &k1, &b1);
+      for(j=0; j<s->npair; j++) {
+         d = DC1[s->npair+j] - (k1*DC1[j]+b1);
+         if(d >= s->excess[j]) s->count[j]++;
+         delta = d-s->mean[j];
+         s->mean[j] += delta/s->nok;
+         s->M2[j] += delta*(d-s->mean[j]);
+      }
+      printf("%6d/%d done\n", s->nok+s->nfail, s->nrep);
+   }
+   else {
+      s->nfail++;
+      printf("%6d/%d failed, see null/%d/screen.out\n", s->nok+s->nfail, s->nrep, irep+1);
+   }
+   if(DC1) { free(DC1);  free(pairs1); }
+   fflush(stdout);
+}
+
+int NullReplicates (double x[])
+{
+/* This runs com.nullReplicates null replicates after the scan of the data in 
+   Forestry(), and writes null-pvalues.out.  See the notes above.
+*/
+   FILE *f;
+   char cwd[512-32], dir[600], file[700], treef[512];  /* cwd leaves room for /null/fitted.tree */
+   int npair, *pairs, nrep=com.nullReplicates, nproc, i, j;
+   double *DC, k, b;
+   struct NULLSUM s;
+   struct RNG rng;
+
+   if(com.ngene>1 || com.Mgene)
+      error2("nullReplicates is not available with partitioned data (Mgene, G)");
+   if((DC=NullBranchTotals("branch-totals.out", &npair, &pairs))==NULL || npair<2) {
+      puts("\nnullReplicates: no branch-totals.out (RateAncestor = 2?), skipped.");
+      return(-1);
+   }
+   calculateRegression(DC, DC+npair, npair, &k, &b);
+   s.npair = npair;  s.pairs = pairs;  s.nrep = nrep;  s.nok = s.nfail = 0;
+   s.excess = (double*)malloc(npair*3*sizeof(double));
+   s.count = (int*)malloc(npair*sizeof(int));
+   if(s.excess==NULL || s.count==NULL) error2("oom NullReplicates");
+   s.mean = s.excess+npair;  s.M2 = s.mean+npair;
+   for(j=0; j<npair; j++) {
+      s.excess[j] = DC[npair+j] - (k*DC[j]+b);
+      s.count[j] = 0;  s.mean[j] = s.M2[j] = 0;
+   }
+
+   if(getcwd(cwd, sizeof(cwd))==NULL) error2("getcwd: path too long?");
+   mkdir("null", 0755);
+   strcpy(treef, com.treef);
+   snprintf(com.treef, 512, "%s/null/fitted.tree", cwd);
+   f = gfopen(com.treef, "w");
+   OutTreeN(f, 1, PrBranch|PrExact);  FPN(f);
+   fclose(f);
+   BatchPath(com.daafile, cwd);
+   BatchPath(com.dtreef, cwd);
+
+   if(RNGCheck())
+      error2("the random number generator fails its known-answer test");
+   if(com.nullSeed<=0) {   /* one seed from /dev/urandom for all replicates */
+      RNGInit(&rng, -1, 0);
+      com.nullSeed = (int)(rng.key[0] & 0x7fffffff) | 1;
+   }
+   printf("\nSimulating %d null replicates (nullSeed = %d)\n", nrep, com.nullSeed);
+   for(i=0; i<nrep; i++) {
+      snprintf(dir, 600, "null/%d", i+1);
+      mkdir(dir, 0755);
+      snprintf(file, 700, "%s/sim.phy", dir);
+      NullSimulate(file, x, i);
+   }
+   nproc = min2(com.numOfThreads, nrep);
+   printf("Analysing them, %d at a time\n", nproc);
+
+   if((i=ForkJobs(nrep, nproc, NullReplicateDone, &s)) >= 0) {
+      snprintf(dir, 600, "null/%d", i+1);
+      com.numOfThreads = 1;
+      com.memoryBudget /= nproc;
+      NullReplicate(i, x, dir);    /* does not return */
+   }
+
+   f = gfopen("null-pvalues.out", "w");
+   fprintf(f, "Branch1\tBranch2\tE-Num-Diverge\tE-Num-Converge\tExcess\tNullMean\tNullSD\tP-value\n");
+   for(j=0; j<npair; j++)
+      fprintf(f, "%d\t%d\t%f\t%f\t%f\t%f\t%f\t%f\n", pairs[j*2], pairs[j*2+1], DC[j], DC[npair+j], 
+         s.excess[j], s.mean[j], (s.nok>1 ? sqrt(s.M2[j]/(s.nok-1)) : 0), (1.+s.count[j])/(s.nok+1.));
+   fclose(f);
+   strcpy(com.treef, treef);
+   printf("\n%d null replicates done, %d failed.  P values are in null-pvalues.out\n", s.nok, s.nfail);
+   free(DC);  free(pairs);  free(s.excess);  free(s.count);
+   return(0);
+}
+
+#endif
+
 /* x[]: t[ntime]; rgene[ngene-1]; kappa; p[](NSsites); omega[]; 
         { alpha(for NSsites) !! alpha, rho || rK[], fK[] || rK[], MK[] }
 */
@@ -671,7 +1254,7 @@ int Forestry (FILE *fout)
    FILE *dtree;
    int  status=0, i,j=0,k, itree, ntree, np, iteration=1;
    int pauptree=0, haslength;
-   double x[NP],xb[NP][2], xcom[NP-NBRANCH], lnL=0,lnL0=0, e=1e-8, tl=0, nchange=-1;
+   double *x, (*xb)[2], *xcom, lnL=0,lnL0=0, e=1e-8, tl=0, nchange=-1;
    double *g=NULL, *H=NULL;
 #ifdef NSSITESBandits
    FILE *fM0tree;
@@ -682,6 +1265,9 @@ int Forestry (FILE *fout)
       exit(-1);
    }
    GetTreeFileType(ftree, &ntree, &pauptree, 0);
+   x = (double*)malloc((NP*4-NBRANCH)*sizeof(double));   /* x[NP], xb[NP][2], xcom[NP-NBRANCH] */
+   if(x==NULL) error2("oom Forestry");
+   xb = (double(*)[2])(x+NP);  xcom = x+NP*3;
    if (com.alpha)
       frate=(FILE*)gfopen(ratef,"w");
    if (ntree>10 && com.npatt>10000 && com.print) 
@@ -732,7 +1318,7 @@ int Forestry (FILE *fout)
                puts("\nBranch lengths in tree used as initials.");
             if(com.fix_blength==1) {
                FOR(i,tree.nnode) 
-                  if((x[nodes[i].ibranch]=nodes[i].branch)<0) 
+                  if(i!=tree.root && (x[nodes[i].ibranch]=nodes[i].branch)<0) 
                      x[nodes[i].ibranch]=1e-5;
             }
          }
@@ -763,6 +1349,9 @@ int Forestry (FILE *fout)
          }
       }
       printf("\nntime & nrate & np:%6d%6d%6d\n",com.ntime,com.nrate,com.np);
+#ifdef JDKLAB
+      MemoryPlan();
+#endif
 /*
       if(itree && !finitials)  for(i=0;i<np-com.ntime;i++) x[com.ntime+i] = xcom[i];
 */
@@ -783,12 +1372,21 @@ com.fpatt[i] /= (double)com.ls;
       }
 
       if(iteration && np) {
+#ifdef JDKLAB
+         StageBegin(StageFit);
+#endif
          if(com.method == 1)
             j = minB (noisy>2?frub:NULL, &lnL,x,xb, e, com.space);
          else if (com.method==3)
             j = minB2(noisy>2?frub:NULL, &lnL,x,xb, e, com.space);
-         else
-            j = ming2(noisy>2?frub:NULL,&lnL,com.plfun,NULL,x,xb, com.space,e,np);
+         else {
+            ConPCache(1);
+            j = ming2(noisy>2?frub:NULL,&lnL,com.plfun,(lfunGradientOK()?lfunGradient:NULL),x,xb, com.space,e,np);
+            ConPCache(0);
+         }
+#ifdef JDKLAB
+         StageEnd(StageFit);
+#endif
 
          if (j==-1 || lnL<=0 || lnL>1e7) status=-1;
          else status=0;
@@ -846,15 +1444,24 @@ com.fpatt[i] /= (double)com.ls;
 
       if (com.getSE) {
          puts("Calculating SE's");
-         if(com.sspace < np*(np+1)*sizeof(double)) {
-            com.sspace = np*(np+1)*sizeof(double);
+         if(com.sspace < np*(np+2)*sizeof(double)) {
+            com.sspace = np*(np+2)*sizeof(double);
             if((com.space=(double*)realloc(com.space,com.sspace))==NULL)
                error2("oom space for SE");
          }
 
          g = com.space;
          H = g + com.np;
-         HessianSKT2004 (x, lnL, g, H);
+         /* The observed information from differences of the analytical 
+            gradient when it is available, which needs 2*np gradient calls, 
+            and the approximation of Seo et al. (2004) otherwise. */
+         if(lfunGradientOK()) {
+            HessianGradient (np, x, g, H, com.plfun, lfunGradient);
+            for(i=0; i<np; i++)     g[i] *= -1;
+            for(i=0; i<np*np; i++)  H[i] *= -1;
+         }
+         else
+            HessianSKT2004 (x, lnL, g, H);
          if(com.getSE>=2 && com.clock==0 && nodes[tree.root].nson==3) {  /* g & H */
             fprintf(frst2,"\n %d\n\n", com.ns);
             OutTreeN(frst2, 1, 1);  fprintf(frst2,"\n\n");
@@ -930,6 +1537,8 @@ com.fpatt[i] /= (double)com.ls;
 
       if(com.np-com.ntime || com.clock) 
          DetailOutput(fout,x, H);
+      if(com.paramf[0])
+         OutParameterFile(itree, x, lnL, tl);
 
       if (com.seqtype==AAseq && com.model>=REVaa_0)
          eigenQaa(fout, Root, U, V, x+com.ntime+com.nrgene);
@@ -947,6 +1556,10 @@ com.fpatt[i] /= (double)com.ls;
       com.print -= 9;
       lnL = com.plfun(x,np);
       com.print += 9;
+#ifdef JDKLAB
+      if(com.nullReplicates>0 && com.print && itree==0)
+         NullReplicates(x);
+#endif
 
       fflush(fout);  fflush(flnf);  fflush(frst);  fflush(frst1);
    }     /* for(itree) */
@@ -965,6 +1578,7 @@ com.fpatt[i] /= (double)com.ls;
    }
 
    fclose(flnf);
+   free(x);
    return (0);
 }
 
@@ -1144,6 +1758,37 @@ static int ijAAref=19*20+9;
 #define E1N(m,s) (s/sqrt(PI*2)*exp(-square((1-m)/s)/2)+m*(1-CDFNormal((1-m)/s)))
 
 
+void OutParameterFile (int itree, double x[], double lnL, double tl)
+{
+/* This writes the estimates for the tree to com.paramf as "option = value"
+   lines, at full precision, so that a later run (grand-conv, for example)
+   can start from exactly the fitted values rather than from the rounded 
+   numbers in the main output file.  Trees after the first are appended.
+   The tree has the branch lengths, and x[] is the full parameter vector in 
+   the order of the in.codeml file.
+*/
+   FILE *fpar=gfopen(com.paramf, (itree==0 ? "w" : "a"));
+   int i;
+
+   fprintf(fpar, "* tree %d\n", itree+1);
+   fprintf(fpar, "lnL = %.17g\n", -lnL);
+   fprintf(fpar, "np = %d\nntime = %d\n", com.np, com.ntime);
+   fprintf(fpar, "treelength = %.17g\n", tl);
+   if(com.seqtype==CODONseq && com.model==0 && com.NSsites==0) {
+      fprintf(fpar, "kappa = %.17g\n", com.kappa);
+      fprintf(fpar, "omega = %.17g\n", com.omega);
+   }
+   if(com.alpha)
+      fprintf(fpar, "alpha = %.17g\n", com.alpha);
+   fprintf(fpar, "tree = ");
+   OutTreeN(fpar, 1, PrBranch|PrExact);
+   fprintf(fpar, "\nx =");
+   for(i=0; i<com.np; i++)
+      fprintf(fpar, " %.17g", x[i]);
+   fprintf(fpar, "\n\n");
+   fclose(fpar);
+}
+
 void DetailOutput (FILE *fout, double x[], double var[])
 {
 /* var[] is used for codon models if com.getSE=1 to calculate the variances 
@@ -1593,7 +2238,7 @@ void getSelectedBranches(char *line, char *opt, int firstCalled){
 
 int GetOptions (char *ctlf)
 {
-   int iopt, i,j, nopt=37, lline=255;
+   int iopt, i,j, nopt=40, lline=255;
    char line[255], *pline, opt[99], *comment="*#";
 #ifndef JDKLAB
    char *optstr[] = {"seqfile", "outfile", "treefile", "seqtype", "noisy", 
@@ -1602,11 +2247,12 @@ int GetOptions (char *ctlf)
         "model", "hkyREV", "aaDist","aaRatefile",
         "NSsites", "NShmm", "icode", "Mgene", "fix_kappa", "kappa",
         "fix_omega", "omega", "fix_alpha", "alpha","Malpha", "ncatG", 
-        "fix_rho", "rho", "ndata", "bootstrap", "Small_Diff", "fix_blength"};
+        "fix_rho", "rho", "ndata", "bootstrap", "Small_Diff", "fix_blength",
+        "numOfThreads", "paramfile", "lazyAddition"};
 #endif
 
 #ifdef JDKLAB
-   nopt = 43;
+   nopt = 51;
    char *optstr[] = {"seqfile", "outfile", "treefile", "seqtype", "noisy", 
         "cleandata", "runmode", "method", 
         "clock", "TipDate", "getSE", "RateAncestor", "CodonFreq", "estFreq", "verbose",
@@ -1614,8 +2260,9 @@ int GetOptions (char *ctlf)
         "NSsites", "NShmm", "icode", "Mgene", "fix_kappa", "kappa",
         "fix_omega", "omega", "fix_alpha", "alpha","Malpha", "ncatG", 
         "fix_rho", "rho", "ndata", "bootstrap", "Small_Diff", "fix_blength",
-        "branch1", "branch2", "numOfThreads", "excludeTipTips", "htmlFileName",
-        "divdistfile"};
+        "numOfThreads", "paramfile", "branch1", "branch2", "excludeTipTips", "htmlFileName",
+        "divdistfile", "memoryBudget", "genelist",
+        "nullReplicates", "nullSeed", "stagetimes", "profile", "lazyAddition"};
 #endif
 
    double t;
@@ -1728,13 +2375,23 @@ int GetOptions (char *ctlf)
                case (34): com.bootstrap=(int)t;   break;
                case (35): Small_Diff=t;           break;
                case (36): com.fix_blength=(int)t; break;
+               case (37): com.numOfThreads=(int)t; if(com.numOfThreads<=0) com.numOfThreads=1; break;
+               case (38): sscanf(pline+1, "%s", com.paramf);  break;
 #ifdef JDKLAB
-               case (37): getSelectedBranches(line, opt, 1); break;
-               case (38): getSelectedBranches(line, opt, 0); break;
-               case (39): com.numOfThreads=(int)t; if(com.numOfThreads==0) com.numOfThreads=1; break;
-               case (40): com.excludeTipTips=(int)t; break;
-               case (41): if(com.htmlFileName[0] == '\0') sscanf(pline+1, "%s", com.htmlFileName); break;
-               case (42): sscanf(pline+1, "%s", com.dtreef);   break;
+               case (39): getSelectedBranches(line, opt, 1); break;
+               case (40): getSelectedBranches(line, opt, 0); break;
+               case (41): com.excludeTipTips=(int)t; break;
+               case (42): if(com.htmlFileName[0] == '\0') sscanf(pline+1, "%s", com.htmlFileName); break;
+               case (43): sscanf(pline+1, "%s", com.dtreef);   break;
+               case (44): com.memoryBudget=t;      break;
+               case (45): sscanf(pline+1, "%s", com.genef);   break;
+               case (46): com.nullReplicates=(int)t;  break;
+               case (47): com.nullSeed=(int)t;        break;
+               case (48): sscanf(pline+1, "%s", com.stagef);  break;
+               case (49): com.profile=(int)t;         break;
+               case (50): LazyAddition=(int)t;        break;
+#else
+               case (39): LazyAddition=(int)t;        break;
 #endif
            }
            break;
@@ -2420,6 +3077,69 @@ int GetInitialsCodon (double x[])
 }
 
 
+#ifdef JDKLAB
+size_t SizeConPPart1 (void)
+{
+   return (size_t)tree.nnode*com.ncode*com.ncode*(com.readpattern?com.npatt:com.ls)*sizeof(double);
+}
+
+size_t SizeConPByCat (void)
+{
+   return (size_t)(tree.nnode-com.ns)*com.ncode*com.ncatG*(com.readpattern?com.npatt:com.ls)*sizeof(double);
+}
+
+int MemoryPlan (void)
+{
+/* This works out the memory needed in the three phases of grand-conv, and 
+   prints it before the work starts.  The likelihood phase uses the data, 
+   conP, fhK, space, per-thread P matrices and the eigen and P(t) caches.  
+   The ancestral phase adds conP_byCat and conP_part1 (which are not touched 
+   before), and the reconstruction arrays.  The convergence scan adds the per-site arrays for 
+   all branch pairs, pDivergentOnSite and pAllConvergentOnSite, and the 
+   regression afterwards the slopes for all pairs of branch pairs.  With 
+   memoryBudget (MB) in the control file, the convergence scan takes the sites 
+   in blocks (com.blockSites) small enough to fit, except with PARA_ON_NODE, 
+   and the job is rejected if a phase does not fit even so.
+*/
+   int n=com.ncode, lst=(com.readpattern?com.npatt:com.ls), nbp=NumBranchPairs();
+   int nthreads=max2(com.numOfThreads,1), nid=tree.nnode-com.ns, i, maxnson=0;
+   double MB=1024.*1024, budget=com.memoryBudget*MB, lik, anc, conv, persite, reg, peak;
+
+   for(i=0; i<tree.nnode; i++) maxnson = max2(maxnson, nodes[i].nson);
+   lik = (double)com.ns*com.npatt + com.npatt*8. + com.ls*4.  /* z, fpatt, pose */
+       + com.sconP + com.npatt*com.ncatG*8. + com.sspace
+       + nthreads*(double)maxnson*n*n*8
+       + PMATCACHE_MB*MB + NEIGENCACHE*(3.*n*n+2*n+1)*8;       /* caches */
+   if(lfunGradientOK())
+      lik += (2.*tree.nnode*n*n + nthreads*(3.*tree.nnode*n + n))*8;
+   anc = lik + SizeConPPart1() + SizeConPByCat()
+       + (nid*(double)com.npatt+1)*9 + com.npatt*(n+2.)*8
+       + tree.nnode*(n*n+2.)*com.ncatG*8;                     /* batched P(t) */
+   conv = anc + 2.*lst*com.numOfSelectedBranchPairs*4      /* siteSpecificMap */
+        + (double)tree.nnode*tree.nnode*4 + nbp*40. + lst*12.;
+   persite = 2.*nbp*8;                                     /* *OnSite */
+   reg = conv + nbp*(nbp+1.)/2*8;                          /* calculateRegression */
+
+   com.blockSites = lst;
+#ifndef PARA_ON_NODE   /* by pair, the site-specific output needs all sites at once */
+   if(budget>0 && conv+lst*persite > budget)
+      com.blockSites = (int)max2(0, (budget-conv)/persite);
+#endif
+   peak = max2(max2(anc, conv + com.blockSites*persite), reg);
+
+   printf("\nMemory (MB): likelihood %.1f, ancestral %.1f, convergence %.1f (%d branch pairs",
+      lik/MB, anc/MB, (conv + com.blockSites*persite)/MB, nbp);
+   if(com.blockSites<lst) printf(", %d sites per block", com.blockSites);
+   printf("), regression %.1f, peak %.1f\n", reg/MB, peak/MB);
+   if(budget>0 && (com.blockSites<1 || peak>budget)) {
+      printf("\nThis job needs at least %.1f MB, more than memoryBudget = %.1f MB.\n", 
+         (com.blockSites<1 ? max2(conv+persite, reg) : peak)/MB, com.memoryBudget);
+      exit(-1);
+   }
+   return(0);
+}
+#endif
+
 int GetInitials (double x[], int* fromfile)
 {
 /* This caculates the number of parameters (com.np) and get initial values.
@@ -2434,6 +3154,7 @@ int GetInitials (double x[], int* fromfile)
    double t;
 
    NFunCall = NPMatUVRoot = NEigenQ = 0;
+   eigenCache.hit = eigenCache.miss = pmatCache.hit = pmatCache.miss = 0;
    if(com.clock==ClockCombined && com.ngene<=1) 
       error2("Combined clock model requires mutliple genes.");
    GetInitialsTimes(x);
@@ -2447,20 +3168,23 @@ int GetInitials (double x[], int* fromfile)
       com.conPSiteClass=1;
       sconP_new *= com.ncatG;
    }
+   com.conPSiteClassPar = (com.numOfThreads>1 && com.plfun==lfundG && !com.conPSiteClass
+      && !com.NSsites && com.ncatG>1 && com.clock<5 && GetPMatBranchThreadSafe());
+   if(com.conPSiteClassPar)
+      sconP_new *= com.ncatG;
    if(com.sconP<0 || sconP_new<0) error2("data set too large.");
    if(com.sconP<sconP_new) {
       com.sconP = sconP_new;
       printf("\n%9lu bytes for conP, adjusted\n", com.sconP);
       if((com.conP=(double*)realloc(com.conP, com.sconP))==NULL) 
          error2("oom conP");
-
-      #ifdef JDKLAB
-         com.conP_part1 = (double*)realloc(com.conP_part1, (com.sconP*com.ncode/com.npatt*(com.readpattern?com.npatt:com.ls)/(tree.nnode-com.ns)*(tree.nnode))); 
-         com.conP_prior = (double*)realloc(com.conP_prior, (com.sconP*com.ncode/com.npatt*(com.readpattern?com.npatt:com.ls)/(tree.nnode-com.ns)*(tree.nnode))); 
-         com.conP_byCat =(double*)realloc(com.conP_byCat,(com.sconP*com.ncatG/com.npatt*(com.readpattern?com.npatt:com.ls))); 
-         com.entropy    =(double*)realloc(com.entropy, com.sconP);
-      #endif
    }
+#ifdef JDKLAB
+   /* conP_part1[nnode][lst][n*n] and conP_byCat[nintern][lst][ncatG*n], see PointconPnodes() */
+   com.conP_part1 = (double*)realloc(com.conP_part1, SizeConPPart1());
+   com.conP_byCat = (double*)realloc(com.conP_byCat, SizeConPByCat());
+   if(com.conP_part1==NULL || com.conP_byCat==NULL) error2("oom conP_part1 & conP_byCat");
+#endif
 
    InitializeNodeScale();
 
@@ -3473,13 +4197,9 @@ int eigenQcodon (int mode, double blength, double *S, double *dS, double *dN,
 
    if(mode==1) {  /* get Root, U, & V */
       if (com.seqtype==AAseq) return (0);
-      eigenQREV(Q, pi, n, Root, U, V, space);
-      if(*meanrate>= 0) {    /* apply scaling if meanrate>0 */
-         if(*meanrate>0)
-            mr = *meanrate;
-         for (i=0; i<n; i++) 
-            Root[i] /= mr;
-      }
+      if(*meanrate>0)        /* apply scaling if meanrate>0 */
+         mr = *meanrate;
+      EigenQREVCache(Q, pi, n, (*meanrate>=0 ? mr : 1), Root, U, V, space);
    }
    else if(mode==2) {  /* get statistics */
       for(i=0;i<3;i++) d[i] = d0[i] = ts[i] = tv[i]=0;
@@ -3638,9 +4358,7 @@ int eigenQaa (FILE *fout, double Root[], double U[], double V[], double rate[])
          fprintf(frst1, "\t%d\t%d\t%.2f\n", i+1,j+1,Q[i*naa+j]/t/com.pi[j]*100);
    }
 
-   eigenQREV(Q, com.pi, naa, Root, U, V, space_pisqrt);
-   for(i=0; i<naa; i++)
-      Root[i] = Root[i]/mr;
+   EigenQREVCache(Q, com.pi, naa, mr, Root, U, V, space_pisqrt);
    return (0);
 }
 
@@ -3685,65 +4403,446 @@ int Qcodon2aa (double Qc[], double pic[], double Qaa[], double piaa[])
 
 
 
-int ConditionalPNode (int inode, int igene, double x[])
+int FunThreads (int nthreads)
+{
+/* This sets the number of threads for the likelihood and returns the old 
+   number.  gradientB() and FunPoints() use it to run the likelihood with one 
+   thread in each of the NFunProcesses processes, which share the cores.
+*/
+   int nthreads0=com.numOfThreads;
+
+   com.numOfThreads = nthreads;
+   return(nthreads0);
+}
+
+int GetPMatBranchThreadSafe (void)
+{
+/* GetPMatBranch() may be called from different threads at the same time only 
+   if it does not change the globals U, V, Root, or com.pomega, which happens 
+   under the branch and branch-site models, AAClasses, and during BEB.
+*/
+   if(com.seqtype==CODONseq && (com.model || com.aaDist==AAClasses)) return(0);
+   if(BayesEB) return(0);
+   return(1);
+}
+
+
+static int *conPLevelNodes=NULL, *conPNodeLevel=NULL, *conPLevelEnd, conPnlevel, conPmaxnson;
+static double *conPPMatThread=NULL;
+static size_t sconPPMatThread=0;
+
+static int CollectConPNodes (int inode, int *nupdate)
+{
+/* This lists the nodes in the subtree at inode that need updating in 
+   post-order, and returns the level of inode, which is 1 + the largest level 
+   among the sons that need updating (0 for tips and for nodes with old conP).
+*/
+   int i, ison, level=0, l;
+
+   for(i=0; i<nodes[inode].nson; i++) {
+      ison = nodes[inode].sons[i];
+      if(nodes[ison].nson>0 && !com.oldconP[ison])
+         if((l = CollectConPNodes(ison, nupdate)) > level) level = l;
+   }
+   if(nodes[inode].nson > conPmaxnson) conPmaxnson = nodes[inode].nson;
+   conPLevelNodes[(*nupdate)++] = inode;
+   return (conPNodeLevel[inode] = level+1);
+}
+
+static void ConditionalPNodeSchedule (int inode, int nthreads)
+{
+/* This sorts the nodes to be updated by level, into conPLevelNodes+NNODE, 
+   with level il ending at conPLevelEnd[il], and gets P(t) space for nthreads.
+*/
+   int i, il, l, nupdate=0, *count;
+   size_t s;
+
+   if(conPLevelNodes==NULL) {
+      conPLevelNodes = (int*)malloc(2*NNODE*sizeof(int));
+      conPNodeLevel = (int*)malloc((2*NNODE+1)*sizeof(int));
+      if(conPLevelNodes==NULL || conPNodeLevel==NULL) error2("oom ConditionalPNode");
+   }
+   conPmaxnson = 0;
+   conPnlevel = CollectConPNodes(inode, &nupdate);
+
+   s = (size_t)nthreads*conPmaxnson*com.ncode*com.ncode;
+   if(sconPPMatThread < s) {
+      sconPPMatThread = s;
+      if((conPPMatThread=(double*)realloc(conPPMatThread, s*sizeof(double)))==NULL)
+         error2("oom ConditionalPNode");
+   }
+
+   conPLevelEnd = count = conPNodeLevel+NNODE;
+   for(il=0; il<=conPnlevel; il++) count[il] = 0;
+   for(i=0; i<nupdate; i++) count[conPNodeLevel[conPLevelNodes[i]]]++;
+   for(il=1,l=0; il<=conPnlevel; il++) { l += count[il]; count[il] = l-count[il]; }
+   for(i=0; i<nupdate; i++)
+      conPLevelNodes[NNODE + count[conPNodeLevel[conPLevelNodes[i]]]++] = conPLevelNodes[i];
+}
+
+static void ConditionalPNodePMat (int inode, int igene, double x[], double rate, double PMatSons[])
 {
-   int n=com.ncode, i,j,k,h, ison, pos0=com.posG[igene], pos1=com.posG[igene+1];
+/* P(t) for the branches leading to the sons of inode, in PMatSons[nson*n*n].
+*/
+   int n=com.ncode, i, ison;
    double t;
 
-   for(i=0; i<nodes[inode].nson; i++)
-      if(nodes[nodes[inode].sons[i]].nson>0 && !com.oldconP[nodes[inode].sons[i]])
-         ConditionalPNode(nodes[inode].sons[i], igene, x);
+   for(i=0; i<nodes[inode].nson; i++) {
+      ison = nodes[inode].sons[i];
+      t = nodes[ison].branch * rate;
+      if(com.clock<5) {
+         if(com.clock)  t *= GetBranchRate(igene,(int)nodes[ison].label,x,NULL);
+         else           t *= com.rgene[igene];
+      }
+      GetPMatBranch(PMatSons+i*n*n, x, t, ison);
+   }
+}
+
+static void ConditionalPNodeSites (int inode, int pos0, int pos1, double PMatSons[], 
+       size_t shift, double scaleF[])
+{
+/* This calculates conP for inode for site patterns pos0 to pos1-1, given the 
+   conP of the sons and P(t) for the branches in PMatSons[].  conP for 
+   interior nodes is at nodes[].conP+shift, as in fx_r().
+*/
+   int n=com.ncode, i,j,k,h, ison;
+   double t, *PMat, *conP, *conPson;
 
+   conP = nodes[inode].conP + (inode<com.ns ? 0 : shift);
    if(inode<com.ns)
       for(h=pos0*n; h<pos1*n; h++)
-         nodes[inode].conP[h] = 0; /* young ancestor */
+         conP[h] = 0; /* young ancestor */
    else
       for(h=pos0*n; h<pos1*n; h++)
-         nodes[inode].conP[h] = 1;
+         conP[h] = 1;
    if (com.cleandata && inode<com.ns)
       for(h=pos0; h<pos1; h++) 
-         nodes[inode].conP[h*n+com.z[inode][h]] = 1;
+         conP[h*n+com.z[inode][h]] = 1;
 
    for (i=0; i<nodes[inode].nson; i++) {
       ison = nodes[inode].sons[i];
-      t = nodes[ison].branch * _rateSite;
-      if(com.clock<5) {
-         if(com.clock)  t *= GetBranchRate(igene,(int)nodes[ison].label,x,NULL);
-         else           t *= com.rgene[igene];
-      }
-
-      GetPMatBranch(PMat, x, t, ison);
+      PMat = PMatSons+i*n*n;
 
       if (nodes[ison].nson<1 && com.cleandata) {        /* tip && clean */
          for(h=pos0; h<pos1; h++)
             for(j=0; j<n; j++)
-               nodes[inode].conP[h*n+j] *= PMat[j*n+com.z[ison][h]];
+               conP[h*n+j] *= PMat[j*n+com.z[ison][h]];
       }
       else if (nodes[ison].nson<1 && !com.cleandata) {  /* tip & unclean */
          for(h=pos0; h<pos1; h++)
             for(j=0; j<n; j++) {
                for(k=0,t=0; k<nChara[com.z[ison][h]]; k++)
                   t += PMat[j*n+CharaMap[com.z[ison][h]][k]];
-               nodes[inode].conP[h*n+j] *= t;
+               conP[h*n+j] *= t;
             }
       }
       else {                                            /* internal node */
+         conPson = nodes[ison].conP + (ison<com.ns ? 0 : shift);
          for(h=pos0; h<pos1; h++)
             for(j=0; j<n; j++) {
                for(k=0,t=0; k<n; k++)
-                  t += PMat[j*n+k]*nodes[ison].conP[h*n+k];
-               nodes[inode].conP[h*n+j] *= t;
+                  t += PMat[j*n+k]*conPson[h*n+k];
+               conP[h*n+j] *= t;
             }
       }
 
    }        /*  for (ison)  */
    if(com.NnodeScale && com.nodeScale[inode]) 
-      NodeScale(inode, pos0, pos1);
+      NodeScaleConP(inode, pos0, pos1, conP, scaleF);
+}
+
+static void ConditionalPNodeRun (int igene, double x[], double rate, size_t shift, 
+       double scaleF[], int nthreads, double PMatThread[])
+{
+/* This does the work for ConditionalPNode() and ConditionalPNodeSiteClasses(), 
+   using the levels set up by ConditionalPNodeSchedule().  
+   PMatThread[] has space for nthreads*conPmaxnson P matrices.
+*/
+   int n=com.ncode, pos0=com.posG[igene], pos1=com.posG[igene+1];
+   int i, il, l, ib, inode, nblock, sizeblock, ithread;
+   size_t sP = (size_t)conPmaxnson*n*n;
+   int parallelnodes = (nthreads>1 && GetPMatBranchThreadSafe());
+
+   for(il=1,l=0; il<=conPnlevel; l=conPLevelEnd[il++]) {
+      /* nodes conPLevelNodes[NNODE+l] to conPLevelNodes[NNODE+conPLevelEnd[il]-1] */
+      if(parallelnodes && conPLevelEnd[il]-l >= nthreads) {
+         #pragma omp parallel for private(ithread, inode) schedule(dynamic,1) num_threads(nthreads)
+         for(i=l; i<conPLevelEnd[il]; i++) {
+            ithread = 0;
+            #ifdef _OPENMP
+               ithread = omp_get_thread_num();
+            #endif
+            inode = conPLevelNodes[NNODE+i];
+            ConditionalPNodePMat(inode, igene, x, rate, PMatThread+ithread*sP);
+            ConditionalPNodeSites(inode, pos0, pos1, PMatThread+ithread*sP, shift, scaleF);
+         }
+      }
+      else {
+         for(i=l; i<conPLevelEnd[il]; i++) {
+            inode = conPLevelNodes[NNODE+i];
+            ConditionalPNodePMat(inode, igene, x, rate, PMatThread);
+            nblock = min2(nthreads*4, (pos1-pos0)/64);
+            if(nthreads>1 && nblock>1) {
+               sizeblock = (pos1-pos0+nblock-1)/nblock;
+               #pragma omp parallel for schedule(static) num_threads(nthreads)
+               for(ib=0; ib<nblock; ib++)
+                  ConditionalPNodeSites(inode, pos0+ib*sizeblock, 
+                     min2(pos0+(ib+1)*sizeblock, pos1), PMatThread, shift, scaleF);
+            }
+            else
+               ConditionalPNodeSites(inode, pos0, pos1, PMatThread, shift, scaleF);
+         }
+      }
+   }
+}
+
+
+int ConditionalPNode (int inode, int igene, double x[])
+{
+/* This updates nodes[].conP for inode and for the nodes in the subtree that 
+   need updating (!com.oldconP[]).  The nodes are processed level by level, 
+   where the level of a node is 1 + the largest level among its sons, so that 
+   the nodes within a level are independent.  With com.numOfThreads>1, a level 
+   with many nodes is processed in parallel over nodes, while narrow levels 
+   near the root are processed in parallel over blocks of site patterns.  The 
+   calculation for each site pattern is unchanged, so that the results do not 
+   depend on the number of threads.
+*/
+   int nthreads=max2(com.numOfThreads,1);
+
+   ConditionalPNodeSchedule(inode, nthreads);
+   ConditionalPNodeRun(igene, x, _rateSite, 0, com.nodeScaleF, nthreads, conPPMatThread);
+   return (0);
+}
 
+
+int ConditionalPNodeSiteClasses (int inode, int igene, double x[])
+{
+/* This is used by fx_r() if(com.conPSiteClassPar), to calculate conP for all 
+   the ncatG rate classes at the same time, with the classes spread over 
+   threads and the remaining threads used within each class by 
+   ConditionalPNodeRun().  Each class has its own conP and scale factors, 
+   in the same layout as for com.conPSiteClass: class ir is in slice 
+   (ir+1)%ncatG, so that the last class is at nodes[].conP and 
+   com.nodeScaleF, where the serial algorithm leaves it.
+*/
+   int nthreads=max2(com.numOfThreads,1), nouter=min2(com.ncatG,nthreads), ninner=max2(nthreads/nouter,1);
+   int ir, is, levels0=1;
+   size_t sP;
+
+   ConditionalPNodeSchedule(inode, nouter*ninner);
+   sP = (size_t)ninner*conPmaxnson*com.ncode*com.ncode;
+#ifdef _OPENMP
+   levels0 = omp_get_max_active_levels();
+   if(ninner>1) omp_set_max_active_levels(max2(levels0,2));
+#endif
+   #pragma omp parallel for private(is) schedule(dynamic,1) num_threads(nouter)
+   for(ir=0; ir<com.ncatG; ir++) {
+      int ithread=0;
+      #ifdef _OPENMP
+         ithread = omp_get_thread_num();
+      #endif
+      is = (ir+1)%com.ncatG;
+      ConditionalPNodeRun(igene, x, com.rK[ir], is*(tree.nnode-com.ns)*com.ncode*(size_t)com.npatt,
+         com.nodeScaleF+is*com.NnodeScale*(size_t)com.npatt, ninner, conPPMatThread+ithread*sP);
+   }
+#ifdef _OPENMP
+   if(ninner>1) omp_set_max_active_levels(levels0);   /* other parallel regions are not nested */
+#endif
+   SetPSiteClass(com.ncatG-1, x);
    return (0);
 }
 
 
+int lfunGradientOK (void)
+{
+/* This decides whether lfunGradient() can be used as dfun by ming2(): branch 
+   lengths are free parameters (clock=0), P(t) is from the global U, V, Root, 
+   and the likelihood is lfun() or lfundG() for discrete-gamma rates.
+*/
+   if(com.clock || com.ntime==0 || com.ntime!=tree.nbranch) return(0);
+   if(!GetPMatBranchThreadSafe()) return(0);
+   if(com.seqtype==AAseq && com.model==Poisson) return(0);
+   if(com.plfun==lfun) return(1);
+   if(com.plfun==lfundG && !com.NSsites && !com.conPSiteClass) return(1);
+   return(0);
+}
+
+static void lfunGradientPreorder (int inode, int order[], int *k)
+{
+   int i;
+
+   order[(*k)++] = inode;
+   for(i=0; i<nodes[inode].nson; i++)
+      if(nodes[nodes[inode].sons[i]].nson>0)
+         lfunGradientPreorder(nodes[inode].sons[i], order, k);
+}
+
+static void lfunGradientSonVector (int ison, int h, double M[], double Low[])
+{
+/* M[j] = sum_k M[j*n+k]*L(k), where L(k) is conP at ison for pattern h.  
+   Low[n] is used in and out.
+*/
+   int n=com.ncode, j,k;
+   double t, *conP;
+
+   if(nodes[ison].nson<1 && com.cleandata) {
+      for(j=0; j<n; j++) Low[j] = M[j*n+com.z[ison][h]];
+   }
+   else if(nodes[ison].nson<1) {
+      for(j=0; j<n; j++) {
+         for(k=0,t=0; k<nChara[com.z[ison][h]]; k++)
+            t += M[j*n+CharaMap[com.z[ison][h]][k]];
+         Low[j] = t;
+      }
+   }
+   else {
+      conP = nodes[ison].conP+h*n;
+      for(j=0; j<n; j++) {
+         for(k=0,t=0; k<n; k++)
+            t += M[j*n+k]*conP[k];
+         Low[j] = t;
+      }
+   }
+}
+
+int lfunGradient (double x[], double *f, double dx[], int np)
+{
+/* This calculates the gradient dx[] of -lnL = lfun() or lfundG(), with the 
+   derivatives for branch lengths calculated analytically and those for the 
+   other parameters by finite differences.  Given conP from the postorder 
+   pass, a preorder pass gives the outside probability Out(a) at each node a, 
+   and for branch b with father a and the other sons s of a, 
+      Q(j)   = Out_a(j) * prod_s sum_k P_s(j,k) Low_s(k)
+      f_h    = sum_j Q(j) sum_k P_b(j,k)  Low_b(k)
+      df_h   = sum_j Q(j) sum_k dP_b(j,k) Low_b(k)
+      Out_b(k) = sum_j Q(j) P_b(j,k),
+   where dP(t)/dt = U diag{Root*exp(Root*t)} V.  Scale factors cancel in 
+   df_h/f_h, and Out is rescaled at each node.  Under the gamma model, 
+   d lnf_h = sum_r freqK[r] f_hr (df_hr/f_hr) / f_h.
+   *f has -lnL at x[].  The sites are done in blocks of fixed size, so that 
+   the result does not depend on the number of threads.
+*/
+   int n=com.ncode, nnode=tree.nnode, nb=com.ntime, ncatG=(com.plfun==lfun?1:com.ncatG);
+   int nthreads=max2(com.numOfThreads,1), sizeblock=64, nblock;
+   int i,j,k,h, ig,ir, it, *order, norder=0;
+   double *PMat, *dPMat, *gblock, *space, *w=NULL, rate, t;
+   static double *work=NULL;
+   static size_t swork=0;
+   size_t s;
+
+   nblock = (com.npatt+sizeblock-1)/sizeblock;
+   s = (size_t)2*nnode*n*n + (size_t)nblock*nb + nnode + 2*np + (ncatG>1 ? (size_t)ncatG*com.npatt : 0)
+     + (size_t)nthreads*(3*nnode*n + n);
+   if(swork<s) {
+      swork = s;
+      if((work=(double*)realloc(work, s*sizeof(double)))==NULL) error2("oom lfunGradient");
+   }
+   /* finite differences for parameters other than branch lengths, one-sided 
+      for those that ming2() has at a bound */
+   gradientBPart(nb, np, x, *f, dx, com.plfun, work+s-2*np, DfunXmark);
+   for(i=0; i<nb; i++) dx[i] = 0;
+
+   PMat = work;  dPMat = PMat+nnode*n*n;  gblock = dPMat+nnode*n*n;
+   order = (int*)(gblock+nblock*nb);
+   space = gblock+nblock*nb+nnode;
+   if(ncatG>1) { w = space;  space += ncatG*com.npatt; }
+   lfunGradientPreorder(tree.root, order, &norder);
+
+   if(ncatG>1) {  /* weights of site classes, w[ir*npatt+h] = freqK[ir]*f_hr/f_h */
+      fx_r(x, np);
+      for(h=0; h<com.npatt; h++) {
+         if(com.NnodeScale) {
+            for(ir=1,it=0; ir<ncatG; ir++)
+               if(com.fhK[ir*com.npatt+h] > com.fhK[it*com.npatt+h]) it = ir;
+            for(ir=0,t=0; ir<ncatG; ir++)
+               t += w[ir*com.npatt+h] = com.freqK[ir]*exp(com.fhK[ir*com.npatt+h]-com.fhK[it*com.npatt+h]);
+         }
+         else 
+            for(ir=0,t=0; ir<ncatG; ir++)
+               t += w[ir*com.npatt+h] = com.freqK[ir]*com.fhK[ir*com.npatt+h];
+         for(ir=0; ir<ncatG; ir++)
+            w[ir*com.npatt+h] = (t>0 ? w[ir*com.npatt+h]/t : 0);
+      }
+   }
+   else if(SetParameters(x)) puts("\npar err..");
+
+   for(ig=0; ig<com.ngene; ig++) {
+      if(ncatG==1 && com.Mgene>1)
+         SetPGene(ig,1,1,0,x);
+      else if(ncatG>1 && (com.Mgene>1 || com.nalpha>1))
+         SetPGene(ig, com.Mgene>1, com.Mgene>1, com.nalpha>1, x);
+      for(ir=0; ir<ncatG; ir++) {
+         if(ncatG>1) SetPSiteClass(ir, x);
+         ConditionalPNode(tree.root, ig, x);
+         rate = _rateSite*(com.clock<5 ? com.rgene[ig] : 1);
+         for(i=0; i<nnode; i++) {
+            if(i==tree.root) continue;
+            GetPMatBranch(PMat+i*n*n, x, nodes[i].branch*rate, i);
+            dPMatUVRoot(dPMat+i*n*n, nodes[i].branch*rate, n, U, V, Root);
+         }
+         nblock = (com.posG[ig+1]-com.posG[ig]+sizeblock-1)/sizeblock;
+         zero(gblock, nblock*nb);
+
+         #pragma omp parallel for private(h, i, j, k, t) num_threads(nthreads) schedule(dynamic,1) if(nthreads>1)
+         for(it=0; it<nblock; it++) {
+            int ithread=0, a, b, ib, is, h0=com.posG[ig]+it*sizeblock, h1=min2(h0+sizeblock, com.posG[ig+1]);
+            double *Out, *Msg, *dMsg, *Q, fh, dfh, wh;
+            #ifdef _OPENMP
+               ithread = omp_get_thread_num();
+            #endif
+            Out = space+ithread*(3*nnode*n+n);  Msg = Out+nnode*n;  dMsg = Msg+nnode*n;  Q = dMsg+nnode*n;
+
+            for(h=h0; h<h1; h++) {
+               if (com.fpatt[h]<=0 && com.print>=0) continue;
+               wh = com.fpatt[h]*(ncatG>1 ? w[ir*com.npatt+h] : 1);
+               if(wh==0) continue;
+               for(j=0; j<n; j++) Out[tree.root*n+j] = com.pi[j];
+               for(k=0; k<norder; k++) {
+                  a = order[k];
+                  if(a<com.ns && com.cleandata)  /* young ancestor */
+                     for(j=0; j<n; j++) Out[a*n+j] *= (j==com.z[a][h]);
+                  for(i=0; i<nodes[a].nson; i++) {
+                     b = nodes[a].sons[i];
+                     lfunGradientSonVector(b, h, PMat+b*n*n, Msg+b*n);
+                     lfunGradientSonVector(b, h, dPMat+b*n*n, dMsg+b*n);
+                  }
+                  for(i=0; i<nodes[a].nson; i++) {
+                     b = nodes[a].sons[i];
+                     for(j=0; j<n; j++) Q[j] = Out[a*n+j];
+                     for(is=0; is<nodes[a].nson; is++) {
+                        if(is==i) continue;
+                        for(j=0; j<n; j++) Q[j] *= Msg[nodes[a].sons[is]*n+j];
+                     }
+                     for(j=0,fh=dfh=0; j<n; j++) {
+                        fh  += Q[j]*Msg[b*n+j];
+                        dfh += Q[j]*dMsg[b*n+j];
+                     }
+                     ib = nodes[b].ibranch;
+                     if(fh>0) gblock[it*nb+ib] -= wh*dfh/fh*rate;
+                     if(nodes[b].nson>0) {
+                        for(j=0; j<n; j++) Out[b*n+j] = 0;
+                        for(j=0; j<n; j++) {
+                           if(Q[j]==0) continue;
+                           for(is=0; is<n; is++)
+                              Out[b*n+is] += Q[j]*PMat[b*n*n+j*n+is];
+                        }
+                        for(j=0,t=0; j<n; j++) if(Out[b*n+j]>t) t = Out[b*n+j];
+                        if(t>0) for(j=0; j<n; j++) Out[b*n+j] /= t;
+                     }
+                  }
+               }
+            }
+         }
+         for(it=0; it<nblock; it++)
+            for(i=0; i<nb; i++) dx[i] += gblock[it*nb+i];
+      }
+   }
+   ConPCache(conPCache.on);  /* conP have been changed */
+   return(0);
+}
+
+
 int PMatJC69like (double P[], double t, int n)
 {
    int i;
@@ -4118,23 +5217,44 @@ int DistanceMatAA (FILE *fout)
 }
 
 
+static double daaFile[190+20];
+
+static int DaaFileRead (void)
+{
+/* This reads the numbers in com.daafile, the lower triangle of the matrix 
+   followed by the amino acid frequencies if any, into daaFile[].  The file is 
+   read once, and later calls, for the next data set or for the genes in a 
+   batch run, use the copy.  Returns the number of values.
+*/
+   static char daafile0[512]="";
+   static int n0=0;
+   FILE *fdaa;
+
+   if(strcmp(daafile0, com.daafile)) {
+      fdaa = gfopen(com.daafile, "r");
+      for(n0=0; n0<190+20 && fscanf(fdaa, "%lf", &daaFile[n0])==1; n0++) ;
+      fclose(fdaa);
+      strcpy(daafile0, com.daafile);
+   }
+   return(n0);
+}
+
 int GetDaa (FILE* fout, double daa[])
 {
 /* Get the amino acid distance (or substitution rate) matrix 
    (grantham, dayhoff, jones, etc).
 */
-   FILE * fdaa;
    char aa3[4]="";
-   int i,j, naa=20;
+   int i,j,k, naa=20, nread;
    double dmax=0, dmin=1e40;
 
    if(noisy>3) printf("\n\nReading matrix from %s", com.daafile);
    if (com.model==REVaa_0||com.model==REVaa) puts(", to get initial values.");
-   fdaa = gfopen(com.daafile, "r");
+   nread = DaaFileRead();
 
-   for (i=0; i<naa; i++)
+   for (i=0,k=0; i<naa; i++)
       for (j=0,daa[i*naa+i]=0; j<i; j++)  {
-         fscanf(fdaa, "%lf", &daa[i*naa+j]);
+         daa[i*naa+j] = (k<nread ? daaFile[k++] : 0);
          daa[j*naa+i] = daa[i*naa+j];
          if (dmax<daa[i*naa+j]) dmax = daa[i*naa+j];
          if (dmin>daa[i*naa+j]) dmin = daa[i*naa+j];
@@ -4154,15 +5274,14 @@ int GetDaa (FILE* fout, double daa[])
 
       if(com.model==Empirical) {
          for(i=0; i<naa; i++)
-            if(fscanf(fdaa,"%lf",&com.pi[i])!=1) 
-               error2("aaRatefile");
+            if(k<nread) com.pi[i] = daaFile[k++];
+            else        error2("aaRatefile");
          if (fabs(1-sum(com.pi,20))>1e-5) {
             printf("\nSum of freq. = %.6f != 1 in aaRateFile\n", sum(com.pi,naa)); 
             exit(-1);
          }
       }
    }
-   fclose(fdaa);
 
    if(fout) {
       fprintf (fout, "\n%s\n", com.daafile);
@@ -4487,6 +5606,131 @@ int distance3pos(double dHKY[], double kHKY[], int *sites4, char *z1, char *z2)
 }
 
 
+#define PAIRBLOCK  4096   /* pairs done at a time by FunPoints() */
+
+static char **_pz0;
+static double *_fpatt0, (*_pairxb)[2];
+static int _npatt0, _pairk0, _pairseed;
+
+static void PairIndex (int k, int *is, int *js)
+{
+/* pair k = is*(is-1)/2+js, with js<is.
+*/
+   int i = (int)((1+sqrt(1.+8.*k))/2);
+
+   while(i*(i-1)/2>k) i--;
+   while((i+1)*i/2<=k) i++;
+   *is = i;  *js = k-i*(i-1)/2;
+}
+
+static void PairwiseCodonData (int is, int js)
+{
+/* This collects the codon pairs for sequences is and js into com.z[0], 
+   com.z[1], com.fpatt[] and com.npatt, and the codon frequencies for the pair
+   into com.pi[].
+*/
+   char codon[2][3];
+   float fp[NCODE*NCODE];
+   int n=com.ncode, j,k,h, i0, nb[3],ib[3][4],ic[2], missing;
+
+   for(k=0; k<n*n; k++) fp[k]=0;
+   if(com.cleandata) {
+      for(h=0; h<_npatt0; h++) {
+         j = max2(_pz0[is][h],_pz0[js][h]);
+         k = min2(_pz0[is][h],_pz0[js][h]);
+         fp[j*n+k] += (float)_fpatt0[h];
+      }
+   }
+   else {
+      for(h=0,com.ls=0; h<_npatt0; h++) {
+         FOR(i0,2) FOR(k,3) codon[i0][k] = _pz0[i0==0 ? is : js][h*3+k];
+         for(i0=0,missing=0; i0<2; i0++) {
+            for(k=0; k<3; k++)
+               NucListall(codon[i0][k], &nb[k], ib[k]);
+            if(nb[0]*nb[1]*nb[2]!=1)
+               { missing=1; break; }
+            else
+               ic[i0] = FROM64[ ib[0][0]*16+ib[1][0]*4+ib[2][0] ];
+         }
+         if(missing) continue;
+         com.ls += (int)_fpatt0[h];
+
+         j = max2(ic[0],ic[1]);
+         k = min2(ic[0],ic[1]);
+         fp[j*n+k] += (float)_fpatt0[h];
+      }
+   }
+
+   for(j=0,com.npatt=0;j<n;j++) {
+      for(k=0; k<j+1; k++)
+         if(fp[j*n+k]) {
+            com.z[0][com.npatt] = (char)j;
+            com.z[1][com.npatt] = (char)k;
+            com.fpatt[com.npatt++] = fp[j*n+k];
+         }
+   }
+   for(j=0,zero(com.pi,n); j<com.npatt; j++) {
+      com.pi[(int)com.z[0][j]] += com.fpatt[j]/(2.*com.ls);
+      com.pi[(int)com.z[1][j]] += com.fpatt[j]/(2.*com.ls);
+   }
+   GetCodonFreqs2 ();
+}
+
+static void PairwiseCodonPoint (int ipair, double out[])
+{
+/* out[] has lnL, x[10] and var[np*np] for pair _pairk0+ipair, which is one of 
+   the pairs done by FunPoints() for PairwiseCodon().  The initial values 
+   depend on the pair only, so that the results do not depend on the number 
+   of processes.
+*/
+   int k=_pairk0+ipair, is,js, j, np;
+   double *x=out+1, *var=com.space+NP, lnL=0, e=1e-7, mr=0;
+   double x0[10]={.9,1,.5,.5,.5,.5,.3};
+
+   PairIndex(k, &is, &js);
+   PairwiseCodonData(is, js);
+   SetSeed(_pairseed+k, 0);
+   np = com.np = (com.ntime=1) + com.nkappa + !com.fix_omega;
+   NFunCall = 0;
+
+   /* initial values */
+   xtoy(x0, x, 10);
+   x[0] = SeqDistance[is*(is-1)/2+js]*(0.8+0.3*rndu());
+   if(x[0]>3) x[0]=1.5+rndu();
+   if(x[0]<1e-6) x[0]=.5*rndu();
+   if(com.nkappa==1)  /* HKY type model */
+      x[1] = (com.icode==1?4:1.5)+rndu();
+   else         /* REV or FMutSel models, do something later */
+      for(j=1,x[1]=.8+.4*rndu(); j<com.nkappa; j++)
+         x[1+j] = .2+.4*rndu();
+   if(!com.fix_omega)
+      x[1+com.nkappa] = 0.2+0.2*rndu();
+
+   if(noisy>=9) {
+      FPN(F0);  FOR(j,np) printf(" %12.6f",x[j]); FPN(F0);
+      FOR(j,np) printf(" %12.6f",_pairxb[j][0]); FPN(F0);
+      FOR(j,np) printf(" %12.6f",_pairxb[j][1]); FPN(F0);
+   }
+   if(com.fix_kappa && com.fix_omega)  
+      eigenQcodon(1,-1,NULL,NULL,NULL,Root,U,V, &mr, com.pkappa,com.omega,PMat);
+   if( com.runmode == -3 ){ //kostas, save values 
+      x[4] = x[0];  
+      x[5] = x[2];  
+   }
+
+   AlwaysCenter = 0;   /* not left from an earlier pair */
+   if(np)
+      ming2(noisy>3?frub:NULL, &lnL, lfun2dSdN, NULL, x, _pairxb, com.space, e, np);
+   else {  x[1]=x[2]=com.kappa=com.omega=0; lnL=0; }
+   out[0] = lnL;
+
+   if (np && com.getSE) {
+      Hessian(np, x, lnL, com.space, var, lfun2dSdN, var+np*np);
+      matinv(var, np, np, var+np*np);
+      xtoy(var, out+11, np*np);
+   }
+}
+
 int PairwiseCodon (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double space[])
 {
 /* Calculates ds & dn for all pairwise codon sequence comparisons.
@@ -4495,16 +5739,17 @@ int PairwiseCodon (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double space[])
    removed.  Think of what to do with raw unclean data.
    JacobiSN has two columns, the 1st are deratives of dS (dS/dt, dS/dk, dS/dw)
    and the second of dN.
+   The ML fits for the pairs are independent, and are done PAIRBLOCK pairs at 
+   a time by FunPoints(), shared among NFunProcesses processes.  The results 
+   are then printed in order of the pairs.
 */
-   char *pz0[NS],codon[2][3];   /* pz0, npatt0, & fpatt0 hold the old information */
+   char *pz0[NS];   /* pz0, npatt0, & fpatt0 hold the old information */
    int npatt0=com.npatt;
    double *fpatt0, ls0=com.ls;
-   float fp[NCODE*NCODE];
-   int n=com.ncode, is,js,j,k,h, i0,np, wname=15;
-   int nb[3],ib[3][4],ic[2], missing=0, sites4;
-   double x[10]={.9,1,.5,.5,.5,.5,.3}, xb[10][2]={{1e-5,50}}, large=50;
+   int n=com.ncode, is,js,j,k,h, np, wname=15, sites4, ipair,npair,k0=0,k1=0,nout;
+   double x[10], xb[10][2]={{1e-5,50}}, large=50;
    double kappab[2]={.01,999}, omegab[2]={.001,99};
-   double lnL, e=1e-7, *var=space+NP, S,dS,dN, mr=0;
+   double lnL, *var=space+NP, S,dS,dN, mr=0, *out, *row;
    double JacobiSN[2*3],T1[2*3],T2[2*3],vSN[2*2], dS1,dN1,dS2,dN2,y[3],eh; 
           /* for calculating SEs of dS & dN */
    double dHKY[4], kHKY[4];
@@ -4523,6 +5768,15 @@ int PairwiseCodon (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double space[])
 
    FOR(j,com.nkappa) { xb[1+j][0]=kappab[0]; xb[1+j][1]=kappab[1]; }
    if(!com.fix_omega)  { k=1+com.nkappa; xb[k][0]=omegab[0]; xb[k][1]=omegab[1]; }
+   if(com.nkappa==1) xb[1][0] = 0.4;
+
+   np = (com.ntime=1) + com.nkappa + !com.fix_omega;
+   nout = 1+10+np*np;
+   npair = com.ns*(com.ns-1)/2;
+   if((out=(double*)malloc(PAIRBLOCK*nout*sizeof(double)))==NULL)
+      error2("oom PairwiseCodon");
+   _pz0 = pz0;  _fpatt0 = fpatt0;  _npatt0 = npatt0;  _pairxb = xb;
+   _pairseed = 1+(int)(rndu()*1e8);
 
    fprintf(fds,"%6d\n", com.ns);  fprintf(fdn,"%6d\n", com.ns);
    fprintf(ft,"%6d\n", com.ns);
@@ -4535,108 +5789,29 @@ int PairwiseCodon (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double space[])
       fprintf(fdn,"%-*s ", wname,com.spname[is]);
       fprintf(ft,"%-*s ", wname,com.spname[is]);
       for(js=0; js<is; js++) {
-         if(noisy>9) {
-            puts("\nInput the pair i & j (i>j) for dN-dS calculation? ");
-            scanf("%d%d",&is,&js);  
-            is--; js--;
-            if(is>com.ns || js<0 || is<js) error2("invalid pair");
+         ipair = is*(is-1)/2+js;
+         if(ipair>=k1) {
+            k0 = _pairk0 = ipair;  k1 = min2(k0+PAIRBLOCK, npair);
+            FunPoints(k1-k0, nout, out, PairwiseCodonPoint, NULL);
          }
+         row = out+(size_t)(ipair-k0)*nout;
+
          if(noisy>1) printf ("\n%4d vs. %3d", is+1, js+1);
          fprintf(fout,"\n\n%d (%s) ... %d (%s)",
               is+1,com.spname[is], js+1,com.spname[js]);
          fprintf (frst, "%3d %3d ", is+1, js+1);
          if(noisy>2) fprintf(frub, "\n\n%d (%s) ... %d (%s)",
                   is+1,com.spname[is], js+1,com.spname[js]);
-         for(k=0; k<n*n; k++) fp[k]=0;
-         if(com.cleandata) {
-            for(h=0; h<npatt0; h++) {
-               j = max2(pz0[is][h],pz0[js][h]);
-               k = min2(pz0[is][h],pz0[js][h]);
-               fp[j*n+k] += (float)fpatt0[h];
-            }
-         }
-         else {
-            for(h=0,com.ls=0; h<npatt0; h++) {
-               FOR(i0,2) FOR(k,3) codon[i0][k] = pz0[i0==0 ? is : js][h*3+k];
-               for(i0=0,missing=0; i0<2; i0++) {
-                  for(k=0; k<3; k++)
-                     NucListall(codon[i0][k], &nb[k], ib[k]);
-                  if(nb[0]*nb[1]*nb[2]!=1)
-                     { missing=1; break; }
-                  else
-                     ic[i0] = FROM64[ ib[0][0]*16+ib[1][0]*4+ib[2][0] ];
-               }
-               if(missing) continue;
-               com.ls += (int)fpatt0[h];
-
-               j = max2(ic[0],ic[1]);
-               k = min2(ic[0],ic[1]);
-               fp[j*n+k] += (float)fpatt0[h];
-            }
-         }
-
-         for(j=0,com.npatt=0;j<n;j++) {
-            for(k=0; k<j+1; k++)
-               if(fp[j*n+k]) {
-                  com.z[0][com.npatt] = (char)j;
-                  com.z[1][com.npatt] = (char)k;
-                  com.fpatt[com.npatt++] = fp[j*n+k];
-               }
-         }
+         PairwiseCodonData(is, js);
          if(noisy>2) printf("\n  npatt=%d ",com.npatt);
-         for(j=0,zero(com.pi,n); j<com.npatt; j++) {
-            com.pi[(int)com.z[0][j]] += com.fpatt[j]/(2.*com.ls);
-            com.pi[(int)com.z[1][j]] += com.fpatt[j]/(2.*com.ls);
-
-         }
-         GetCodonFreqs2 ();
-
-         distance3pos(dHKY, kHKY, &sites4, com.z[0], com.z[1]);
-
-         np = com.np = (com.ntime=1) + com.nkappa + !com.fix_omega;
-         NFunCall = 0;
-
-         /* initial values and bounds */
-         x[0] = SeqDistance[is*(is-1)/2+js]*(0.8+0.3*rndu());
-         if(x[0]>3) x[0]=1.5+rndu();
-         if(x[0]<1e-6) x[0]=.5*rndu();
-         if(com.nkappa==1) { /* HKY type model */
-            if(is==0 && js==1)  x[1] = (com.icode==1?4:1.5)+rndu();
-            else                x[1] = (x[1]*2+2+rndu())/3;
-            if(x[1]>10) x[1] = 5;
-            xb[1][0] = 0.4;
-         }
-         else         /* REV or FMutSel models, do something later */
-            for(j=1,x[1]=.8+.4*rndu(); j<com.nkappa; j++)
-               x[1+j] = .2+.4*rndu();
-
-         if(!com.fix_omega) {
-            k = 1+com.nkappa;
-            if(is==0 && js==0) x[k] = 0.2+0.2*rndu();
-            else               x[k] = (3*x[k]+0.6*rndu())/4;
-            x[k] = max2(x[k],0.01);
-            x[k] = min2(x[k],2);
-         }
-
-         if(noisy>=9) {
-            FPN(F0);  FOR(k,np) printf(" %12.6f",x[k]); FPN(F0);
-            FOR(k,np) printf(" %12.6f",xb[k][0]); FPN(F0);
-            FOR(k,np) printf(" %12.6f",xb[k][1]); FPN(F0);
-         }
-         
+         com.np = np;  com.ntime = 1;
+         lnL = row[0];
+         xtoy(row+1, x, 10);
+         if(np && com.getSE) xtoy(row+11, var, np*np);
          if(com.fix_kappa && com.fix_omega)  
             eigenQcodon(1,-1,NULL,NULL,NULL,Root,U,V, &mr, com.pkappa,com.omega,PMat);
-
-
-         if( com.runmode == -3 ){ //kostas, save values 
-            x[4] = x[0];  
-            x[5] = x[2];  
-         }
-
-
-         if(np)
-            ming2(noisy>3?frub:NULL, &lnL, lfun2dSdN, NULL, x, xb, space, e, np);
-         else {  x[1]=x[2]=com.kappa=com.omega=0; lnL=0; }
+         if(np) lfun2dSdN(x, np);    /* sets kappa and omega */
+         else   com.kappa = com.omega = 0;
          
          lnLmodel = lnL;
          fprintf(fout,"\nlnL =%12.6f\n",-lnL);
@@ -4648,8 +5823,6 @@ int PairwiseCodon (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double space[])
          }
 
          if (np && com.getSE) {
-            Hessian(np, x, lnL, space, var, lfun2dSdN, var+np*np);
-            matinv(var, np, np, var+np*np);
             fprintf(fout,"SEs for parameters:\n");
             FOR(k,np) fprintf(fout," %8.5f",(var[k*np+k]>0.?sqrt(var[k*np+k]):-0));
             FPN(fout);
@@ -4658,6 +5831,7 @@ int PairwiseCodon (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double space[])
          eigenQcodon(2,x[0],&S,&dS,&dN, NULL,NULL,NULL, &mr, com.pkappa,com.omega,PMat);
 
          if(noisy>=3) {
+            distance3pos(dHKY, kHKY, &sites4, com.z[0], com.z[1]);
             puts("\nNucleotide-based analysis (approximate MLEs; use baseml to get proper MLEs):");
             printf("\ndHKY (123-4):");  FOR (k,4) printf(" %8.5f", dHKY[k]);
             printf("\nkHKY (123-4):");  FOR (k,4) printf(" %8.5f", kHKY[k]);
@@ -4732,6 +5906,7 @@ int PairwiseCodon (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double space[])
 
    com.ls = (int)ls0;   FOR(k,com.ns) com.z[k] = pz0[k];  
    com.npatt = npatt0;  FOR(h,npatt0) com.fpatt[h] = fpatt0[h];  free(fpatt0);
+   free(out);
    return (0);
 }
 
@@ -5160,6 +6335,36 @@ for(k=0; k<3; k++) {
 }
 
 
+static void PairwiseAAPoint (int ipair, double out[])
+{
+/* out[0] is the distance for pair _pairk0+ipair, which is one of the pairs 
+   done by FunPoints() for PairwiseAA().
+*/
+   int n=com.ncode, k=_pairk0+ipair, is,js, j;
+   double x, xb[2]={0,19}, lnL, step;
+
+   PairIndex(k, &is, &js);
+   if(com.model==REVaa) {
+      SetSeed(_pairseed+k, 0);
+      out[0] = PairwiseAArev(is, js);
+      return;
+   }
+   com.z[0]=_pz0[is]; com.z[1]=_pz0[js]; 
+   if(com.model==1||com.model==Empirical_F) {
+      for (j=0,zero(com.pi,n); j<com.npatt; j++) {
+         com.pi[(int)com.z[0][j]]+=com.fpatt[j];
+         com.pi[(int)com.z[1][j]]+=com.fpatt[j];
+      }
+      abyx(1./sum(com.pi,n), com.pi, n);
+      eigenQaa(NULL,Root,U,V,NULL);
+   }
+   /* com.posG[1]=com.npatt; */
+
+   xb[0]=SeqDistance[is*(is-1)/2+js];  x=xb[0]*1.5;  step=xb[0];
+   LineSearch(lfun2AA, &lnL, &x, xb, step, 1e-7);
+   out[0] = x;
+}
+
 int PairwiseAA (FILE *fout, FILE*f2AA)
 {
 /* Calculates pairwise distances using amino acid seqs.
@@ -5167,10 +6372,11 @@ int PairwiseAA (FILE *fout, FILE*f2AA)
    com.npatt for the whole data set is used which may be greater than 
    the number of patterns for each pair.
    SE is not calculated.
+   The pairs are done PAIRBLOCK at a time by FunPoints(), as in PairwiseCodon().
 */
    char *pz0[NS];
-   int n=com.ncode, j, is,js;
-   double x, xb[2]={0,19}, lnL, step;
+   int n=com.ncode, j, is,js, ipair,npair=com.ns*(com.ns-1)/2, k0=0,k1=0;
+   double x, *out;
 
    if (com.ngene>1 && com.Mgene==1) error2("ngene>1 to be tested.");
    if (noisy) printf("\npairwise ML distances of AA seqs.\n\n");
@@ -5183,6 +6389,8 @@ int PairwiseAA (FILE *fout, FILE*f2AA)
       eigenQaa(NULL, Root, U, V, NULL);
 
    FOR(j,com.ns) pz0[j]=com.z[j];
+   if((out=(double*)malloc(PAIRBLOCK*sizeof(double)))==NULL) error2("oom PairwiseAA");
+   _pz0 = pz0;  _pairseed = 1+(int)(rndu()*1e8);
    fprintf(fout,"\nML distances of aa seqs.\n");
    if(com.alpha) 
       fprintf(fout,"\nContinuous gamma with alpha = %.3f is used (ncatG is ignored).\n\n",com.alpha);
@@ -5193,32 +6401,18 @@ int PairwiseAA (FILE *fout, FILE*f2AA)
       fprintf(f2AA,"%-14s ", com.spname[is]);
       fprintf(fout,"%-14s ", com.spname[is]);
       for(js=0; js<is; js++) {
-
-         if(com.model==REVaa) {
-            x = PairwiseAArev(is, js);
-            fprintf(f2AA," %7.4f",x); fprintf(fout," %7.4f",x); 
-            continue;
-         }
-
-         com.z[0]=pz0[is]; com.z[1]=pz0[js]; 
-         printf (" %2d", js+1);
-         if(com.model==1||com.model==Empirical_F) {
-            for (j=0,zero(com.pi,n); j<com.npatt; j++) {
-               com.pi[(int)com.z[0][j]]+=com.fpatt[j];
-               com.pi[(int)com.z[1][j]]+=com.fpatt[j];
-            }
-            abyx(1./sum(com.pi,n), com.pi, n);
-            eigenQaa(NULL,Root,U,V,NULL);
+         ipair = is*(is-1)/2+js;
+         if(ipair>=k1) {
+            k0 = _pairk0 = ipair;  k1 = min2(k0+PAIRBLOCK, npair);
+            FunPoints(k1-k0, 1, out, PairwiseAAPoint, NULL);
          }
-         /* com.posG[1]=com.npatt; */
-
-         xb[0]=SeqDistance[is*(is-1)/2+js];  x=xb[0]*1.5;  step=xb[0];
-         LineSearch(lfun2AA, &lnL, &x, xb, step, 1e-7);
+         x = out[ipair-k0];
+         if(com.model!=REVaa) printf (" %2d", js+1);
          fprintf(f2AA," %7.4f",x); fprintf(fout," %7.4f",x); 
-         if (com.getSE) ;
       }  /* for (js) */
    }     /* for (is) */
 
+   free(out);
    FOR(j,com.ns) com.z[j]=pz0[j];
    return (0);
 }
@@ -5723,6 +6917,7 @@ void SimulateData2s61(void)
 
    com.icode=0; com.seqtype=1; com.ns=2;
    com.ncode=n; com.cleandata=1; setmark_61_64 ();
+   AllocSeqs(com.ns);
    for(j=0; j<com.ns; j++)
       com.z[j] = (char*) malloc(npatt0*sizeof(char));
    if(com.z[com.ns-1]==NULL) error2("oom z");
@@ -5940,6 +7135,7 @@ scanf ("%d", &fcodon);
    matout(frst,f3x4,3,4);
    com.icode=0; com.seqtype=1; com.ns=2; com.ls=1; npatt0=n*(n+1)/2;
    com.ncode=n; setmark_61_64 ();
+   AllocSeqs(com.ns);
    FOR(j,com.ns) com.z[j]=(char*) malloc(npatt0*sizeof(char));
    if(com.z[com.ns-1]==NULL) error2 ("oom z");
    if((com.fpatt=(double*)malloc(npatt0*sizeof(double)))==NULL)
@@ -6512,14 +7708,14 @@ int lfunNSsites_M2M8 (FILE* frst, double x[], int np)
    double p_beta_b[]={0,2}, q_beta_b[]={0,2};
 
    int dim=(com.NSsites==8||M2a?4:3), ngrid,igrid, ip[4]={0}, j,k,h, it;
-   int refsp=0, ncatG0=com.ncatG;
+   int refsp=0, ncatG0=com.ncatG, nthreads=max2(com.numOfThreads,1), ndone=0;
    /* # of site classes under model and index for site class */
    int nclassM = (com.NSsites==NSpselection?3:n1d+1), iclassM, *iw;
    double para[4][100]={{0}}, postpara[4][100];  /* paras on grid for 4-d integral: n1d<=100! */
    /* lnfXs is log of term in equation 5 in YWN05, which sums over those terms. */
    double fh, fX, *lnfXs,S1,S2, *lnprior, *pclassM, *meanw, *varw, *postSite, *postp0p1=NULL;
-   double fh1site, t,v;
-   char timestr[32], *paras[4];
+   double fh1site, t,v, *wgrid, *fhKh, *fhs;
+   char timestr[32], *paras[4], *ok;
 
    printf("\nBEBing (dim = %d).  This may take several minutes.", dim);
 
@@ -6537,8 +7733,9 @@ int lfunNSsites_M2M8 (FILE* frst, double x[], int np)
 
    if(ternary && (postp0p1=(double*)malloc(n1d*n1d*sizeof(double)))==NULL)
       error2("oom postp0p1");
-   if((lnfXs=(double*)malloc(ngrid*sizeof(double)))==NULL)
+   if((lnfXs=(double*)malloc(ngrid*2*sizeof(double)+ngrid))==NULL)
       error2("oom lnfXs");
+   wgrid = lnfXs+ngrid;  ok = (char*)(wgrid+ngrid);
    if((pclassM=(double*)malloc(ngrid*nclassM*(sizeof(double)+sizeof(int))))==NULL)
       error2("oom pclassM");  /* this wastes space */
    iw = (int*)(pclassM+ngrid*nclassM);
@@ -6547,6 +7744,7 @@ int lfunNSsites_M2M8 (FILE* frst, double x[], int np)
 
    k=com.npatt*com.ncatG*sizeof(double);
    if((com.fhK=(double*)realloc(com.fhK,k))==NULL) error2("oom fhK");
+   if((fhKh=(double*)malloc(k))==NULL) error2("oom fhKh");
 
    for(j=0; j<n1d*n1d; j++) lnprior[j]=0;
    if(com.NSsites==8 && trianglePriorM8) {
@@ -6560,37 +7758,56 @@ int lfunNSsites_M2M8 (FILE* frst, double x[], int np)
    BayesEB=1;
    get_grid_para_like_M2M8(para, n1d, dim, M2a, ternary, p0b, p1b, w0b, wsb, p_beta_b, q_beta_b, x, &S1);
 
-   /* Set up im and pclassM, for each igrid and iclassM. */
+   /* Set up im and pclassM, for each igrid and iclassM.  ok[igrid]=0 marks 
+      the unfeasible points. */
    for(igrid=0; igrid<ngrid; igrid++) {
       for(j=dim-1,it=igrid; j>=0; j--) { ip[j]=it%n1d; it/=n1d; }
-      if(com.NSsites==2 && !ternary && para[0][ip[0]]+para[1][ip[1]]>1) continue;
+      ok[igrid] = !(com.NSsites==2 && !ternary && para[0][ip[0]]+para[1][ip[1]]>1);
+      if(!ok[igrid]) continue;
       for(k=0; k<nclassM; k++) {
          get_pclassM_iw_M2M8(&iw[igrid*nclassM+k], &pclassM[igrid*nclassM+k],k,ip,para,n1d,M2a,ternary);
       }
    }
 
    /* calculate log{fX}, where fX is the marginal probability of data,
-      and posterior of parameters postpara[].  S2 is the scale factor. */
+      and posterior of parameters postpara[].  S2 is the scale factor.  
+      lnfXs[] for the grid points are independent and are calculated in 
+      parallel, each summing over the site patterns in the same order as 
+      before, with f(x_h) for all h accumulated over the site classes in one 
+      contiguous sweep of fhK[].  The scaling that follows is sequential over 
+      the grid, so that the result does not depend on the number of threads.
+   */
    printf("Calculating f(X), the marginal probability of data.\n");
+   #pragma omp parallel num_threads(nthreads) private(igrid, j, k, h, it, ip, fhs)
+   {
+      if((fhs=(double*)malloc(com.npatt*sizeof(double)))==NULL) error2("oom fhs");
+      #pragma omp for schedule(dynamic,16)
+      for(igrid=0; igrid<ngrid; igrid++) {
+         if(!ok[igrid]) continue;
+         for(h=0; h<com.npatt; h++) fhs[h]=0;
+         for(k=0; k<nclassM; k++) {
+            double pk=pclassM[igrid*nclassM+k], *fk=com.fhK+iw[igrid*nclassM+k]*com.npatt;
+            for(h=0; h<com.npatt; h++)
+               fhs[h] += pk*fk[h];
+         }
+         for(h=0,lnfXs[igrid]=0; h<com.npatt; h++) {
+            if(fhs[h]<1e-300) {
+               printf("strange: f[%3d] = %12.6g very small.\n",h,fhs[h]);
+               continue;
+            }
+            lnfXs[igrid] += log(fhs[h])*com.fpatt[h];
+         }
+         for(j=dim-1,it=igrid; j>=0; j--) { ip[j]=it%n1d; it/=n1d; }
+         lnfXs[igrid] += (com.NSsites==8 ? lnprior[ip[0]] : lnprior[ip[0]*n1d+ip[1]]);
+      }
+      free(fhs);
+   }
    fX=1;  S2=-1e300;
    FOR(j,dim) FOR(k,n1d) postpara[j][k]=1;
    if(ternary) FOR(k,n1d*n1d) postp0p1[k]=1;
    for(igrid=0; igrid<ngrid; igrid++) {
+      if(!ok[igrid]) continue;
       for(j=dim-1,it=igrid; j>=0; j--) { ip[j]=it%n1d; it/=n1d; }
-      if(com.NSsites==2 && !ternary && para[0][ip[0]]+para[1][ip[1]]>1) 
-         continue;
-      for(h=0,lnfXs[igrid]=0; h<com.npatt; h++) {
-         for(k=0,fh=0; k<nclassM; k++)
-            fh += pclassM[igrid*nclassM+k]*com.fhK[iw[igrid*nclassM+k]*com.npatt+h];
-
-         if(fh<1e-300) {
-            printf("strange: f[%3d] = %12.6g very small.\n",h,fh);
-            continue;
-         }
-
-         lnfXs[igrid] += log(fh)*com.fpatt[h];
-      }
-      lnfXs[igrid] += (com.NSsites==8 ? lnprior[ip[0]] : lnprior[ip[0]*n1d+ip[1]]);
       t=lnfXs[igrid]-S2;
       if(t>0) {    /* change scale factor S2 */
          t = (t<200 ? exp(-t) : 0);
@@ -6626,58 +7843,49 @@ int lfunNSsites_M2M8 (FILE* frst, double x[], int np)
    printf("\tlog(fX) = %12.6f  S = %12.6f %12.6f\n", fX+S1-dim*log(n1d*1.),S1,S2);
 
    /* calculate posterior probabilities and mean w for each site pattern.
-      S1 and S2 are scale factors for probabilities and for w. */
+      The term for grid point igrid and site class iclassM is 
+      f(x_h|class)*pclassM/f(x_h) * f(X|grid)/f(X), and the second factor, 
+      wgrid[igrid], does not depend on h, so it is calculated once here, 
+      without the scale factors that were kept for each site.  f(x_h) is 
+      calculated once for each grid point rather than for each site class, 
+      and fhK[] is transposed into fhKh[] so that the site classes for a site 
+      are contiguous.  The site patterns are done in parallel.
+   */
    printf("Calculating f(w|X), posterior probabilities of site classes.\n");
+   for(igrid=0; igrid<ngrid; igrid++)
+      wgrid[igrid] = (ok[igrid] ? exp(lnfXs[igrid]-fX) : 0);
+   for(k=0; k<com.ncatG; k++)
+      for(h=0; h<com.npatt; h++)
+         fhKh[h*com.ncatG+k] = com.fhK[k*com.npatt+h];
+   #pragma omp parallel for num_threads(nthreads) private(h, igrid, iclassM, it, fh, fh1site, t, v) schedule(dynamic,1)
    for(h=0; h<com.npatt; h++) {
-      S1=-1e300;  FOR(j,nclassM) postSite[j*com.npatt+h]=1;
-      S2=-1e300;  meanw[h]=varw[h]=1;
-      for(iclassM=0; iclassM<nclassM; iclassM++) {
-         for(igrid=0; igrid<ngrid; igrid++) {
-            for(j=dim-1,it=igrid; j>=0; j--) { ip[j]=it%n1d; it/=n1d; }
-            if(com.NSsites==2 && !ternary && para[0][ip[0]]+para[1][ip[1]]>1) 
-               continue;
+      double *fk=fhKh+h*com.ncatG, post[100], mw=0, vw=0;
 
-            for(k=0,fh=0; k<nclassM; k++) /* duplicated calculation */
-               fh += pclassM[igrid*nclassM+k]*com.fhK[iw[igrid*nclassM+k]*com.npatt+h];
-
-            it = igrid*nclassM+iclassM;
-            fh1site = pclassM[it]*com.fhK[iw[it]*com.npatt+h];
-
-            if(fh1site<1e-300) continue;
-
-            fh1site /= fh;
-            t = log(fh1site)+lnfXs[igrid]; /* t is log of term on grid */
-            if(t>S1) {  /* change scale factor S1 */
-               for(j=0; j<nclassM; j++) 
-                  postSite[j*com.npatt+h] = postSite[j*com.npatt+h]*exp(S1-t);
-               S1 = t;
-            }
-            postSite[iclassM*com.npatt+h] += exp(t-S1);
-
-            t = fh1site*com.rK[iw[it]];
-            v = fh1site*square(com.rK[iw[it]]);
-            if(t<1e-300) continue;
-            t = log(t)+lnfXs[igrid]; /* t is log of mean */
-            v = log(v)+lnfXs[igrid];
-            if(t>S2) {  /* change scale factor S2 */
-               meanw[h] = meanw[h]*exp(S2-t);
-               varw[h]  = varw[h]*exp(S2-t);
-               S2 = t;
-            }
-            meanw[h] += exp(t-S2);
-            varw[h]  += exp(v-S2);
+      for(iclassM=0; iclassM<nclassM; iclassM++) post[iclassM]=0;
+      for(igrid=0; igrid<ngrid; igrid++) {
+         if(wgrid[igrid]==0) continue;
+         it = igrid*nclassM;
+         for(iclassM=0,fh=0; iclassM<nclassM; iclassM++)
+            fh += pclassM[it+iclassM]*fk[iw[it+iclassM]];
+         if(fh<1e-300) continue;
+         t = wgrid[igrid]/fh;
+         for(iclassM=0; iclassM<nclassM; iclassM++) {
+            fh1site = t*pclassM[it+iclassM]*fk[iw[it+iclassM]];
+            v = com.rK[iw[it+iclassM]];
+            post[iclassM] += fh1site;
+            mw += fh1site*v;
+            vw += fh1site*v*v;
          }
       }
+      for(iclassM=0; iclassM<nclassM; iclassM++) 
+         postSite[iclassM*com.npatt+h] = post[iclassM];
+      meanw[h] = mw;
+      vw -= mw*mw;
+      varw[h] = (vw>0?sqrt(vw):0);
 
-      for(j=0; j<nclassM; j++) 
-         postSite[j*com.npatt+h] *= exp(S1-fX);
-      meanw[h] *= exp(S2-fX);
-      varw[h]  *= exp(S2-fX);
-      varw[h] -= meanw[h]*meanw[h];
-      varw[h] = (varw[h]>0?sqrt(varw[h]):0);
-
-      if((h+1)%10==0 || h==com.npatt-1)
-         printf("\r\tdid %3d / %3d patterns  %s", h+1,com.npatt,printtime(timestr));
+      #pragma omp critical (BEBprogress)
+      if(++ndone%10==0 || ndone==com.npatt)
+         printf("\r\tdid %3d / %3d patterns  %s", ndone,com.npatt,printtime(timestr));
    }  /* for(h) */
 
    /* print out posterior probabilities */
@@ -6711,7 +7919,7 @@ int lfunNSsites_M2M8 (FILE* frst, double x[], int np)
    }
 
    BayesEB = 0;
-   free(meanw);  free(lnfXs);  free(pclassM);  free(lnprior);
+   free(meanw);  free(lnfXs);  free(pclassM);  free(lnprior);  free(fhKh);
    if(ternary) free(postp0p1);
    return(0);
 }
@@ -28,6 +28,7 @@
 #define spaceming2(n) ((n)*((n)*2+9+2)*sizeof(double))
 
 int ReadSeq (FILE *fout, FILE *fseq, int cleandata, int locus);
+void AllocSeqs (int ns);
 int ScanFastaFile(FILE *f, int *ns, int *ls, int *aligned);
 void EncodeSeqs (void);
 void SetMapAmbiguity(void);
@@ -43,6 +44,18 @@ double getRoot(double (*f)(double), double (*df)(double), double initVal);
 int f_and_x(double x[], double f[], int n, int fromx, int LastItem);
 void bigexp(double lnx, double *a, double *b);
 void SetSeed (int seed, int PrintSeed);
+struct RNG {
+   unsigned int key[2], ctr[4], out[4];
+   int next;
+};
+int RNGCheck (void);
+void RNGInit (struct RNG *r, int seed, unsigned long long stream);
+double RNGUniform (struct RNG *r);
+void RNGUniforms (struct RNG *r, double u[], int n);
+double RNGNormal (struct RNG *r);
+void RNGNormals (struct RNG *r, double x[], int n);
+double RNGGamma (struct RNG *r, double a);
+void RNGGammas (struct RNG *r, double a, double x[], int n);
 double rndu (void);
 void rndu_vector (double r[], int n);
 void randorder(int order[], int n, int space[]);
@@ -159,6 +172,8 @@ int PMatK80 (double P[], double t, double kapa);
 int PMatT92 (double P[], double t, double kappa, double pGC);
 int PMatTN93 (double P[], double a1t, double a2t, double bt, double pi[]);
 int PMatUVRoot (double P[],double t,int n,double U[],double V[],double Root[]);
+int PMatUVRootBatch (double P[],double t[],int nt,int n,double U[],double V[],double Root[],double space[]);
+int dPMatUVRoot (double dP[],double t,int n,double U[],double V[],double Root[]);
 int PMatCijk (double PMat[], double t);
 int PMatQRev(double P[], double pi[], double t, int n, double space[]);
 int EvolveHKY85 (char source[], char target[], int ls, double t, 
@@ -246,9 +261,16 @@ double bound (int nx, double x0[], double p[], double x[],
     int (*testx) (double x[], int nx));
 int gradient (int n, double x[], double f0, double g[], 
     double (* fun)(double x[],int n), double space[], int Central);
+int gradientBPart (int i0, int n, double x[], double f0, double g[], 
+    double (*fun)(double x[],int n), double space[], int xmark[]);
+int ForkJobs (int njob, int nproc, void (*done)(int job, int ok, void *data), void *data);
 int Hessian (int nx, double x[], double f, double g[], double H[],
     double (*fun)(double x[], int n), double space[]);
 int HessianSKT2004 (double xmle[], double lnLm, double g[], double H[]);
+int HessianGradient (int n, double x[], double g[], double H[],
+    double (*fun)(double x[], int n), int (*dfun)(double x[], double *f, double dx[], int n));
+int FunPoints (int npoint, int nout, double out[], 
+    void (*point)(int ipoint, double out[]), char *label);
 
 int H_end (double x0[], double x1[], double f0, double f1, double e1, double e2, int n);
 double LineSearch(double(*fun)(double x),double *f,double *x0,double xb[2],double step,double e);
@@ -302,6 +324,9 @@ int LSDistance (double * ss, double x[], int (*testx)(double x[],int np));
 
 int SetUserDefDivergeDist(int *node1, int *node2, int numBranchPairs, double *pDivergent);
 double CalcDistance(int n1, int n2);
+int NumBranchPairs(void);
+int BitCount (unsigned long long x);
+void SiteStateSets (unsigned int set[]);
 
 int StepwiseAdditionMP (double space[]);
 double MPScoreStepwiseAddition (int is, double space[], int save);
@@ -331,6 +356,8 @@ int DownStatesOneNode (int ison, int father);
 int DownStates (int inode);
 int PathwayMP (FILE *fout, double space[]);
 double MPScore (double space[]);
+int MPPack (void);
+double MPFitch (unsigned long long U[], unsigned long long U1[], unsigned long long U2[]);
 double RemoveMPNinfSites (double *nsiteNinf);
 int MarkStopCodons(void);
 
@@ -371,7 +398,7 @@ void printSptree(void);
 
 enum {BASEseq=0, CODONseq, AAseq, CODON2AAseq, BINARYseq, BASE5seq} SeqTypes;
 
-enum {PrBranch=1, PrNodeNum=2, PrLabel=4, PrAge=8, PrOmega=16} OutTreeOptions;
+enum {PrBranch=1, PrNodeNum=2, PrLabel=4, PrAge=8, PrOmega=16, PrExact=32} OutTreeOptions;
 
 
 /* use mean (0; default) for discrete gamma instead of median (1) */
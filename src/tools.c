@@ -1,6 +1,10 @@
 /* tools.c 
 */
 #include "paml.h"
+#if (defined __unix__ || defined __APPLE__)
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
 
 /************************
              sequences 
@@ -82,6 +86,7 @@ int GeneticCode[][64] =
 
 
 int noisy=0, Iround=0, NFunCall=0, NEigenQ, NPMatUVRoot;
+void (*MinimizationRound)(int round, double f) = NULL;  /* called by ming2() each round, if set */
 double SIZEp=0;
 
 int blankline (char *str)
@@ -518,6 +523,7 @@ P(t) = U * exp{Root*t} * V
    double expt, uexpt, *pP;
    double smallp = 0;
 
+   #pragma omp atomic
    NPMatUVRoot++;
    if (t<-0.1) printf ("\nt = %.5f in PMatUVRoot", t);
    if (t<1e-100) {
@@ -543,6 +549,70 @@ P(t) = U * exp{Root*t} * V
 }
 
 
+int PMatUVRootBatch (double P[], double t[], int nt, int n, double U[], double V[], double Root[], double space[])
+{
+/* 
+P(t) = U * exp{Root*t} * V for the nt times in t[], into P[nt*n*n].  
+The exponentials are calculated together into space[nt*n].  Rows of P are 
+formed four at a time, so that each row of V is loaded once for the four 
+rows, with the same sums in the same order as PMatUVRoot().
+*/
+   int i,j,k,m;
+   double *expt=space, u0,u1,u2,u3, *pP, *p0,*p1,*p2,*p3, *pV;
+   double smallp = 0;
+
+   #pragma omp atomic
+   NPMatUVRoot += nt;
+   for (m=0; m<nt; m++)
+      for (k=0; k<n; k++)
+         expt[m*n+k] = exp(t[m]*Root[k]);
+   for (m=0; m<nt; m++,expt+=n) {
+      pP = P+(size_t)m*n*n;
+      if (t[m]<-0.1) printf ("\nt = %.5f in PMatUVRootBatch", t[m]);
+      if (t[m]<1e-100) {
+         identity (pP, n); 
+         continue;
+      }
+      zero (pP, n*n);
+      for (i=0; i+4<=n; i+=4) {
+         p0 = pP+i*n;  p1 = p0+n;  p2 = p1+n;  p3 = p2+n;
+         for (k=0,pV=V; k<n; k++,pV+=n) {
+            u0 = U[i*n+k]*expt[k];      u1 = U[(i+1)*n+k]*expt[k];
+            u2 = U[(i+2)*n+k]*expt[k];  u3 = U[(i+3)*n+k]*expt[k];
+            for (j=0; j<n; j++) {
+               p0[j] += u0*pV[j];  p1[j] += u1*pV[j];
+               p2[j] += u2*pV[j];  p3[j] += u3*pV[j];
+            }
+         }
+      }
+      for ( ; i<n; i++)    /* the remaining rows */
+         for (k=0,p0=pP+i*n,pV=V; k<n; k++,pV+=n)
+            for (j=0,u0=U[i*n+k]*expt[k]; j<n; j++)
+               p0[j] += u0*pV[j];
+      for (i=0; i<n*n; i++)
+         if (pP[i]<smallp)  pP[i] = 0;
+   }
+   return (0);
+}
+
+
+int dPMatUVRoot (double dP[], double t, int n, double U[], double V[], double Root[])
+{
+/* 
+dP(t)/dt = U * diag{Root*exp(Root*t)} * V
+*/
+   int i,j,k;
+   double expt, uexpt, *pP;
+
+   if (t<0) t = 0;
+   for (k=0,zero(dP,n*n); k<n; k++)
+      for (i=0,pP=dP,expt=Root[k]*exp(t*Root[k]); i<n; i++)
+         for (j=0,uexpt=U[i*n+k]*expt; j<n; j++)
+            *pP++ += uexpt*V[k*n+j];
+   return (0);
+}
+
+
 int PMatQRev(double Q[], double pi[], double t, int n, double space[])
 {
 /* This calculates P(t) = exp(Q*t), where Q is the rate matrix for a 
@@ -1377,6 +1447,217 @@ double rndu (void)
 
 #endif
 
+/* Counter-based random numbers, for use in parallel code.
+   rndu() and the samplers above share one stream, which cannot be used from 
+   threads, and replicates drawn from it depend on the order in which they are 
+   run.  Here the state is a struct RNG, which the caller owns.  Number i of 
+   stream s under seed is the Philox4x32-10 block cipher (Salmon et al. 2011, 
+   Proc. SC'11) applied to the counter (i, s) with the seed as the key, so that 
+   the streams for different s are independent, and any replicate, site, etc. 
+   can be given a stream of its own and drawn in any thread, in any order.  
+   The numbers then do not depend on the number of threads.  rndu() is kept 
+   as it was, as initial values and old seeds depend on it.
+*/
+
+static void Philox4x32 (unsigned int ctr[4], unsigned int key[2], unsigned int out[4])
+{
+   unsigned int c0=ctr[0], c1=ctr[1], c2=ctr[2], c3=ctr[3], k0=key[0], k1=key[1];
+   unsigned long long p0, p1;
+   int i;
+
+   for(i=0; i<10; i++) {
+      p0 = 0xD2511F53ULL*c0;
+      p1 = 0xCD9E8D57ULL*c2;
+      c0 = (unsigned int)(p1>>32) ^ c1 ^ k0;
+      c2 = (unsigned int)(p0>>32) ^ c3 ^ k1;
+      c1 = (unsigned int)p1;
+      c3 = (unsigned int)p0;
+      k0 += 0x9E3779B9;
+      k1 += 0xBB67AE85;
+   }
+   out[0] = c0;  out[1] = c1;  out[2] = c2;  out[3] = c3;
+}
+
+static void RNGBlock (struct RNG *r, unsigned int out[4])
+{
+   Philox4x32(r->ctr, r->key, out);
+   if(++r->ctr[0]==0) r->ctr[1]++;
+}
+
+int RNGCheck (void)
+{
+/* This checks Philox4x32() against the known-answer vectors of Salmon et al. 
+   (Random123 kat_vectors, philox4x32_10), and returns the number of vectors 
+   that do not match.  Callers should stop if it is not 0, as replicates 
+   drawn from a changed generator cannot be reproduced.
+*/
+   unsigned int ctr[3][4]={{0,0,0,0}, {0xffffffff,0xffffffff,0xffffffff,0xffffffff}, 
+                           {0x243f6a88,0x85a308d3,0x13198a2e,0x03707344}};
+   unsigned int key[3][2]={{0,0}, {0xffffffff,0xffffffff}, {0xa4093822,0x299f31d0}};
+   unsigned int kat[3][4]={{0x6627e8d5,0xe169c58d,0xbc57ac4c,0x9b00dbd8}, 
+                           {0x408f276d,0x41c83b0e,0xa20bc7c6,0x6d5451fd},
+                           {0xd16cfe09,0x94fdcceb,0x5001e420,0x24126ea1}}, out[4];
+   int i, nbad=0;
+
+   for(i=0; i<3; i++) {
+      Philox4x32(ctr[i], key[i], out);
+      nbad += (memcmp(out, kat[i], 4*sizeof(unsigned int)) != 0);
+   }
+   return(nbad);
+}
+
+#define RNGDouble(a,b)  (((a)>>5)*67108864.0 + ((b)>>6) + 0.5) / 9007199254740992.0
+
+void RNGInit (struct RNG *r, int seed, unsigned long long stream)
+{
+/* This starts stream on seed.  seed<=0 takes a seed from /dev/urandom, as in 
+   SetSeed().
+*/
+   FILE *frand;
+   int i;
+
+   if(seed <= 0) {
+      if((frand=fopen("/dev/urandom", "r")) == NULL) 
+         seed = 1234567891*(int)time(NULL) + 1;
+      else {
+         for(i=0,seed=0; i<sizeof(unsigned int); i++)
+            seed += (seed << 8) + getc(frand);
+         fclose(frand);
+      }
+   }
+   r->key[0] = (unsigned int)seed;
+   r->key[1] = 0x5DEECE66;
+   r->ctr[0] = r->ctr[1] = 0;
+   r->ctr[2] = (unsigned int)stream;
+   r->ctr[3] = (unsigned int)(stream>>32);
+   r->next = 4;
+}
+
+double RNGUniform (struct RNG *r)
+{
+/* U(0,1), with 53 random bits, never 0 or 1.
+*/
+   double u;
+
+   if(r->next>2) {
+      RNGBlock(r, r->out);
+      r->next = 0;
+   }
+   u = RNGDouble(r->out[r->next], r->out[r->next+1]);
+   r->next += 2;
+   return(u);
+}
+
+void RNGUniforms (struct RNG *r, double u[], int n)
+{
+/* This fills u[n] with the next n numbers from RNGUniform(), whole blocks at 
+   a time.
+*/
+   int i=0;
+   unsigned int w[4];
+
+   for( ; i<n && r->next<4; i++)
+      u[i] = RNGUniform(r);
+   for( ; i+1<n; i+=2) {
+      RNGBlock(r, w);
+      u[i]   = RNGDouble(w[0], w[1]);
+      u[i+1] = RNGDouble(w[2], w[3]);
+   }
+   for( ; i<n; i++)
+      u[i] = RNGUniform(r);
+}
+
+double RNGNormal (struct RNG *r)
+{
+/* N(0,1), as rndNormal().
+*/
+   double u, v, s;
+
+   do {
+      u = 2*RNGUniform(r) - 1;
+      v = 2*RNGUniform(r) - 1;
+      s = u*u + v*v;
+   } while (s>=1);
+   return (u*sqrt(-2*log(s)/s));
+}
+
+void RNGNormals (struct RNG *r, double x[], int n)
+{
+/* This fills x[n] with N(0,1) variates, using both of each pair from the 
+   polar method, so the numbers differ from those of repeated RNGNormal().
+*/
+   int i, j, nu;
+   double u[2*64+8], s;
+
+   for(i=0; i<n; ) {
+      nu = min2(2*(n-i)+8, 2*64+8);
+      RNGUniforms(r, u, nu);
+      for(j=0; j+1<nu && i<n; j+=2) {
+         u[j] = 2*u[j]-1;  u[j+1] = 2*u[j+1]-1;
+         s = u[j]*u[j] + u[j+1]*u[j+1];
+         if(s>=1) continue;
+         s = sqrt(-2*log(s)/s);
+         x[i++] = u[j]*s;
+         if(i<n) x[i++] = u[j+1]*s;
+      }
+   }
+}
+
+double RNGGamma (struct RNG *r, double a)
+{
+/* gamma(a, 1), as rndgamma() (Marsaglia & Tsang 2000).
+*/
+   double a0=a, c, d, u, v, x;
+
+   if(a<1) a ++;
+   d = a - 1.0/3.0;
+   c = (1.0/3.0) / sqrt(d);
+   for ( ; ; ) {
+      do {
+         x = RNGNormal(r);
+         v = 1.0 + c * x;
+      } while (v <= 0);
+      v *= v * v;
+      u = RNGUniform(r);
+      if (u < 1 - 0.0331 * x * x * x * x) 
+         break;
+      if (log(u) < 0.5 * x * x + d * (1 - v + log(v)))
+         break;
+   }
+   v *= d;
+   if(a0 < 1) 
+      v *= pow(RNGUniform(r), 1/a0);
+   return v;
+}
+
+void RNGGammas (struct RNG *r, double a, double x[], int n)
+{
+/* This fills x[n] with gamma(a, 1) variates.  The normal and uniform 
+   variates are drawn in blocks, and those left over are discarded.
+*/
+   int i, j, nb;
+   double a1=(a<1 ? a+1 : a), c, d, z[64], u[64+64], v;
+
+   d = a1 - 1.0/3.0;
+   c = (1.0/3.0) / sqrt(d);
+   for(i=0; i<n; ) {
+      nb = min2(n-i, 64);
+      RNGNormals(r, z, nb);
+      RNGUniforms(r, u, nb*2);
+      for(j=0; j<nb && i<n; j++) {
+         v = 1.0 + c * z[j];
+         if(v <= 0) continue;
+         v *= v * v;
+         if(u[j] >= 1 - 0.0331*z[j]*z[j]*z[j]*z[j] 
+            && log(u[j]) >= 0.5*z[j]*z[j] + d*(1 - v + log(v)))
+            continue;
+         v *= d;
+         if(a < 1) v *= pow(u[nb+j], 1/a);
+         x[i++] = v;
+      }
+   }
+}
+
 
 double rnduM0V1 (void)
 {
@@ -6216,29 +6497,303 @@ int gradientB (int n, double x[], double f0, double g[],
 extern int noisy, Iround;
 extern double SIZEp;
 
+int NFunProcesses=1;                /* processes for gradientB() */
+int (*FunProcessThreads)(int nthreads)=NULL;  /* threads for fun(), returns the old number */
+int *DfunXmark=NULL;                /* xmark[] of ming2(), for dfun() */
+
+static double gradientB1 (int i, int n, double x[], double f0, 
+    double (*fun)(double x[],int n), double space[], int xmark[])
+{
+/* derivative for x[i].  xmark=0: central; 1: upper; -1: down
+*/
+   int j, mark=(xmark ? xmark[i] : 0);
+   double *x0=space, *x1=space+n, eh0=Small_Diff, eh;  /* eh0=1e-6 || 1e-7 */
+
+   eh = eh0*(fabs(x[i])+1);
+   if (mark==0 && (AlwaysCenter || SIZEp<1)) {   /* central */
+      for(j=0; j<n; j++)  x0[j] = x1[j] = x[j];
+      eh = pow(eh, .67);  x0[i] -= eh;  x1[i] += eh;
+      return ((*fun)(x1,n) - (*fun)(x0,n))/(eh*2.0);
+   }
+   else  {                         /* forward or backward */
+      for(j=0; j<n; j++)  x1[j] = x[j];
+      if (mark) eh *= -mark;
+      x1[i] += eh;
+      return ((*fun)(x1,n) - f0)/eh;
+   }
+}
+
+#if (defined __unix__ || defined __APPLE__)
+
+static int gradientBFork (int i0, int n, double x[], double f0, double g[], 
+    double (*fun)(double x[],int n), double space[], int xmark[])
+{
+/* This is gradientBPart() with the derivatives x[i0], ..., x[n-1] shared among 
+   NFunProcesses processes.  Process ip calculates g[i] for i = i0+ip, 
+   i0+ip+nproc, ..., and the forked processes (ip>0) send them back through 
+   a pipe.  Each forked process has a copy of all the globals, so fun() need 
+   not be reentrant, and as every g[i] is calculated in the same way as in 
+   the serial loop, the result is the same.  If a process fails, the parent 
+   does its share.  Every process, the parent included, runs fun() with one 
+   thread, as the processes share the cores.
+*/
+   int nproc=min2(NFunProcesses, n-i0), nthreads0=0, ip, i, k, *fd;
+   pid_t *pid;
+   double gi;
+
+   fd = (int*)malloc(nproc*2*sizeof(int));
+   pid = (pid_t*)malloc(nproc*sizeof(pid_t));
+   if(fd==NULL || pid==NULL) { free(fd); free(pid); return(-1); }
+
+   fflush(NULL);
+   for(ip=1; ip<nproc; ip++) {
+      pid[ip] = -1;
+      if(pipe(fd+ip*2)) continue;
+      if((pid[ip]=fork()) == 0) {
+         close(fd[ip*2]);
+         if(FunProcessThreads) (*FunProcessThreads)(1);
+         for(i=i0+ip; i<n; i+=nproc) {
+            gi = gradientB1(i, n, x, f0, fun, space, xmark);
+            if(write(fd[ip*2+1], &gi, sizeof(double)) != sizeof(double)) break;
+         }
+         _exit(0);
+      }
+      close(fd[ip*2+1]);
+      if(pid[ip]<0) close(fd[ip*2]);
+   }
+   if(FunProcessThreads) nthreads0 = (*FunProcessThreads)(1);
+   for(i=i0; i<n; i+=nproc)
+      g[i] = gradientB1(i, n, x, f0, fun, space, xmark);
+   for(ip=1; ip<nproc; ip++) {
+      i = i0+ip;
+      if(pid[ip]>0) {
+         for( ; i<n; i+=nproc) {
+            for(k=0; k<(int)sizeof(double); ) {
+               int r = read(fd[ip*2], (char*)&gi+k, sizeof(double)-k);
+               if(r<=0) break;
+               k += r;
+            }
+            if(k<(int)sizeof(double)) break;
+            g[i] = gi;
+         }
+         close(fd[ip*2]);
+         waitpid(pid[ip], NULL, 0);
+      }
+      for( ; i<n; i+=nproc)
+         g[i] = gradientB1(i, n, x, f0, fun, space, xmark);
+   }
+   if(FunProcessThreads) (*FunProcessThreads)(nthreads0);
+   free(fd);  free(pid);
+   return(0);
+}
+#endif
+
+int gradientBPart (int i0, int n, double x[], double f0, double g[], 
+    double (*fun)(double x[],int n), double space[], int xmark[])
+{
+/* This calculates g[i0], ..., g[n-1], as in gradientB().  xmark=NULL means 
+   that no parameter is at the boundary.  With NFunProcesses>1, the 
+   function calls are shared by forked processes.
+*/
+   int i;
+
+#if (defined __unix__ || defined __APPLE__)
+   if(NFunProcesses>1 && n-i0>1)
+      if(gradientBFork(i0, n, x, f0, g, fun, space, xmark)==0)
+         return(0);
+#endif
+   for(i=i0; i<n; i++)
+      g[i] = gradientB1(i, n, x, f0, fun, space, xmark);
+   return(0);
+}
+
 int gradientB (int n, double x[], double f0, double g[], 
     double (*fun)(double x[],int n), double space[], int xmark[])
 {
 /* f0=fun(x) is always provided.
    xmark=0: central; 1: upper; -1: down
 */
-   int i,j;
-   double *x0=space, *x1=space+n, eh0=Small_Diff, eh;  /* eh0=1e-6 || 1e-7 */
+   return gradientBPart(0, n, x, f0, g, fun, space, xmark);
+}
 
-   for(i=0; i<n; i++) {
-      eh = eh0*(fabs(x[i])+1);
-      if (xmark[i]==0 && (AlwaysCenter || SIZEp<1)) {   /* central */
-         for(j=0; j<n; j++)  x0[j] = x1[j] = x[j];
-         eh = pow(eh, .67);  x0[i] -= eh;  x1[i] += eh;
-         g[i] = ((*fun)(x1,n) - (*fun)(x0,n))/(eh*2.0);
+int ForkJobs (int njob, int nproc, void (*done)(int job, int ok, void *data), void *data)
+{
+/* This runs jobs 0, 1, ..., njob-1 in forked processes, up to nproc at a time, 
+   for analyses that are too large to be shared as in gradientBFork(), such as 
+   whole genes or replicate data sets.  Like fork(), it returns twice.  In the 
+   process for job i, it returns i at once, and the process should do the job 
+   and exit, with status 0 if the job succeeded.  In this process, it calls 
+   done(i, ok, data) for each job as it finishes, with ok=1 if the process 
+   exited with status 0, and returns -1 when all the jobs have finished.
+*/
+#if (defined __unix__ || defined __APPLE__)
+   pid_t pid, *pids=(pid_t*)malloc(max2(njob,1)*sizeof(pid_t));
+   int status, nrun=0, i, j;
+
+   if(pids==NULL) error2("oom ForkJobs");
+   fflush(NULL);
+   for(i=0; i<njob || nrun; ) {
+      if(i<njob && nrun<nproc) {
+         if((pid=fork()) == 0) {
+            free(pids);
+            return(i);
+         }
+         if(pid<0) error2("fork failed in ForkJobs");
+         pids[i++] = pid;  nrun++;
+         continue;
+      }
+      if((pid=wait(&status))<=0) break;
+      for(j=0; j<i && pids[j]!=pid; j++) ;
+      if(j==i) continue;     /* not one of the jobs */
+      nrun--;
+      if(done) (*done)(j, WIFEXITED(status) && WEXITSTATUS(status)==0, data);
+   }
+   free(pids);
+#else
+   error2("ForkJobs needs fork()");
+#endif
+   return(-1);
+}
+
+static int FunPointsRead (int fd, double out[], int nout)
+{
+   int k, r, size=nout*sizeof(double);
+
+   for(k=0; k<size; k+=r)
+      if((r=read(fd, (char*)out+k, size-k)) <= 0) return(-1);
+   return(0);
+}
+
+int FunPoints (int npoint, int nout, double out[], 
+    void (*point)(int ipoint, double out[]), char *label)
+{
+/* This calls point(i, out+i*nout) for i = 0, ..., npoint-1, as for the 
+   stencil points of a finite-difference Hessian.  The points are shared among 
+   NFunProcesses processes as in gradientBFork(): process ip does points ip, 
+   ip+nproc, ..., each in its own copy of the likelihood state, and sends 
+   out[] back through a pipe.  The parent reports progress and the estimated 
+   time remaining, from its own share, under label if noisy.  NFunProcesses 
+   is 1 while the points are done, so that point() does not fork again, and 
+   with more than one process, each runs point() with one thread.
+*/
+   int nproc=max2(1, min2(NFunProcesses, npoint)), nfun0=NFunProcesses, nthreads0=0, ip, i, *fd=NULL;
+   pid_t *pid=NULL;
+   time_t t0=time(NULL), t;
+   char timestr[2][32];
+
+   NFunProcesses = 1;
+#if (defined __unix__ || defined __APPLE__)
+   if(nproc>1) {
+      fd = (int*)malloc(nproc*2*sizeof(int));
+      pid = (pid_t*)malloc(nproc*sizeof(pid_t));
+      if(fd==NULL || pid==NULL) { free(fd); free(pid); fd=NULL; pid=NULL; nproc=1; }
+   }
+   fflush(NULL);
+   for(ip=1; ip<nproc; ip++) {
+      pid[ip] = -1;
+      if(pipe(fd+ip*2)) continue;
+      if((pid[ip]=fork()) == 0) {
+         close(fd[ip*2]);
+         if(FunProcessThreads) (*FunProcessThreads)(1);
+         for(i=ip; i<npoint; i+=nproc) {
+            (*point)(i, out+(size_t)i*nout);
+            if(write(fd[ip*2+1], out+(size_t)i*nout, nout*sizeof(double)) != nout*sizeof(double)) break;
+         }
+         _exit(0);
+      }
+      close(fd[ip*2+1]);
+      if(pid[ip]<0) close(fd[ip*2]);
+   }
+#else
+   nproc = 1;
+#endif
+   if(nproc>1 && FunProcessThreads) nthreads0 = (*FunProcessThreads)(1);
+   for(i=0; i<npoint; i+=nproc) {
+      (*point)(i, out+(size_t)i*nout);
+      if(noisy && label) {
+         ip = min2(i+nproc, npoint);
+         t = time(NULL)-t0;
+         t = (time_t)(t*(npoint-ip)/(double)ip);
+         sprintf(timestr[1], "%d:%02d", (int)t/60, (int)t%60);
+         printf("\r%s: %d/%d points, %s, %s left  ", label, ip, npoint, printtime(timestr[0]), timestr[1]);
+         fflush(stdout);
       }
-      else  {                         /* forward or backward */
-         for(j=0; j<n; j++)  x1[j] = x[j];
-         if (xmark[i]) eh *= -xmark[i];
-         x1[i] += eh;
-         g[i] = ((*fun)(x1,n) - f0)/eh;
+   }
+#if (defined __unix__ || defined __APPLE__)
+   for(ip=1; ip<nproc; ip++) {
+      i = ip;
+      if(pid[ip]>0) {
+         for( ; i<npoint; i+=nproc)
+            if(FunPointsRead(fd[ip*2], out+(size_t)i*nout, nout)) break;
+         close(fd[ip*2]);
+         waitpid(pid[ip], NULL, 0);
       }
+      for( ; i<npoint; i+=nproc)
+         (*point)(i, out+(size_t)i*nout);
    }
+   free(fd);  free(pid);
+#endif
+   if(nproc>1 && FunProcessThreads) (*FunProcessThreads)(nthreads0);
+   NFunProcesses = nfun0;
+   if(noisy && label) FPN(F0);
+   return(0);
+}
+
+static int HessianGradient_n;
+static double *HessianGradient_x, *HessianGradient_h;
+static double (*HessianGradient_fun)(double x[], int n);
+static int (*HessianGradient_dfun)(double x[], double *f, double dx[], int n);
+
+static void HessianGradientPoint (int ipoint, double g[])
+{
+/* g[] at x[] with x[j] moved by -h[j] (ipoint=2j) or +h[j] (ipoint=2j+1).
+*/
+   int n=HessianGradient_n, j=ipoint/2;
+   double f, *x=(double*)malloc(n*sizeof(double));
+
+   if(x==NULL) error2("oom HessianGradientPoint");
+   xtoy(HessianGradient_x, x, n);
+   x[j] += (ipoint%2 ? 1 : -1)*HessianGradient_h[j];
+   f = (*HessianGradient_fun)(x, n);
+   (*HessianGradient_dfun)(x, &f, g, n);
+   free(x);
+}
+
+int HessianGradient (int n, double x[], double g[], double H[],
+    double (*fun)(double x[], int n), 
+    int (*dfun)(double x[], double *f, double dx[], int n))
+{
+/* Hessian matrix H[n*n] and gradient g[n] of the function at x[] by central 
+   differences of the gradient from dfun(), which needs 2*n gradient calls 
+   instead of the 2*n*n function calls in Hessian().  The step is that of 
+   the central differences in gradientB().  The 2*n points are done by 
+   FunPoints(), and H is symmetrized.  dfun() takes f=fun(x) at each point, 
+   as in ming2().
+*/
+   int i,j;
+   double *gpm, *h, f;
+
+   if((gpm=(double*)malloc((2*n*n+n)*sizeof(double)))==NULL)
+      error2("oom HessianGradient");
+   h = gpm+2*n*n;
+   for(j=0; j<n; j++) {
+      h[j] = pow(Small_Diff*(fabs(x[j])+1), .67);
+      if(h[j] > x[j]) 
+         printf("Hessian warning: x[%d] = %8.5g < h = %8.5g.\n", j+1, x[j],h[j]);
+   }
+   HessianGradient_n = n;  HessianGradient_x = x;  HessianGradient_h = h;
+   HessianGradient_fun = fun;  HessianGradient_dfun = dfun;
+   FunPoints(2*n, n, gpm, HessianGradientPoint, "Hessian");
+   f = (*fun)(x, n);
+   (*dfun)(x, &f, g, n);
+
+   for(i=0; i<n; i++)
+      for(j=0; j<n; j++)
+         H[i*n+j] = (gpm[(2*j+1)*n+i] - gpm[2*j*n+i])/(2*h[j]);
+   for(i=0; i<n; i++)
+      for(j=0; j<i; j++)
+         H[i*n+j] = H[j*n+i] = (H[i*n+j] + H[j*n+i])/2;
+   free(gpm);
    return(0);
 }
 
@@ -6264,6 +6819,7 @@ int ming2 (FILE *fout, double *f, double (*fun)(double x[], int n),
    xmark[i]=0 for inside space; -1 for lower boundary; 1 for upper boundary.
    x[] has initial values at input and returns the estimates in return.
    ix[i] specifies the i-th free parameter
+   DfunXmark is xmark while ming2 runs, for finite differences in dfun().
 
 */
    int i,j, i1,i2,it, maxround=10000, fail=0, *xmark, *ix, nfree;
@@ -6278,6 +6834,7 @@ int ming2 (FILE *fout, double *f, double (*fun)(double x[], int n),
    xmark=(int*)(tv+2*n);  ix=xmark+n;
 
    for(i=0; i<n; i++)  { xmark[i]=0; ix[i]=i; }
+   DfunXmark = xmark;
    for(i=0,nfree=0;i<n;i++) {
       if(x[i]<=xb[i][0]) { x[i]=xb[i][0]; xmark[i]=-1; continue; }
       if(x[i]>=xb[i][1]) { x[i]=xb[i][1]; xmark[i]= 1; continue; }
@@ -6303,6 +6860,7 @@ int ming2 (FILE *fout, double *f, double (*fun)(double x[], int n),
 
    identity (H,nfree);
    for(Iround=0; Iround<maxround; Iround++) {
+      if (MinimizationRound) MinimizationRound(Iround, f0);
       if (fout) {
          fprintf (fout, "\n%3d %7.4f %13.6f  x: ", Iround,sizep0,f0);
          FOR (i,n) fprintf (fout, "%8.5f  ", x0[i]);
@@ -6421,6 +6979,7 @@ for(i=0; i<n; i++) fprintf(frst,"%9.2f", g[i]); FPN(frst);
          H[i*nfree+j] += ((1+w/v)*s[i]*s[j]-z[i]*s[j]-s[i]*z[j])/v;
 #endif
    }    /* for (Iround,maxround)  */
+   DfunXmark = NULL;
 
    /* try to remove this after updating LineSearch2() */
    *f = (*fun)(x,n);
@@ -189,6 +189,139 @@ int ReadMorphology (FILE *fout, FILE *fin)
 
 #endif
 
+#if (defined __unix__ || defined __APPLE__)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+static int ReadSeqMapped (FILE *fseq, char *pch, int nchar, int *miss)
+{
+/* Reads sequential-format (paml/phylip or fasta) sequences from the current 
+   position of fseq by mapping the file into memory, instead of copying every 
+   line into a line buffer with fgets.  The file is scanned once to check the 
+   characters and to locate the start of each sequence, and the sequences are 
+   then copied into com.z[] in parallel.  Errors are reported as in ReadSeq().
+   Returns -1 without reading anything if the file cannot be mapped (pipes, 
+   or no mmap), in which case ReadSeq() falls back on fgets.
+*/
+#if (defined __unix__ || defined __APPLE__)
+   char eq='.', *buf, *p, *end, name[2*LSPNAME+1], map[256];
+   unsigned char cls[256];  /* 0: skipped; 1: state; 2: ambiguity; 3: eq; 4: bad; 5: EOF */
+   int i,j,k,ch, lspname, n, *start;
+   long off0;
+   struct stat st;
+
+   off0 = ftell(fseq);
+   if(off0<0 || fstat(fileno(fseq), &st) || !S_ISREG(st.st_mode) || st.st_size<=off0)
+      return(-1);
+   buf = (char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fileno(fseq), 0);
+   if(buf == (char*)MAP_FAILED) return(-1);
+   end = buf + st.st_size;
+   if((start=(int*)malloc(com.ns*sizeof(int))) == NULL) error2("oom start");
+
+   for(i=0; i<256; i++) {
+      ch = toupper(i);
+      if((com.seqtype==BASEseq || com.seqtype==CODONseq) && ch=='U') ch = 'T';
+      map[i] = (char)ch;
+      p = (ch ? strchr(pch, ch) : NULL);
+      if(ch == eq)            cls[i] = 3;
+      else if(p)              cls[i] = (unsigned char)(p-pch<nchar ? 1 : 2);
+      else if(isalpha(ch))    cls[i] = 4;
+      else if(i == (unsigned char)EOF) cls[i] = 5;
+      else                    cls[i] = 0;
+   }
+
+   for(j=0,p=buf+off0; j<com.ns; j++) {
+      /* name line, with blank lines skipped as by PopEmptyLines() */
+      if(p>=end) error2("EOF?");
+      for(i=0; p+i<end && p[i]!='\n' && !isalnum(p[i]); i++) ;
+      if(p+i==end || p[i]=='\n') {
+         for( ; ; ) {
+            p += i+1;
+            if(p>=end)
+               { printf("error in sequence data file: empty line (seq %d)\n",j+1); exit(-1); }
+            for(i=0; p+i<end && p[i]!='\n'; i++) 
+               if(p[i]=='-' || p[i]=='?' || p[i]==eq || isalpha(p[i])) break;
+            if(p+i<end && p[i]!='\n') break;
+         }
+      }
+      for(n=0; p+n<end && p[n]!='\n' && n<2*LSPNAME; n++) name[n] = p[n];
+      name[n] = '\0';
+      lspname = LSPNAME;
+      i = (name[0]=='=' || name[0]=='>');
+      while(isspace(name[i])) i++;
+      if((ch=(int)(strstr(name+i,"  ")-(name+i)))<lspname && ch>0) lspname=ch;
+      strncpy(com.spname[j], name+i, lspname);
+      k = strlen(com.spname[j]);
+      p += i + (k<lspname?k:lspname);
+      for (; k>0; k--) /* trim spaces */
+         if (!isgraph(com.spname[j][k]))   com.spname[j][k]=0;
+         else    break;
+      if (noisy>=2) printf ("Reading seq #%2d: %s     \r", j+1, com.spname[j]);
+
+      start[j] = (int)(p-buf);
+      for (k=0; k<com.ls; p++) {
+         if(p==end)
+            { printf("\nEOF at site %d, seq %d\n", k+1,j+1); exit(-1); }
+         switch(cls[(unsigned char)*p]) {
+         case 0:  break;
+         case 2:  *miss = 1;   /* fall through */
+         case 1:  k++;  break;
+         case 3:  
+            if (j==0) error2("Error in sequence data file: . in 1st seq.?");
+            k++;  break;
+         case 4:
+            printf("\nError in sequence data file: %c at %d seq %d.\n",map[(unsigned char)*p],k+1,j+1); 
+            puts("Make sure to separate the sequence from its name by 2 or more spaces.");
+            exit(0); 
+         case 5:  error2("EOF?");
+         }
+      }
+      while(p<end && *p++!='\n') ;   /* pop up line return */
+   }
+   off0 = (long)(p-buf);
+
+   /* the checks are done; copy the states.  '.' in seq j>0 is resolved in 
+      a second pass, once the first sequence is complete.
+   */
+#ifdef CODEML
+   #pragma omp parallel for private(j,k,p) schedule(dynamic) num_threads(com.numOfThreads)
+#else
+   #pragma omp parallel for private(j,k,p) schedule(dynamic)
+#endif
+   for(j=0; j<com.ns; j++) {
+      unsigned char *z=com.z[j];
+      for(k=0,p=buf+start[j]; k<com.ls; p++)
+         if(cls[(unsigned char)*p])  z[k++] = (unsigned char)map[(unsigned char)*p];
+   }
+   for(j=1; j<com.ns; j++)
+      for(k=0; k<com.ls; k++)
+         if(com.z[j][k]==eq) com.z[j][k] = com.z[0][k];
+   free(start);
+   munmap(buf, (size_t)st.st_size);
+   if(fseek(fseq, off0, SEEK_SET)) error2("ReadSeq: fseek");
+   return(0);
+#else
+   return(-1);
+#endif
+}
+
+void AllocSeqs (int ns)
+{
+/* This makes room for ns sequences in com.z[] and com.spname[], which grow 
+   as needed and are never shrunk.  New entries are NULL, so that the 
+   sequences and names can be realloc'ed.
+*/
+   int j;
+
+   if(ns <= com.nsalloc) return;
+   com.z = (unsigned char**)realloc(com.z, ns*sizeof(unsigned char*));
+   com.spname = (char**)realloc(com.spname, ns*sizeof(char*));
+   if(com.z==NULL || com.spname==NULL) error2("oom AllocSeqs");
+   for(j=com.nsalloc; j<ns; j++) { com.z[j] = NULL;  com.spname[j] = NULL; }
+   com.nsalloc = ns;
+}
+
 int ReadSeq (FILE *fout, FILE *fseq, int cleandata, int locus)
 {
 /* read in sequence, translate into protein (CODON2AAseq), and 
@@ -230,7 +363,11 @@ int ReadSeq (FILE *fout, FILE *fseq, int cleandata, int locus)
    }
    GetSeqFileType(fseq, &format);
    
-   if (com.ns>NS) error2("too many sequences.. raise NS?");
+   if (com.ns>NS) {
+      printf("\n%d sequences, more than NS = %d.  Rebuild with make NS=%d.\n", com.ns, NS, com.ns);
+      exit(-1);
+   }
+   AllocSeqs(com.ns);
    if (com.ls%n31!=0) {
       printf ("\n%d nucleotides, not a multiple of 3!", com.ls); exit(-1);
    }
@@ -319,7 +456,10 @@ int ReadSeq (FILE *fout, FILE *fseq, int cleandata, int locus)
       case ('G') :
          if(basecoding) error2("Error in sequence data file: incorrect option format, use GC?\n");
          if (fscanf(fseq,"%d",&com.ngene)!=1) error2("expecting #gene here..");
-         if (com.ngene>NGENE) error2("raise NGENE?");
+         if (com.ngene>NGENE) {
+            printf("\n%d genes, more than NGENE = %d.  Rebuild with make NGENE=%d.\n", com.ngene, NGENE, com.ngene);
+            exit(-1);
+         }
 
          fgets(line,lline,fseq);
          if (!blankline(line)) {    /* #sites in genes on the 2nd line */
@@ -376,7 +516,7 @@ int ReadSeq (FILE *fout, FILE *fseq, int cleandata, int locus)
    /* read sequence */
    if (Sequential)  {    /* sequential */
       if (noisy) printf ("Reading sequences, sequential format..\n");
-      for (j=0; j<com.ns; j++) {
+      for (j=(ReadSeqMapped(fseq, pch, nchar, &miss)==0 ? com.ns : 0); j<com.ns; j++) {
          lspname = LSPNAME;
          for (i=0; i<2*lspname; i++) line[i]='\0';
          if (!fgets (line, lline, fseq)) error2("EOF?");
@@ -595,8 +735,15 @@ int ReadSeq (FILE *fout, FILE *fseq, int cleandata, int locus)
 
 #endif
 
-   if(!com.readpattern) 
+   if(!com.readpattern) {
+#ifdef JDKLAB
+      StageBegin(StagePatternWeight);
+      PatternWeight();
+      StageEnd(StagePatternWeight);
+#else
       PatternWeight();
+#endif
+   }
    else {  /*  read pattern counts */
       com.npatt = com.ls;
       if((com.fpatt=(double*)realloc(com.fpatt, com.npatt*sizeof(double))) == NULL)
@@ -941,6 +1088,7 @@ void AllPatterns (FILE* fout)
    int gap=(n31==3?3:10);
 
    com.ns = 3;
+   AllocSeqs(com.ns);
    for(j=0,com.npatt=1; j<com.ns; j++) com.npatt*=com.ncode;
    printf ("%3d species, %d site patterns\n", com.ns, com.npatt);
    com.cleandata=1;
@@ -978,6 +1126,30 @@ void AllPatterns (FILE* fout)
 }
 
 
+static char *ztPatternWeight;
+static int lpattPatternWeight;
+
+static int ComparePatterns (const void *a, const void *b)
+{
+   return strcmp(ztPatternWeight+*(int*)a*lpattPatternWeight, ztPatternWeight+*(int*)b*lpattPatternWeight);
+}
+
+static unsigned long long HashPattern (char *s, int len, int ig)
+{
+/* 64-bit FNV-1a hash of the site column s[len] and gene label ig, with a 
+   final mix so that the low bits can index the table.
+*/
+   unsigned long long hash=14695981039346656037ULL ^ (unsigned long long)ig;
+   int i;
+
+   for(i=0; i<len; i++) {
+      hash ^= (unsigned char)s[i];
+      hash *= 1099511628211ULL;
+   }
+   hash ^= hash>>29;  hash *= 0xbf58476d1ce4e5b9ULL;  hash ^= hash>>32;
+   return(hash);
+}
+
 int PatternWeight (void)
 {
 /* This collaps sites into patterns, for nucleotide, amino acid, or codon sequences.
@@ -985,121 +1157,105 @@ int PatternWeight (void)
    encoded before this routine is called.
    com.pose[i] has labels for genes as input and maps sites to patterns in return.
    com.fpatt, a vector of doubles, wastes space as site pattern counts are integers.
-   Sequences z[ns*ls] are copied into patterns zt[ls*lpatt], and bsearch is used 
-   twice to avoid excessive copying, to count npatt first & to generate fpatt etc.
-*/
-   int maxnpatt=com.ls, h, ip,l,u, j, k, same, ig, *poset;
-   int gap = (com.seqtype==CODONseq ? 3 : 10);
-   int n31 = (com.seqtype==CODONseq ? 3 : 1);
+   Sequences z[ns*ls] are copied into sites zt[ls*lpatt] by blocks of sites.  
+   Each site (with its gene label) is then looked up in a hash table with open 
+   addressing, so that the distinct patterns are found in one pass.  The 
+   patterns within each gene are then sorted using strcmp, as before, so that 
+   the order of patterns does not change.
+*/
+   int h, h0, ip, j, k, ig, *poset, *p2s, *upatt, *table, nu, *nuG;
+   int n31 = (com.seqtype==CODONseq ? 3 : 1), len=com.ns*n31, sizeblock=256;
    int lpatt=com.ns*n31+1;   /* extra 0 used for easy debugging, can be voided */
-   int *p2s;  /* point patterns to sites in zt */
+   size_t tablesize, mask, it;
+   unsigned long long hash, *thash;
    char *zt, *p, timestr[36];
-   double nc = (com.seqtype == 1 ? 64 : com.ncode) + !com.cleandata+1;
-   int debug=0;
-   char DS[]="DS";
 
    /* (A) 
-      Collect and sort patterns.  Get com.npatt, com.lgene, com.posG.
-      Move sequences com.z[ns][ls] into sites zt[ls*lpatt].  
-      Use p2s to map patterns to sites in zt to avoid copying.
+      Move sequences com.z[ns][ls] into sites zt[ls*lpatt].  Find the distinct 
+      patterns by hashing, with upatt[h] the distinct pattern for site h, and 
+      p2s[] the first site for each distinct pattern.  Get com.lgene.
    */
    if(noisy) printf("Counting site patterns.. %s\n", printtime(timestr));
 
-   if((com.seqtype==1 && com.ns<5) || (com.seqtype!=1 && com.ns<7))
-      maxnpatt = (int)(pow(nc, (double)com.ns) + 0.5) * com.ngene;
-   if(maxnpatt>com.ls) maxnpatt = com.ls;
-   p2s  = (int*)malloc(maxnpatt*sizeof(int));
    zt = (char*)malloc((com.ns+1)*com.ls*n31*sizeof(char));
-   if(p2s==NULL || zt==NULL)  error2("oom p2s or zt");
-   memset(zt, 0, (com.ns+1)*com.ls*n31*sizeof(char));
-   for(j=0; j<com.ns; j++) 
-      for(h=0; h<com.ls; h++) 
-         for(k=0; k<n31; k++)
-            zt[h*lpatt+j*n31+k] = com.z[j][h*n31+k];
-
+   if(zt==NULL)  error2("oom zt");
+   for(h0=0; h0<com.ls; h0+=sizeblock) {
+      for(j=0; j<com.ns; j++) {
+         p = com.z[j] + h0*n31;
+         for(h=h0; h<min2(h0+sizeblock, com.ls); h++, p+=n31)
+            memcpy(zt+h*lpatt+j*n31, p, n31);
+      }
+      for(h=h0; h<min2(h0+sizeblock, com.ls); h++)
+         zt[h*lpatt+len] = 0;
+   }
    for(j=0; j<com.ns; j++) free(com.z[j]); 
 
-   for(ig=0; ig<com.ngene; ig++) com.lgene[ig] = 0;
-   for(ig=0,com.npatt=0; ig<com.ngene; ig++) {
-      com.posG[ig] = l = u = ip = com.npatt;      
-      for(h=0; h<com.ls; h++) {
-         if(com.pose[h] != ig) continue;
-         if(debug) printf("\nh %3d %s", h, zt+h*lpatt);
-
-         /* bsearch in existing patterns.  Knuth 1998 Vol3 Ed2 p.410 
-            ip is the loc for match or insertion.  [l,u] is the search interval.
-         */
-         same = 0;
-         if(com.lgene[ig]++ != 0) {  /* not 1st pattern? */
-            for(l=com.posG[ig], u=com.npatt-1; ; ) {
-               if(u<l) break;
-               ip = (l+u)/2;
-               k = strcmp(zt+h*lpatt, zt+p2s[ip]*lpatt);
-               if(k<0)        u = ip - 1;
-               else if(k>0)   l = ip + 1;
-               else         { same = 1;  break; }
-            }
-         }
-         if(!same) {
-            if(com.npatt>maxnpatt) 
-               error2("npatt > maxnpatt");
-            if(l > ip) ip++;        /* last comparison in bsearch had k > 0. */
-            /* Insert new pattern at ip.  This is the expensive step. */
-
-            if(ip<com.npatt)
-               memmove(p2s+ip+1, p2s+ip, (com.npatt-ip)*sizeof(int));
-
-            /*
-            for(j=com.npatt; j>ip; j--) 
-               p2s[j] = p2s[j-1];
-            */
-            p2s[ip] = h;
-            com.npatt ++;
-         }
-
-         if(debug) {
-            printf(": %3d (%c ilu %3d%3d%3d) ", com.npatt, DS[same], ip, l, u);
-            for(j=0; j<com.npatt; j++)
-               printf(" %s", zt+p2s[j]*lpatt);
+   for(tablesize=1024; tablesize<2*(size_t)com.ls; tablesize*=2) ;
+   mask = tablesize-1;
+   table = (int*)malloc(tablesize*sizeof(int));
+   thash = (unsigned long long*)malloc(tablesize*sizeof(unsigned long long));
+   upatt = (int*)malloc(com.ls*sizeof(int));
+   p2s   = (int*)malloc(com.ls*sizeof(int));
+   nuG   = (int*)malloc((com.ngene+1)*sizeof(int));
+   if(table==NULL || thash==NULL || upatt==NULL || p2s==NULL || nuG==NULL) 
+      error2("oom PatternWeight");
+   for(it=0; it<tablesize; it++) table[it] = -1;
+   for(ig=0; ig<=com.ngene; ig++) nuG[ig] = com.lgene[ig] = 0;
+
+   for(h=0,nu=0; h<com.ls; h++) {
+      ig = com.pose[h];
+      if(ig<0 || ig>=com.ngene) error2("some gene labels are missing");
+      com.lgene[ig]++;
+      hash = HashPattern(zt+h*lpatt, len, ig);
+      for(it=hash&mask; ; it=(it+1)&mask) {
+         if(table[it] == -1) {     /* new pattern */
+            table[it] = nu;
+            thash[it] = hash;
+            p2s[nu++] = h;
+            nuG[ig]++;
+            break;
          }
-         if(noisy && ((h+1)%10000==0 || h+1==com.ls))
-            printf("\r%12d patterns at %8d / %8d sites (%.1f%%), %s", 
-               com.npatt, h+1, com.ls, (h+1.)*100/com.ls, printtime(timestr));
-
-      }     /* for (h)  */
-   }        /* for (ig) */
+         k = p2s[table[it]];
+         if(thash[it]==hash && com.pose[k]==ig && memcmp(zt+h*lpatt, zt+k*lpatt, len)==0)
+            break;
+      }
+      upatt[h] = table[it];
+      if(noisy && ((h+1)%100000==0 || h+1==com.ls))
+         printf("\r%12d patterns at %8d / %8d sites (%.1f%%), %s", 
+            nu, h+1, com.ls, (h+1.)*100/com.ls, printtime(timestr));
+   }
    if(noisy) FPN(F0);
+   free(table);  free(thash);
 
-   /* (B) count pattern frequencies and collect pose[] */
-   com.posG[com.ngene] = com.npatt;
+   /* (B) sort patterns within genes, count pattern frequencies and collect pose[] */
+   com.npatt = nu;
+   for(ig=0,com.posG[0]=0; ig<com.ngene; ig++)
+      com.posG[ig+1] = com.posG[ig] + nuG[ig];
    for(j=0; j<com.ngene; j++) 
       if(com.lgene[j]==0) 
          error2("some gene labels are missing");
    for(j=1; j<com.ngene; j++) 
       com.lgene[j] += com.lgene[j-1];
 
+   poset = (int*)malloc(max2(com.ls,nu)*sizeof(int));
+   if(poset==NULL) error2("oom poset");
+   for(ig=0; ig<com.ngene; ig++) nuG[ig] = com.posG[ig];
+   for(ip=0; ip<nu; ip++)      /* first sites of patterns, grouped by gene */
+      poset[nuG[com.pose[p2s[ip]]]++] = p2s[ip];
+   ztPatternWeight = zt;  lpattPatternWeight = lpatt;
+   for(ig=0; ig<com.ngene; ig++)
+      qsort(poset+com.posG[ig], com.posG[ig+1]-com.posG[ig], sizeof(int), ComparePatterns);
+   memcpy(p2s, poset, nu*sizeof(int));  /* p2s[] now points patterns to sites */
+   for(ip=0; ip<nu; ip++)
+      poset[upatt[p2s[ip]]] = ip;         /* distinct pattern to sorted pattern */
+   for(h=0; h<com.ls; h++)
+      upatt[h] = poset[upatt[h]];
+
    com.fpatt = (double*)realloc(com.fpatt, com.npatt*sizeof(double));
-   poset = (int*)malloc(com.ls*sizeof(int));
-   if(com.fpatt==NULL || poset==NULL) error2("oom poset");
+   if(com.fpatt==NULL) error2("oom fpatt");
    for(ip=0; ip<com.npatt; ip++) com.fpatt[ip] = 0;
-
-   for(ig=0; ig<com.ngene; ig++) {
-      for(h=0; h<com.ls; h++) {
-         if(com.pose[h] != ig) continue;
-         for(same=0, l=com.posG[ig], u=com.posG[ig+1]-1; ; ) {
-            if(u<l) break;
-            ip = (l+u)/2;
-            k = strcmp(zt+h*lpatt, zt+p2s[ip]*lpatt);
-            if(k<0)        u = ip - 1;
-            else if(k>0)   l = ip + 1;
-            else         { same = 1;  break; }
-         }
-         if(!same)
-            error2("ghost pattern?");
-         com.fpatt[ip]++;
-         poset[h] = ip;
-      }     /* for (h)  */
-   }        /* for (ig) */
+   for(h=0; h<com.ls; h++)
+      com.fpatt[upatt[h]]++;
 
    if(com.seqtype==CODONseq && com.ngene==3 &&com.lgene[0]==com.ls/3) {
       puts("\nCheck option G in data file? (Enter)\n");
@@ -1111,8 +1267,8 @@ int PatternWeight (void)
          for(k=0; k<n31; k++)
             *p++ = zt[p2s[ip]*lpatt + j*n31 + k];
    }
-   memcpy(com.pose, poset, com.ls*sizeof(int));
-   free(poset);  free(p2s);  free(zt);
+   memcpy(com.pose, upatt, com.ls*sizeof(int));
+   free(poset);  free(upatt);  free(p2s);  free(nuG);  free(zt);
 
    return (0);
 }
@@ -2026,12 +2182,15 @@ int DistanceMatNG86 (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double alpha)
    In the latter case (com.cleandata==0), the method does pairwise delection.
 
    alpha for gamma rates is used for dN only.
+   The pairs (is, js) for each is are done in parallel, into pairs[js*4+k] 
+   for S, N, and the synonymous and nonsynonymous differences, and are printed 
+   in order afterwards.
 */
    char *codon[2];
    int is,js, i,k,h, wname=20, status=0, ndiff,nsd[4];
    int nb[3],ib[3][4], missing;
    double ns,na, nst,nat, S,N, St,Nt, dS,dN,dN_dS,y, bigD=3, lst;
-   double SEds, SEdn, p;
+   double SEds, SEdn, p, *pairs;
 
    if(fout) { 
       fputs("\n\n\nNei & Gojobori 1986. dN/dS (dN, dS)",fout);
@@ -2045,6 +2204,8 @@ int DistanceMatNG86 (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double alpha)
       fprintf(fdn,"%6d\n",com.ns); 
       fprintf(ft,"%6d\n",com.ns);
    }
+   if((pairs=(double*)malloc(com.ns*4*sizeof(double)))==NULL) error2("oom DistanceMatNG86");
+   S = N = nst = nat = 0;
    if(noisy>1 && com.ns>10)  puts("NG distances for seqs.:");
    for(is=0; is<com.ns; is++) {
       if(fout) 
@@ -2054,6 +2215,11 @@ int DistanceMatNG86 (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double alpha)
          fprintf(fdn,   "%-*s ",wname,com.spname[is]);
          fprintf(ft,    "%-*s ",wname,com.spname[is]);
       }
+#ifdef CODEML
+      #pragma omp parallel for private(js,h,k,codon,lst,ndiff,nsd,St,Nt,ns,na,S,N,nst,nat,y) schedule(dynamic,16) num_threads(com.numOfThreads) if(is>64)
+#else
+      #pragma omp parallel for private(js,h,k,codon,lst,ndiff,nsd,St,Nt,ns,na,S,N,nst,nat,y) schedule(dynamic,16) if(is>64)
+#endif
       for(js=0; js<is; js++) {
          for(k=0; k<4; k++) nsd[k] = 0;
          for (h=0,lst=0,nst=nat=S=N=0; h<com.npatt; h++)  {
@@ -2076,6 +2242,12 @@ int DistanceMatNG86 (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double alpha)
             S *= y;
             N *= y;
          }
+         pairs[js*4+0] = S;    pairs[js*4+1] = N;
+         pairs[js*4+2] = nst;  pairs[js*4+3] = nat;
+      }
+      for(js=0; js<is; js++) {
+         S = pairs[js*4+0];    N = pairs[js*4+1];
+         nst = pairs[js*4+2];  nat = pairs[js*4+3];
          if(noisy>=9)
            printf("\n%3d %3d:Sites %7.1f +%7.1f =%7.1f\tDiffs %7.1f +%7.1f =%7.1f",
              is+1,js+1,S,N,S+N,nst,nat, nst+nat);
@@ -2112,6 +2284,7 @@ int DistanceMatNG86 (FILE *fout, FILE*fds, FILE*fdn, FILE*ft, double alpha)
       }
       if(noisy>1 && com.ns>10)  printf(" %3d", is+1);
    }    /* for(is) */
+   free(pairs);
    FPN(F0); 
    if(fout) FPN(fout);
    if(status) fprintf (fout, "NOTE: -1 means that NG86 is inapplicable.\n");
@@ -3058,7 +3231,7 @@ int OutSubTreeN (FILE *fout, int inode, int spnames, int printopt, char *labelfm
 #endif
 
    if((printopt & PrBranch) && (inode!=tree.root || nodes[inode].branch>0))
-      fprintf(fout, ": %.6f", nodes[inode].branch);
+      fprintf(fout, ((printopt & PrExact) ? ": %.17g" : ": %.6f"), nodes[inode].branch);
    if(nsib == 0)            /* root */
       fputc(';', fout);
    else if (inode == nodes[dad].sons[nsib-1])  /* last sib */
@@ -3966,20 +4139,40 @@ static struct TREE
 
 int Perturbation(FILE* fout, int initialMP, double space[]);
 
+static int _seedNNI, _sizetreeNNI;
+
+static void PerturbationPoint (int ineighb, double out[])
+{
+/* out[0] has the score and out[1] x[] for NNI neighbour ineighb of treebest, 
+   which is one of the neighbours done by FunPoints().
+*/
+   int noisy0=noisy;
+
+   tree=treebest.tree;  memcpy (nodes, treebest.nodes, _sizetreeNNI);
+   NeighborNNI (ineighb);
+   SetSeed(_seedNNI+ineighb, 0);
+   noisy = 0;
+   out[0] = TreeScore(out+1, com.space);
+   noisy = noisy0;
+}
+
 int Perturbation(FILE* fout, int initialMP, double space[])
 {
 /* heuristic tree search by the NNI tree perturbation algorithm.  
    Some trees are evaluated multiple times as no trees are kept.
    This needs more work.
+   All NNI neighbours of the current tree are evaluated by FunPoints(), 
+   shared among NFunProcesses processes, and the search moves to the best 
+   of them if it is better than the current tree, the first in the order of 
+   the neighbours if there are ties, so that the search does not depend on 
+   the number of processes.
 */
-   int step=0, ntree=0, nmove=0, improve=0, ineighb, i,j;
+   int step=0, ntree=0, nmove=0, ineighb, nneighb, nout, best, i,j;
    int sizetree=(2*com.ns-1)*sizeof(struct TREEN);
-   double *x=treestar.x;
+   double *x=treestar.x, *out, score;
    FILE *ftree;
 
    if(com.clock) error2("\n\aerr: pertubation does not work with a clock yet.\n");
-   if(initialMP&&!com.cleandata)
-      error2("\ncannot get initial parsimony tree for gapped data yet.");
 
    fprintf(fout, "\n\nHeuristic tree search by NNI perturbation\n");
    if (initialMP) {
@@ -3998,6 +4191,7 @@ int Perturbation(FILE* fout, int initialMP, double space[])
    }
    if (noisy) { FPN (F0);  OutTreeN(F0,0,0);  FPN(F0); }
    tree.lnL=TreeScore(x, space);
+   nodes[tree.root].branch = 0;
    if (noisy) { OutTreeN(F0,0,1);  printf("\n lnL = %.4f\n",-tree.lnL); }
    OutTreeN(fout,1,1);  fprintf(fout, "\n lnL = %.4f\n",-tree.lnL);
    if (com.np>com.ntime) {
@@ -4009,38 +4203,57 @@ int Perturbation(FILE* fout, int initialMP, double space[])
    treebest.tree=tree;  memcpy(treebest.nodes, nodes, sizetree);
 
    for (step=0; ; step++) {
-      for (ineighb=0,improve=0; ineighb<(tree.nbranch-com.ns)*2; ineighb++) {
-         tree=treebest.tree; memcpy (nodes, treebest.nodes, sizetree);
-         NeighborNNI (ineighb);
-         if(noisy) {
+      nneighb = (tree.nbranch-com.ns)*2;
+      com.ntime = tree.nbranch;
+      GetInitials(x, &i);
+      nout = 1+com.np;
+      if((out=(double*)malloc((size_t)nneighb*nout*sizeof(double)))==NULL)
+         error2("oom Perturbation");
+      _sizetreeNNI = sizetree;  _seedNNI = 1+(int)(rndu()*1e8);
+      FunPoints(nneighb, nout, out, PerturbationPoint, (noisy ? "  NNI neighbours" : NULL));
+
+      for (ineighb=0,best=-1; ineighb<nneighb; ineighb++) {
+         score = out[ineighb*nout];
+         if (noisy) {
+            tree=treebest.tree; memcpy (nodes, treebest.nodes, sizetree);
+            NeighborNNI (ineighb);
             printf("\nTrying tree # %d (%d move[s]) \n", ++ntree,nmove);
-            OutTreeN(F0,0,0);  FPN(F0);
+            OutTreeN(F0,0,0);  printf("\n lnL = %.4f\n",-score);
          }
-         tree.lnL=TreeScore(x, space);
-         if (noisy) { OutTreeN(F0,1,1); printf("\n lnL = %.4f\n",-tree.lnL);}
-         if (noisy && com.np>com.ntime) {
+         if (score < (best==-1 ? treebest.tree.lnL : out[best*nout]))
+            best = ineighb;
+      }
+      if (best==-1) { free(out);  break; }
+
+      tree=treebest.tree; memcpy (nodes, treebest.nodes, sizetree);
+      NeighborNNI (best);
+      xtoy(out+best*nout+1, x, com.np);
+      PointconPnodes();
+      tree.lnL = com.plfun(x, com.np);   /* sets the branch lengths */
+      nodes[tree.root].branch = 0;
+      free(out);
+      treebest.tree=tree;  memcpy (treebest.nodes, nodes, sizetree);
+      nmove++;
+      if (noisy) {
+         printf(" moving to tree # %d\n", best+1);
+         OutTreeN(F0,1,1); printf("\n lnL = %.4f\n",-tree.lnL);
+         if (com.np>com.ntime) {
             printf("\tparameters:"); 
             for(i=com.ntime; i<com.np; i++) printf("%9.5f", x[i]);
             FPN(F0);
          }
-         if (tree.lnL<=treebest.tree.lnL) {
-            treebest.tree=tree;  memcpy (treebest.nodes, nodes, sizetree);
-            improve=1; nmove++;
-            if (noisy) printf(" moving to this tree\n");
-            if (fout) {
-               fprintf(fout, "\nA better tree:\n");
-               OutTreeN(fout,0,0); FPN(fout); OutTreeN(fout,1,1); FPN(fout); 
-               fprintf(fout, "\nlnL = %.4f\n", tree.lnL);
-               if (com.np>com.ntime) {
-                  fprintf(fout,"\tparameters:"); 
-                  for(i=com.ntime; i<com.np; i++) fprintf(fout,"%9.5f", x[i]);
-                  FPN(fout);
-               }
-               fflush(fout);
-          }
+      }
+      if (fout) {
+         fprintf(fout, "\nA better tree:\n");
+         OutTreeN(fout,0,0); FPN(fout); OutTreeN(fout,1,1); FPN(fout); 
+         fprintf(fout, "\nlnL = %.4f\n", tree.lnL);
+         if (com.np>com.ntime) {
+            fprintf(fout,"\tparameters:"); 
+            for(i=com.ntime; i<com.np; i++) fprintf(fout,"%9.5f", x[i]);
+            FPN(fout);
          }
+         fflush(fout);
       }
-      if (!improve) break;
    }
    tree=treebest.tree;  memcpy (nodes, treebest.nodes, sizetree);
    if (noisy) {
@@ -4057,32 +4270,130 @@ int Perturbation(FILE* fout, int initialMP, double space[])
 }
 
 
-static int *_U0, *_step0, _mnnode;
-/* up pass characters and changes for the star tree: each of size npatt*nnode*/
+/* Bit-parallel Fitch parsimony on packed site patterns.  The patterns are in 
+   blocks of 64, and the state set of a node for a block is ncode words, word 
+   s having bit p set if state s is in the set for pattern 64*ib+p.  A node 
+   thus takes MPsize = MPnblock*ncode words, and one pass over the words of 
+   two sons gives the sets and changes of their father for 64 patterns.  
+   The patterns in the last block past npatt have state 0 at all tips, so 
+   they never change.  The changes are weighted by fpatt[] using popcount on 
+   the bits of fpatt[], kept as MPnwbit masks for each block, if fpatt[] are 
+   integers, as they are except for user-supplied site weights.
+*/
+static int MPnblock, MPsize, MPnwbit;
+static unsigned long long *MPTip, *MPWeight;
+
+int MPPack (void)
+{
+/* This packs the state sets at the tips (MPTip[is*MPsize]) and the bits of 
+   fpatt[] (MPWeight[ib*MPnwbit+b]), for MPFitch().  With ambiguities 
+   (cleandata=0), the set at a tip has all states in CharaMap[].
+*/
+   int n=com.ncode, nw, is, h, ib, b, k, maxf=0;
+   unsigned long long bit;
+
+   MPnblock = (com.npatt+63)/64;
+   MPsize = MPnblock*n;
+   for(h=0; h<com.npatt; h++) {
+      if(com.fpatt[h]!=(int)com.fpatt[h] || com.fpatt[h]<0 || com.fpatt[h]>(1<<30)) break;
+      maxf = max2(maxf, (int)com.fpatt[h]);
+   }
+   for(MPnwbit=0; h==com.npatt && (maxf>>MPnwbit); MPnwbit++) ;
+   nw = MPnblock*max2(1,MPnwbit);
+   free(MPTip);
+   if((MPTip=(unsigned long long*)malloc(((size_t)com.ns*MPsize+nw)*sizeof(unsigned long long)))==NULL)
+      error2("oom MPPack");
+   MPWeight = MPTip+(size_t)com.ns*MPsize;
+   memset(MPTip, 0, ((size_t)com.ns*MPsize+nw)*sizeof(unsigned long long));
+
+   for(h=0; h<MPnblock*64; h++) {
+      ib = h/64;  bit = 1ULL<<(h%64);
+      for(is=0; is<com.ns; is++) {
+         if(h>=com.npatt)
+            MPTip[(size_t)is*MPsize+ib*n] |= bit;
+         else if(com.cleandata)
+            MPTip[(size_t)is*MPsize+ib*n+com.z[is][h]] |= bit;
+         else
+            for(k=0; k<nChara[com.z[is][h]]; k++)
+               MPTip[(size_t)is*MPsize+ib*n+CharaMap[com.z[is][h]][k]] |= bit;
+      }
+      if(h<com.npatt)
+         for(b=0; b<MPnwbit; b++)
+            if(((int)com.fpatt[h]>>b) & 1) MPWeight[ib*MPnwbit+b] |= bit;
+   }
+   return(0);
+}
+
+static double MPWeightOf (unsigned long long change, int ib)
+{
+/* sum of fpatt[] over the patterns in block ib with bits set in change.
+*/
+   int b;
+   double w=0;
+
+   if(MPnwbit)
+      for(b=0; b<MPnwbit; b++)
+         w += (double)BitCount(change & MPWeight[ib*MPnwbit+b]) * (1<<b);
+   else
+      for(b=0; b<64; b++)
+         if((change>>b) & 1) w += com.fpatt[ib*64+b];
+   return(w);
+}
+
+double MPFitch (unsigned long long U[], unsigned long long U1[], unsigned long long U2[])
+{
+/* This sets U[] for the father of two nodes with sets U1[] and U2[] and 
+   returns the weighted number of changes.  U[] should not overlap U1[] or U2[].
+*/
+   int n=com.ncode, ib, i;
+   unsigned long long any, empty;
+   double change=0;
+
+   for(ib=0; ib<MPnblock; ib++,U+=n,U1+=n,U2+=n) {
+      for(i=0,any=0; i<n; i++)
+         any |= (U[i] = U1[i] & U2[i]);
+      if((empty = ~any) == 0) continue;
+      for(i=0; i<n; i++)
+         U[i] |= empty & (U1[i] | U2[i]);
+      change += MPWeightOf(empty, ib);
+   }
+   return(change);
+}
+
+static unsigned long long *_U0;
+static double *_step0;
+static int _mnnode;
+/* up pass state sets (packed as in MPFitch()) for the nodes of the best tree 
+   so far, of size MPsize*mnnode, and the weighted changes in the subtree at 
+   each node.  The path from the new species to the root is calculated in 
+   _U0[mnnode*MPsize], of size MPsize*(mnnode+1).
+*/
 
 int StepwiseAdditionMP (double space[])
 {
 /* tree search by species addition.
 */
    char *z0[NS];
-   int  ns0=com.ns, is, i,j,h, tiestep=0,tie,bestbranch=0;
+   int  ns0=com.ns, is, i,j, tiestep=0,tie,bestbranch=0;
    int sizetree=(2*com.ns-1)*sizeof(struct TREEN);
    double bestscore=0,score;
 
    _mnnode=com.ns*2-1;
-   _U0=(int*)malloc(com.npatt*_mnnode*sizeof(int));
-   _step0=(int*)malloc(com.npatt*_mnnode*sizeof(int));
+   MPPack();
+   _U0=(unsigned long long*)malloc((size_t)MPsize*(_mnnode*2+1)*sizeof(unsigned long long));
+   _step0=(double*)malloc(_mnnode*sizeof(double));
    if (noisy>2) 
-     printf("\n%9ld bytes for MP (U0 & N0)\n", 2*com.npatt*_mnnode*sizeof(int));
+     printf("\n%9ld bytes for MP (U0 & N0)\n", (size_t)MPsize*(_mnnode*2+1)*sizeof(unsigned long long));
    if (_U0==NULL || _step0==NULL) error2("oom U0&step0");
 
    FOR (i,ns0)  z0[i]=com.z[i];
    tree.nbranch=tree.root=com.ns=3;
    FOR (i, tree.nbranch) { tree.branches[i][0]=com.ns; tree.branches[i][1]=i; }
    BranchToNode ();
-   FOR (h, com.npatt)
-      FOR (i,com.ns)
-        { _U0[h*_mnnode+i]=1<<(com.z[i][h]-1); _step0[h*_mnnode+i]=0; }
+   FOR (i,com.ns) {
+      memcpy(_U0+(size_t)i*MPsize, MPTip+(size_t)i*MPsize, MPsize*sizeof(unsigned long long));
+      _step0[i]=0;
+   }
    for (is=com.ns,tie=0; is<ns0; is++) {
       treestar.tree=tree;  memcpy (treestar.nodes, nodes, sizetree);
 
@@ -4119,33 +4430,45 @@ printf(" Add sp %d (ns=%d) at branch %d, score %.0f\n", is+1,com.ns,j+1,score);
 double MPScoreStepwiseAddition (int is, double space[], int save)
 {
 /* this changes only the part of the tree affected by the newly added 
-   species is.
+   species is, which is the path from is to the root.  The nodes off the 
+   path are at i-2*(i>=is) in _U0 and _step0, as AddSpecies() moves the 
+   interior nodes up by 2, and the nodes on the path are calculated in the 
+   work space after _U0, using MPFitch() for all site patterns at once.
+   The slot of tip 0 in the work space is used for a root with 3 sons.
    save=1 for the best tree, so that _U0 & _step0 are updated
 */
-   int *U,*N,U3[3], h,ist, i,father,son2,*pU0=_U0,*pN0=_step0;
-   double score;
+   int i, ist, father, son2, nnode0=tree.nnode-2;
+   double *N=space, score;
+   unsigned long long *W=_U0+(size_t)_mnnode*MPsize, *Ures;
+   unsigned long long **U=(unsigned long long**)(N+tree.nnode);
 
-   U=(int*)space;  N=U+_mnnode;
-   for (h=0,score=0; h<com.npatt; h++,pU0+=_mnnode,pN0+=_mnnode) {
-      FOR (i, tree.nnode) { U[i]=pU0[i-2*(i>=is)]; N[i]=pN0[i-2*(i>=is)]; }
-      U[is]=1<<(com.z[is][h]-1);  N[is]=0;
-      for (ist=is; (father=nodes[ist].father)!=tree.root; ist=father) {
-         if ((son2=nodes[father].sons[0])==ist)  son2=nodes[father].sons[1];
-         N[father]=N[ist]+N[son2];
-         if ((U[father]=U[ist]&U[son2])==0)
-            { U[father]=U[ist]|U[son2];  N[father]++; }
-      }
-      FOR (i,3) U3[i]=U[nodes[tree.root].sons[i]];
-      N[tree.root]=2;
-      if (U3[0]&U3[1]&U3[2]) N[tree.root]=0;
-      else if (U3[0]&U3[1] || U3[1]&U3[2] || U3[0]&U3[2]) N[tree.root]=1;
-      FOR(i,3) N[tree.root]+=N[nodes[tree.root].sons[i]];
+   for (i=0; i<tree.nnode; i++) {
+      U[i] = _U0+(size_t)(i-2*(i>=is))*MPsize;
+      N[i] = _step0[i-2*(i>=is)];
+   }
+   U[is] = MPTip+(size_t)is*MPsize;  N[is] = 0;
+   for (ist=is; (father=nodes[ist].father)!=tree.root; ist=father) {
+      if ((son2=nodes[father].sons[0])==ist)  son2=nodes[father].sons[1];
+      Ures = W+(size_t)father*MPsize;
+      N[father] = N[ist]+N[son2] + MPFitch(Ures, U[ist], U[son2]);
+      U[father] = Ures;
+   }
+   Ures = W+(size_t)tree.root*MPsize;
+   N[tree.root] = N[nodes[tree.root].sons[0]]+N[nodes[tree.root].sons[1]]
+                + MPFitch(Ures, U[nodes[tree.root].sons[0]], U[nodes[tree.root].sons[1]]);
+   if (nodes[tree.root].nson==3) {
+      N[tree.root] += N[nodes[tree.root].sons[2]]
+                    + MPFitch(W, Ures, U[nodes[tree.root].sons[2]]);
+   }
+   score = N[tree.root];
 
-      if (save) {
-         memcpy (pU0, U, tree.nnode*sizeof(int));
-         memcpy (pN0, N, tree.nnode*sizeof(int));
+   if (save) {
+      memmove(_U0+(size_t)(is+2)*MPsize, _U0+(size_t)is*MPsize, (size_t)(nnode0-is)*MPsize*sizeof(unsigned long long));
+      memmove(_step0+is+2, _step0+is, (nnode0-is)*sizeof(double));
+      for (ist=is; ist!=-1; ist=nodes[ist].father) {
+         memcpy(_U0+(size_t)ist*MPsize, U[ist], MPsize*sizeof(unsigned long long));
+         _step0[ist] = N[ist];
       }
-      score+=N[tree.root]*com.fpatt[h];
    }
    return (score);
 }
@@ -4155,7 +4478,7 @@ double TreeScore(double x[], double space[])
 {
    static int fromfile=0;
    int i;
-   double xb[NP][2], e=1e-9, lnL=0;
+   double (*xb)[2], e=1e-9, lnL=0;
 
    if(com.clock==2) error2("local clock in TreeScore");
    com.ntime = com.clock ? tree.nnode-com.ns : tree.nbranch;
@@ -4163,6 +4486,7 @@ double TreeScore(double x[], double space[])
    GetInitials(x, &i);  /* this shoulbe be improved??? */
    if(i) fromfile=1;
    PointconPnodes();
+   if((xb=(double(*)[2])malloc(max2(com.np,1)*2*sizeof(double))) == NULL) error2("oom xb");
 
    if(com.method==0 || !fromfile) SetxBound(com.np, xb);
 
@@ -4175,21 +4499,113 @@ double TreeScore(double x[], double space[])
       ming2(NULL,&lnL,com.plfun,NULL,x,xb, space,e,com.np);
    else
       minB(NULL, &lnL, x, xb, e, space);
+   free(xb);
+
+   return(lnL);
+}
+
+
+int LazyAddition=0;  /* set by the main program, see StepwiseAddition() */
 
+static int _is, _ilazy[3], _seed, _sizetree;
+static double *_xlazy;
+
+static double LazyAdditionFun (double xs[], int n)
+{
+   int i;
+
+   for(i=0; i<n; i++) _xlazy[_ilazy[i]] = xs[i];
+   return com.plfun(_xlazy, com.np);
+}
+
+static double TreeScoreLazy (double x[], int ib, double space[])
+{
+/* This scores the tree with species _is just added on branch ib of treestar, 
+   optimizing only the 3 branches at the new node: ib, which now leads to the 
+   new node, the rest of ib below it (branch nb0), and the branch to _is 
+   (nb0+1).  The other branch lengths and parameters are fixed at the 
+   estimates for treestar in treebest.x, and with the conP cache on, each 
+   calculation updates conP only on the path from the new node to the root.
+*/
+   int nb0=treestar.tree.nbranch, i, fromfile;
+   double (*xb)[2], xs[3], xbs[3][2], lnL=0;
+
+   com.ntime = tree.nbranch;
+   GetInitials(x, &fromfile);
+   if(fromfile) return TreeScore(x, space);
+   if((xb=(double(*)[2])malloc(com.np*2*sizeof(double))) == NULL) error2("oom xb");
+   for(i=com.ntime; i<com.np; i++) x[i] = treebest.x[nb0+i-com.ntime];
+   for(i=0; i<nb0; i++) x[i] = treebest.x[i];
+   x[ib] = x[nb0] = treebest.x[ib]/2;
+   x[nb0+1] = 0.1;
+   SetxBound(com.np, xb);
+   _ilazy[0] = ib;  _ilazy[1] = nb0;  _ilazy[2] = nb0+1;
+   for(i=0; i<3; i++) {
+      xs[i] = x[_ilazy[i]];
+      xbs[i][0] = xb[_ilazy[i]][0];  xbs[i][1] = xb[_ilazy[i]][1];
+   }
+   free(xb);
+   _xlazy = x;
+   PointconPnodes();
+   ConPCache(1);
+   ming2(NULL, &lnL, LazyAdditionFun, NULL, xs, xbs, space, 1e-9, 3);
+   ConPCache(0);
+   for(i=0; i<3; i++) x[_ilazy[i]] = xs[i];
+   return(lnL);
+}
+
+static double TreeScoreFrom (double x[], double space[])
+{
+/* as TreeScore(), but starting from x[] for the current tree.
+*/
+   double (*xb)[2], lnL=0;
+
+   if((xb=(double(*)[2])malloc(max2(com.np,1)*2*sizeof(double))) == NULL) error2("oom xb");
+   SetxBound(com.np, xb);
+   PointconPnodes();
+   ConPCache(1);
+   ming2(NULL, &lnL, com.plfun, NULL, x, xb, space, 1e-9, com.np);
+   ConPCache(0);
+   free(xb);
    return(lnL);
 }
 
+static void StepwiseAdditionPoint (int j, double out[])
+{
+/* out[0] has the score and out[1] x[] for adding species _is on branch j of 
+   treestar, which is one of the candidates done by FunPoints().  The random 
+   numbers for the initial values depend on j only, so that the result does 
+   not depend on the number of processes.
+*/
+   int noisy0=noisy;
+
+   tree=treestar.tree;  memcpy(nodes, treestar.nodes, _sizetree);
+   AddSpecies(_is, j);
+   SetSeed(_seed+j, 0);
+   noisy = 0;
+   if(LazyAddition && !com.clock && _is>3)
+      out[0] = TreeScoreLazy(out+1, j, com.space);
+   else
+      out[0] = TreeScore(out+1, com.space);
+   noisy = noisy0;
+}
 
 int StepwiseAddition (FILE* fout, double space[])
 {
 /* heuristic tree search by species addition.  Species are added in the order 
    of occurrence in the data.
    Try to get good initial values.
+   The candidate branches for each species are independent, and are done by 
+   FunPoints(), shared among NFunProcesses processes, each with its own copy 
+   of the tree.  The best is taken in the order of the branches.  With 
+   LazyAddition, a candidate is scored with only the 3 branches at the new 
+   node optimized (TreeScoreLazy()), and only the best tree is then fitted 
+   in full, starting from those estimates.
 */
    char *z0[NS], *spname0[NS];
-   int ns0=com.ns, is, i,j, bestbranch=0, randadd=0, order[NS];
+   int ns0=com.ns, is, i,j, bestbranch=0, randadd=0, order[NS], ncand, nout;
    int sizetree=(2*com.ns-1)*sizeof(struct TREEN);
-   double bestscore=0,score, *x=treestar.x;
+   double bestscore=0,score, *x=treestar.x, *out;
 
    if(com.ns>50) printf("if this crashes, increase com.sspace?");
 
@@ -4220,24 +4636,45 @@ int StepwiseAddition (FILE* fout, double space[])
    BranchToNode ();
    for (is=com.ns; is<ns0; is++) {                  /* add the is_th species */
       treestar.tree=tree;  memcpy (treestar.nodes, nodes, sizetree);
-
-      for (j=0; j<treestar.tree.nbranch+(com.clock>0); j++,com.ns--) { 
-         tree=treestar.tree;  memcpy(nodes, treestar.nodes, sizetree);
-         com.ns++;
-         AddSpecies(is,j);
-         score=TreeScore(x, space);
-         if (noisy>1)
-            { printf("\n "); OutTreeN(F0, 0, 0); printf("%12.3f",-score); }
-
+      ncand = treestar.tree.nbranch+(com.clock>0);
+      com.ns = is+1;
+      AddSpecies(is, 0);
+      com.ntime = com.clock ? tree.nnode-com.ns : tree.nbranch;
+      GetInitials(x, &i);
+      nout = 1+com.np;
+      if((out=(double*)malloc((size_t)ncand*nout*sizeof(double)))==NULL) 
+         error2("oom StepwiseAddition");
+      _is = is;  _sizetree = sizetree;  _seed = 1+(int)(rndu()*1e8);
+      FunPoints(ncand, nout, out, StepwiseAdditionPoint, (noisy ? "  candidates" : NULL));
+
+      for (j=0; j<ncand; j++) {
+         score = out[j*nout];
+         if (noisy>1) {
+            tree=treestar.tree;  memcpy(nodes, treestar.nodes, sizetree);
+            AddSpecies(is,j);
+            printf("\n "); OutTreeN(F0, 0, 0); printf("%12.3f",-score);
+         }
          if (j==0 || score<bestscore || (score==bestscore&&rndu()<.2)) {
-            treebest.tree=tree;  memcpy(treebest.nodes, nodes, sizetree);
-            xtoy (x, treebest.x, com.np);
             bestscore=score; bestbranch=j;
          }
       }
-      tree=treebest.tree;  memcpy(nodes,treebest.nodes, sizetree);
-      xtoy (treebest.x, x, com.np);
-      com.ns=is+1;
+      tree=treestar.tree;  memcpy(nodes, treestar.nodes, sizetree);
+      AddSpecies(is,bestbranch);
+      com.ntime = com.clock ? tree.nnode-com.ns : tree.nbranch;
+      GetInitials(x, &i);
+      xtoy(out+bestbranch*nout+1, x, com.np);
+      if(LazyAddition && !com.clock && is>3 && !i) {
+         if (noisy) printf("\n  fitting the best tree");
+         bestscore = TreeScoreFrom(x, space);
+      }
+      else {
+         PointconPnodes();
+         com.plfun(x, com.np);   /* sets the branch lengths */
+      }
+      free(out);
+      nodes[tree.root].branch = 0;   /* not left from another candidate */
+      treebest.tree=tree;  memcpy(treebest.nodes, nodes, sizetree);
+      xtoy (x, treebest.x, com.np);
 
       if (noisy) {
          printf("\n\nAdded sp. %d, %s [%.3f]\n",is+1,com.spname[is],-bestscore);
@@ -4278,9 +4715,11 @@ int StarDecomposition (FILE *fout, double space[])
    int status=0,stage=0, i,j, itree,ntree=0,ntreet,best=0,improve=1,collaps=0;
    int inode, nson=0, ison1,ison2, son1, son2;
    int sizetree=(2*com.ns-1)*sizeof(struct TREEN);
-   double x[NP];
+   double *x=(double*)malloc(NP*sizeof(double));
    FILE *ftree, *fsum=frst;
 
+   if(x==NULL) error2("oom StarDecomposition");
+
    if (com.runmode==1) {   /* read the star-like tree from tree file */
       if ((ftree=fopen (com.treef,"r"))==NULL)
          error2("no treefile");
@@ -4436,6 +4875,7 @@ int StarDecomposition (FILE *fout, double space[])
 
    if (com.ns<=4 && !improve && best) error2("strange");
 
+   free(x);
    if (com.ns<=4) return (best);
    else return (0);
 }
@@ -4664,13 +5104,11 @@ for(ig=0,lg=0; ig<com.ngene; ig++) wantgene[ig]=!wantgene[ig];
 #ifdef PARSIMONY
 
 void UpPassScoreOnly (int inode);
-void UpPassScoreOnlyB (int inode);
 
-static int *Nsteps, *chUB;   /* MM */
+static int *Nsteps;   /* MM */
 static char *Kspace, *chU, *NchU; 
 /* Elements of chU are character states (there are NchU of them).  This 
    representation is used to speed up calculation for large trees.
-   Bit operations on chUB are performed for binary trees
 */
 
 void UpPassScoreOnly (int inode)
@@ -4694,68 +5132,68 @@ void UpPassScoreOnly (int inode)
    FOR (i, nodes[inode].nson)  Nsteps[inode]+=Nsteps[nodes[inode].sons[i]];
 }
 
-void UpPassScoreOnlyB (int inode)
+
+static double MPScoreBit (int inode, unsigned long long U[])
 {
-/* uses bit operation, for binary trees only 
+/* Fitch pass for the subtree at inode, with U[inode*MPsize] for interior 
+   nodes, and U[tree.nnode*MPsize] as work space for a root with 3 sons, 
+   which is resolved as ((s0,s1),s2), with the same score.
 */
-   int ison1,ison2, i, change=0;
-
-   FOR (i,nodes[inode].nson)
-      if (nodes[nodes[inode].sons[i]].nson>0)
-          UpPassScoreOnlyB (nodes[inode].sons[i]);
+   int i, ison[3];
+   double score=0;
+   unsigned long long *Us[3], *Uf=U+(size_t)inode*MPsize;
 
-   ison1=nodes[inode].sons[0];  ison2=nodes[inode].sons[1];
-   if ((chUB[inode]=(chUB[ison1] & chUB[ison2]))==0)
-      { chUB[inode]=(chUB[ison1] | chUB[ison2]);  change=1; }
-   Nsteps[inode]=change+Nsteps[ison1]+Nsteps[ison2];
+   for(i=0; i<nodes[inode].nson; i++) {
+      ison[i] = nodes[inode].sons[i];
+      if(nodes[ison[i]].nson>0) {
+         score += MPScoreBit(ison[i], U);
+         Us[i] = U+(size_t)ison[i]*MPsize;
+      }
+      else
+         Us[i] = MPTip+(size_t)ison[i]*MPsize;
+   }
+   if(nodes[inode].nson==2)
+      score += MPFitch(Uf, Us[0], Us[1]);
+   else {
+      score += MPFitch(U+(size_t)tree.nnode*MPsize, Us[0], Us[1]);
+      score += MPFitch(Uf, U+(size_t)tree.nnode*MPsize, Us[2]);
+   }
+   return(score);
 }
 
-
 double MPScore (double space[])
 {
 /* calculates MP score for a given tree using Hartigan's (1973) algorithm.
    sizeof(space) = nnode*sizeof(int)+(nnode+2)*ncode*sizeof(char).
    Uses Nsteps[nnode], chU[nnode*ncode], NchU[nnode].
-   if(BitOperation), bit operations are used on binary trees.
+   Binary trees (with 2 or 3 sons at the root) use the bit-parallel Fitch 
+   pass, MPScoreBit(), on all site patterns at once.
 */
-   int h,i, BitOperation,U[3],change;
+   int h,i, BitOperation;
    double score;
+   static unsigned long long *U=NULL;
+   static size_t sU=0;
 
-   Nsteps=(int*)space;
    BitOperation=(tree.nnode==2*com.ns-1 - (nodes[tree.root].nson==3));
-   BitOperation=(BitOperation&&com.ncode<32);
-   if (BitOperation)  chUB=Nsteps+tree.nnode;
-   else {
-      chU=(char*)(Nsteps+tree.nnode);
-      NchU=chU+tree.nnode*com.ncode;  Kspace=NchU+tree.nnode;
+   if (BitOperation) {
+      MPPack();
+      if(sU < (size_t)(tree.nnode+1)*MPsize) {
+         sU = (size_t)(tree.nnode+1)*MPsize;
+         if((U=(unsigned long long*)realloc(U, sU*sizeof(unsigned long long)))==NULL)
+            error2("oom MPScore");
+      }
+      return MPScoreBit(tree.root, U);
    }
+   Nsteps=(int*)space;
+   chU=(char*)(Nsteps+tree.nnode);
+   NchU=chU+tree.nnode*com.ncode;  Kspace=NchU+tree.nnode;
    for (h=0,score=0; h<com.npatt; h++) {
       FOR (i,tree.nnode) Nsteps[i]=0;
-      if (BitOperation) { 
-         FOR (i,com.ns)  chUB[i]=1<<(com.z[i][h]);
-         UpPassScoreOnlyB (tree.root);
-         if (nodes[tree.root].nson>2) {
-            FOR (i,3) U[i]=chUB[nodes[tree.root].sons[i]];
-            change=2;
-            if (U[0]&U[1]&U[2]) change=0;
-            else if (U[0]&U[1] || U[1]&U[2] || U[0]&U[2]) change=1;
-            for (i=0,Nsteps[tree.root]=change; i<3; i++) 
-               Nsteps[tree.root]+=Nsteps[nodes[tree.root].sons[i]];
-       }
-      }
-      else {                   /* polytomies, use characters */
-         FOR(i,com.ns)
-            {chU[i*com.ncode]=(char)(com.z[i][h]); NchU[i]=(char)1; }
-         for (i=com.ns; i<tree.nnode; i++)  NchU[i]=0;
-         UpPassScoreOnly (tree.root);
-      }
+      FOR(i,com.ns)
+         {chU[i*com.ncode]=(char)(com.z[i][h]); NchU[i]=(char)1; }
+      for (i=com.ns; i<tree.nnode; i++)  NchU[i]=0;
+      UpPassScoreOnly (tree.root);
       score+=Nsteps[tree.root]*com.fpatt[h];
-/*
-printf("\nh %3d:    ", h+1);
-FOR(i,com.ns) printf("%2d  ", com.z[i][h]);
-printf(" %6d ", Nsteps[tree.root]);
-if((h+1)%10==0) exit(1);
-*/
    }
 
    return (score);
@@ -5569,12 +6007,30 @@ int isNodeDescendent(int inode, int jnode) {
    
    return isDescendent;
 }
+
+int NumBranchPairs(void) {
+   // Number of pairs of independent branches (neither is a descendent of the other), 
+   // less pairs of sister tips with excludeTipTips.
+   int inode, jnode, numBranchPairs = 0;
+
+   for (inode=0; inode<tree.nnode; inode++) {
+      if (nodes[inode].father == -1) continue;
+      for (jnode=inode+1; jnode<tree.nnode; jnode++) {
+         if (nodes[jnode].father == -1) continue;
+         if (isNodeDescendent(inode, jnode)) continue;
+         if (isNodeDescendent(jnode, inode)) continue;
+         if (com.excludeTipTips && (nodes[inode].father == nodes[jnode].father) && ( nodes[inode].nson < 1 ) && ( nodes[jnode].nson < 1 ) ) continue;
+         numBranchPairs++;
+      }
+   }
+   return numBranchPairs;
+}
 #endif
 
 #ifdef JDKLAB
 void PostProbFwdBwd(double x[])
 {
-   int ii, aa, aa_2, gg, hp;
+   int ii, aa, gg, hp;
    int lst=(com.readpattern?com.npatt:com.ls);
    double *sPMat= (double*)malloc(tree.nnode*com.ncatG*20*20*sizeof(double));    // precomputed PMat values (over all node and gamma cat)
    int *LRLabel = (int*)malloc(tree.nnode*2*sizeof(int));            //stores the id of the node being pointed to by each L and R
@@ -5585,16 +6041,20 @@ void PostProbFwdBwd(double x[])
    double *D = (double*)malloc(tree.nnode*20*com.ncatG*sizeof(double));
    double *U = (double*)malloc(tree.nnode*20*com.ncatG*sizeof(double));
 
+   double *tb = (double*)malloc(tree.nnode*com.ncatG*sizeof(double));
+   int *nodeb = (int*)malloc(tree.nnode*com.ncatG*sizeof(int));
+
+   // all branches and gamma categories in one batch, in the order of sPMat
    for (ii=0; ii < tree.nnode; ii++)
    {
       for (gg = 0; gg < com.ncatG; gg++)
       {
-         GetPMatBranch(PMat, x, nodes[ii].branch*com.rK[gg], ii);
-         for (aa=0; aa < 20; aa++)
-            for (aa_2=0; aa_2 < 20; aa_2++)
-               sPMat[(ii*com.ncatG*20*20)+(gg*20*20)+(aa*20)+aa_2] = PMat[aa*20+aa_2];
+         tb[ii*com.ncatG+gg] = nodes[ii].branch*com.rK[gg];
+         nodeb[ii*com.ncatG+gg] = ii;
       }
    }
+   GetPMatBranches(sPMat, x, tree.nnode*com.ncatG, tb, nodeb);
+   free(tb);  free(nodeb);
 
    for (hp=0; hp < com.npatt; hp++)
    {
@@ -5836,7 +6296,9 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
       fprintf(fout,"\nProb distribs at nodes, those with p < %.3f not listed\n", smallp);
 
 #ifdef JDKLAB
+   StageBegin(StagePostProb);
    PostProbFwdBwd(x);   // A much quicker way of ancestral reconstruction.
+   StageEnd(StagePostProb);
 #endif
 
 #ifndef JDKLAB
@@ -6062,13 +6524,20 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
    }
 
    int ir, iir;
+   double *PMatNodes = (double*)malloc(tree.nnode*(n*n+1)*sizeof(double)), *tNodes = PMatNodes+tree.nnode*n*n;
+   int *iNodes = (int*)malloc(tree.nnode*sizeof(int));
+   if (PMatNodes == NULL || iNodes == NULL) error2("oom PMatNodes");
    ReRootTree(oldroot);
 
+   StageBegin(StageConP);
+   // Each gene (com.posG[]) has its own parameters (SetPGene) and conP, so only
+   // its own sites are done in its pass, and conP_part1 is cleared only once.
+   memset(com.conP_part1, 0, SizeConPPart1());
+   printf("\nCalculating posterior event probabilities...\n");
    for(ig=0; ig<com.ngene; ig++) { /* alpha may differ over ig */
       if(com.Mgene>1 || com.nalpha>1)
          SetPGene(ig, com.Mgene>1, com.Mgene>1, com.nalpha>1, x);
       int pos0 = com.posG[ig], pos1 = com.posG[ig+1];
-      printf("\nCalculating posterior event probabilities...\n");
       for(ir=0; ir<com.ncatG; ir++) {
          if(ir && com.conPSiteClass) {  /* shift com.nodeScaleF & conP */
             if(com.NnodeScale) com.nodeScaleF+=com.npatt*com.NnodeScale;
@@ -6077,34 +6546,39 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
          }
          if (ir==0) {
             //Clear it out...
-            for (inode=com.ns; inode<tree.nnode; inode++) {  
-               // memset(nodes[inode].conP_prior, 0, (lst*n*n)*sizeof(double));
-               memset(nodes[inode].conP_part1, 0, (lst*n*n)*sizeof(double));  
-               memset(nodes[inode].conP, 0, ((pos1-pos0)*n)*sizeof(double));  
-            }
+            for (inode=com.ns; inode<tree.nnode; inode++)
+               memset(nodes[inode].conP+pos0*n, 0, ((pos1-pos0)*n)*sizeof(double));  
          }
 
          SetPSiteClass(ir,x);
          ConditionalPNode(tree.root,ig, x);
-         int pos0 = com.posG[ig], pos1 = com.posG[ig+1];
 
+         // P(t) for all the branches in this site class, in one batch (t=0 for the root)
+         for (inode=0; inode<tree.nnode; inode++) {
+            tNodes[inode] = 0;
+            iNodes[inode] = inode;
+            if (inode == tree.root) continue;
+            tNodes[inode] = nodes[inode].branch*_rateSite;
+            if(com.clock<5) {
+               if(com.clock)  tNodes[inode] *= GetBranchRate(ig,(int)nodes[inode].label,x,NULL);
+               else           tNodes[inode] *= com.rgene[ig];
+            }
+         }
+         GetPMatBranches(PMatNodes, x, tree.nnode, tNodes, iNodes);
+
+         #pragma omp parallel for private(hp, inode) schedule(static) num_threads(com.numOfThreads)
          for (h=0; h<lst; h++) {
             hp=(!com.readpattern ? com.pose[h] : h);
+            if (hp<pos0 || hp>=pos1) continue;    // site from another gene
 
             for (inode=0; inode<tree.nnode; inode++) { //com.ns
                if (inode == tree.root) continue;
-               double t, sum, sum2;
-               int igene=ig, j, k;
+               double sum, sum2;
+               int j, k;
                int hhh;    
 
                // We need to get the individual conditional P's times the Pmat first, then sum them up for the normalization...
-               t = nodes[inode].branch*_rateSite;
-
-               if(com.clock<5) {
-                  if(com.clock)  t *= GetBranchRate(igene,(int)nodes[inode].label,x,NULL);
-                  else           t *= com.rgene[igene];
-               }
-               GetPMatBranch(PMat, x, t, inode);
+               double *Pt = PMatNodes+inode*n*n;
 
                if(nodes[inode].nson<1) { //tips
                   // Skip ambiguities in the sequence data
@@ -6116,20 +6590,27 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
                   FOR(j,n) {
                      sum = 0.0;
                      for (k=0; k<n; k++) {
-                        sum += (  PMat[j*n+k] * nodes[inode].conP[hp*n+k]  );
+                        sum += (  Pt[j*n+k] * nodes[inode].conP[hp*n+k]  );
                      }
                      sum = (sum == 0) ? 0: (1/sum);
                      for (k=0; k<n; k++) {
-                        nodes[inode].conP_part1[(h*n*n)+(j*n)+k] +=  p[j] * (PMat[j*n+k] * nodes[inode].conP[hp*n+k] ) * sum;
+                        nodes[inode].conP_part1[(h*n*n)+(j*n)+k] +=  p[j] * (Pt[j*n+k] * nodes[inode].conP[hp*n+k] ) * sum;
                         // conP_prior is not needed, but keep in the code commented out for later
-                        // nodes[inode].conP_prior[(h*n*n)+(j*n)+k] +=  com.freqK[ir] * com.pi[j] * PMat[j*n+k];
+                        // nodes[inode].conP_prior[(h*n*n)+(j*n)+k] +=  com.freqK[ir] * com.pi[j] * Pt[j*n+k];
                      }
                   }
                }
             } // nodes
          } // site
       } // site cat
+      if(com.conPSiteClass) {  /* shift pointers conP back */
+         if(com.NnodeScale) com.nodeScaleF -= (com.ncatG-1)*com.NnodeScale*(size_t)com.npatt;
+         for(i=com.ns; i<tree.nnode; i++)
+            nodes[i].conP -= (com.ncatG-1)*(size_t)(tree.nnode-com.ns)*com.ncode*com.npatt;
+      }
    } //genes
+   StageEnd(StageConP);
+   free(PMatNodes);  free(iNodes);
    
    // BEGINNING OF THE MAIN CONVERGENCE/DIVERGENCE STUFF -------------------------------------------------------------------------------------------------------------------------------
    // CALCULATION OF MOST OF THE CONVERGENT, DIVERGENT SUBSTITUTIONS OCCURS HERE (REQUISITE PROBABILITIES HAVE BEEN COLLECTED OVER THE TREE ALREADY; JUST NEED TO SUM UP)...
@@ -6137,22 +6618,7 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
    double probConverge, probParallel, probConverge_liberal, probDiverge;
    
    // COUNT THE NUMBER OF INDEPENDENT BRANCH PAIRS...
-   int numBranchPairs = 0;
-   for(ig=0; ig<com.ngene; ig++) { /* alpha may differ over ig */
-      for (inode=0; inode<tree.nnode; inode++) {
-         if (nodes[inode].father == -1) continue;
-         for (jnode=inode; jnode<tree.nnode; jnode++) {
-            if (jnode == inode) continue;
-            if (nodes[jnode].father == -1) continue;
-            // Need to also skip comparisons between branches that aren't 'independent'...
-            if (isNodeDescendent(inode, jnode)) continue;
-            if (isNodeDescendent(jnode, inode)) continue;
-            // add the optional conditional to skip pairs of tip lineages
-            if (com.excludeTipTips && (nodes[inode].father == nodes[jnode].father) && ( nodes[inode].nson < 1 ) && ( nodes[jnode].nson < 1 ) ) continue;
-            numBranchPairs++;
-         }
-      }
-   }
+   int numBranchPairs = NumBranchPairs();
    
    printf("\n\nThere are %d branch pairs that follow divergent paths through the tree.  Totalling probabilities of subs over these...\n", numBranchPairs);
    
@@ -6161,11 +6627,18 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
    double *pDivergentOnSite, *pAllConvergentOnSite;
    double *postNumSub;
    int *siteClass;
+   // The sites are taken in blocks of nsb, so that the per-site arrays fit in the memory 
+   // budget (see MemoryPlan).  Sums over sites are in the same order whatever the block size.
+   int h0, nsb = (com.blockSites>0 && com.blockSites<lst ? com.blockSites : lst);
+   #ifdef PARA_ON_NODE
+   nsb = lst;  // site-specific output is by pair, over all sites; MemoryPlan does not block
+   #endif
    
-   pDivergentOnSite = (double*)malloc( (lst*numBranchPairs) * sizeof(double) );
-   pAllConvergentOnSite  = (double*)malloc( (lst*numBranchPairs) * sizeof(double) );
+   pDivergentOnSite = (double*)malloc( ((size_t)nsb*numBranchPairs) * sizeof(double) );
+   pAllConvergentOnSite  = (double*)malloc( ((size_t)nsb*numBranchPairs) * sizeof(double) );
    pDivergent = malloc( numBranchPairs * sizeof(double) );
    pAllConvergent = malloc( numBranchPairs * sizeof(double) );
+   if (pDivergentOnSite == NULL || pAllConvergentOnSite == NULL) error2("oom OnSite");
 
    node1 = malloc( numBranchPairs * sizeof(int) );
    node2 = malloc( numBranchPairs * sizeof(int) );
@@ -6210,112 +6683,143 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
       } //jnode
    } // inode
 
-   for(ig=0; ig<com.ngene; ig++) { // alpha may differ over ig
-      // Parallel with openmp
-      #pragma omp parallel for \
-         private(h, j, k, j2, k2, probConverge_liberal, probDiverge, nodes_index, hp) \
-         num_threads(com.numOfThreads) 
-      
-      #ifdef PARA_ON_NODE
+   // Output site-specific posterior probabilities of convergence (and divergence) for requested branch pairs only   
+   FILE *branchP;
+   branchP = fopen("site-specific-posteriors.out", "w");
+   fprintf(branchP, "SiteNumber\tSitePattern\tBranch1\tBranch2\tP-Diverge\tP-Converge\n");
+
+   float *siteSpecificMap = (float*)malloc((2*lst*com.numOfSelectedBranchPairs)*sizeof(float));
+   memset(siteSpecificMap, 0, (2*lst*com.numOfSelectedBranchPairs)*sizeof(float));
+
+   // Totals for each gene as well, in the same pass, if there are genes (com.posG[])
+   double *pDivergentG=NULL, *pAllConvergentG=NULL;
+   int *siteGene=NULL;
+   if (com.ngene>1) {
+      pDivergentG = (double*)calloc((size_t)com.ngene*numBranchPairs*2, sizeof(double));
+      siteGene = (int*)malloc(lst*sizeof(int));
+      if (pDivergentG == NULL || siteGene == NULL) error2("oom pDivergentG");
+      pAllConvergentG = pDivergentG + (size_t)com.ngene*numBranchPairs;
+      for(h=0; h<lst; h++) {
+         hp=(!com.readpattern ? com.pose[h] : h);
+         for(ig=1; ig<com.ngene; ig++) 
+            if(hp<com.posG[ig]) break;
+         siteGene[h] = ig-1;
+      }
+   }
+
+   StageBegin(StagePairs);
+   for(h0=0; h0<lst; h0+=nsb) {
+   int h1 = min2(h0+nsb, lst);
+
+   // one pass over the sites of all genes: conP_part1 has each gene's parameters
+   // Parallel with openmp
+   #pragma omp parallel for \
+      private(h, j, k, j2, k2, probConverge_liberal, probDiverge, nodes_index, hp) \
+      num_threads(com.numOfThreads) 
+   
+   #ifdef PARA_ON_NODE
+   for(nodes_index = 0; nodes_index < numBranchPairs*3; nodes_index += 3){
+      int inode = nodesIndexs[nodes_index], jnode = nodesIndexs[nodes_index+1];
+      int pairCount = nodes_index/3;
+      node1[pairCount] = inode; node2[pairCount] = jnode;
+      double sumdK[n], sumcK[n], tbusy = ThreadBusyBegin();
+      for(h=h0;h<h1; h++) {
+         hp=(!com.readpattern ? com.pose[h] : h);
+   #endif
+
+   #ifdef PARA_ON_SITE
+   for(h=h0;h<h1; h++) {
+      hp=(!com.readpattern ? com.pose[h] : h);
+      double sumdK[n], sumcK[n], tbusy = ThreadBusyBegin();
       for(nodes_index = 0; nodes_index < numBranchPairs*3; nodes_index += 3){
          int inode = nodesIndexs[nodes_index], jnode = nodesIndexs[nodes_index+1];
          int pairCount = nodes_index/3;
          node1[pairCount] = inode; node2[pairCount] = jnode;
-         double sumdK[n], sumcK[n];
-         for(h=0;h<lst; h++) {
-            hp=(!com.readpattern ? com.pose[h] : h);
-      #endif
-
-      #ifdef PARA_ON_SITE
-      for(h=0;h<lst; h++) {
-         hp=(!com.readpattern ? com.pose[h] : h);
-         double sumdK[n], sumcK[n];
-         for(nodes_index = 0; nodes_index < numBranchPairs*3; nodes_index += 3){
-            int inode = nodesIndexs[nodes_index], jnode = nodesIndexs[nodes_index+1];
-            int pairCount = nodes_index/3;
-            node1[pairCount] = inode; node2[pairCount] = jnode;
-      #endif
+   #endif
 
-            double *inode_conP_part1 = com.conP_part1 + nodes_conP_part1_offset[inode]+h*n*n;
-            double *jnode_conP_part1 = com.conP_part1 + nodes_conP_part1_offset[jnode]+h*n*n;
-            double sumdforJ=0;   
-
-            memset(sumdK,0, sizeof(sumdK));
-            memset(sumcK,0, sizeof(sumcK));
-            for(j=0;j<n;j++){
-              #pragma simd
-               for (k=0; k<n; k++) {
-                  sumcK[k] += jnode_conP_part1[j*n+k];
-                  sumdforJ += jnode_conP_part1[j*n+k];
-               }
-               sumcK[j] -= jnode_conP_part1[j*n+j];
-               sumdforJ -= jnode_conP_part1[j*n+j];
-            }    
+         double *inode_conP_part1 = com.conP_part1 + nodes_conP_part1_offset[inode]+h*n*n;
+         double *jnode_conP_part1 = com.conP_part1 + nodes_conP_part1_offset[jnode]+h*n*n;
+         double sumdforJ=0;   
 
-            #pragma simd
+         memset(sumdK,0, sizeof(sumdK));
+         memset(sumcK,0, sizeof(sumcK));
+         for(j=0;j<n;j++){
+           #pragma simd
             for (k=0; k<n; k++) {
-               sumdK[k] = sumdforJ - sumcK[k];
+               sumcK[k] += jnode_conP_part1[j*n+k];
+               sumdforJ += jnode_conP_part1[j*n+k];
             }
+            sumcK[j] -= jnode_conP_part1[j*n+j];
+            sumdforJ -= jnode_conP_part1[j*n+j];
+         }    
+
+         #pragma simd
+         for (k=0; k<n; k++) {
+            sumdK[k] = sumdforJ - sumcK[k];
+         }
 
-            for (j=0, probConverge_liberal = probDiverge = 0.0; j<n;j++) { 
-               #pragma simd
-               for (k=0; k<n;k++) {
-                  probDiverge += sumdK[k] * inode_conP_part1[j*n + k]; 
-                  probConverge_liberal += sumcK[k] * inode_conP_part1[j*n + k]; 
-               } 
-               probDiverge -= sumdK[j] * inode_conP_part1[j*n + j]; 
-               probConverge_liberal -= sumcK[j] * inode_conP_part1[j*n + j]; 
+         for (j=0, probConverge_liberal = probDiverge = 0.0; j<n;j++) { 
+            #pragma simd
+            for (k=0; k<n;k++) {
+               probDiverge += sumdK[k] * inode_conP_part1[j*n + k]; 
+               probConverge_liberal += sumcK[k] * inode_conP_part1[j*n + k]; 
             } 
+            probDiverge -= sumdK[j] * inode_conP_part1[j*n + j]; 
+            probConverge_liberal -= sumcK[j] * inode_conP_part1[j*n + j]; 
+         } 
 
-            #ifdef PARA_ON_NODE
-               pDivergentOnSite[pairCount*lst+h] = probDiverge;
-               pAllConvergentOnSite[pairCount*lst+h] = probConverge_liberal;
-            #endif
+         #ifdef PARA_ON_NODE
+            pDivergentOnSite[pairCount*nsb+h-h0] = probDiverge;
+            pAllConvergentOnSite[pairCount*nsb+h-h0] = probConverge_liberal;
+         #endif
 
-            #ifdef PARA_ON_SITE
-               pDivergentOnSite[h*numBranchPairs+pairCount] = probDiverge;
-               pAllConvergentOnSite[h*numBranchPairs+pairCount] = probConverge_liberal;
-            #endif
+         #ifdef PARA_ON_SITE
+            pDivergentOnSite[(h-h0)*numBranchPairs+pairCount] = probDiverge;
+            pAllConvergentOnSite[(h-h0)*numBranchPairs+pairCount] = probConverge_liberal;
+         #endif
 
-         }
       }
+      ThreadBusyEnd(StagePairs, tbusy);
    }
 
    // accumulate site diverge and converge rate onto each branch
    #ifdef PARA_ON_NODE
    for (ig=0;ig<numBranchPairs;ig++) {
-      for(h=0;h<lst; h++) {
-         pDivergent[ig] += pDivergentOnSite[ig*lst+h]; 
-         pAllConvergent[ig] += pAllConvergentOnSite[ig*lst+h];
+      for(h=h0;h<h1; h++) {
+         pDivergent[ig] += pDivergentOnSite[ig*nsb+h-h0]; 
+         pAllConvergent[ig] += pAllConvergentOnSite[ig*nsb+h-h0];
+         if (siteGene) {
+            pDivergentG[siteGene[h]*numBranchPairs+ig] += pDivergentOnSite[ig*nsb+h-h0];
+            pAllConvergentG[siteGene[h]*numBranchPairs+ig] += pAllConvergentOnSite[ig*nsb+h-h0];
+         }
       }
    }
    #endif
 
    #ifdef PARA_ON_SITE
-   for(h=0;h<lst; h++) {
+   for(h=h0;h<h1; h++) {
       for (ig=0;ig<numBranchPairs;ig++) {
-         pDivergent[ig] += pDivergentOnSite[h*numBranchPairs+ig]; 
-         pAllConvergent[ig] += pAllConvergentOnSite[h*numBranchPairs+ig];
+         pDivergent[ig] += pDivergentOnSite[(h-h0)*numBranchPairs+ig]; 
+         pAllConvergent[ig] += pAllConvergentOnSite[(h-h0)*numBranchPairs+ig];
+      }
+      if (siteGene) {
+         double *pd = pDivergentG + siteGene[h]*numBranchPairs, *pc = pAllConvergentG + siteGene[h]*numBranchPairs;
+         for (ig=0;ig<numBranchPairs;ig++) {
+            pd[ig] += pDivergentOnSite[(h-h0)*numBranchPairs+ig]; 
+            pc[ig] += pAllConvergentOnSite[(h-h0)*numBranchPairs+ig];
+         }
       }
    }
    #endif
 
-   // Output site-specific posterior probabilities of convergence (and divergence) for requested branch pairs only   
-   FILE *branchP;
-   branchP = fopen("site-specific-posteriors.out", "w");
-   fprintf(branchP, "SiteNumber\tSitePattern\tBranch1\tBranch2\tP-Diverge\tP-Converge\n");
-
-   float *siteSpecificMap = (float*)malloc((2*lst*com.numOfSelectedBranchPairs)*sizeof(float));
-   memset(siteSpecificMap, 0, (2*lst*com.numOfSelectedBranchPairs)*sizeof(float));
-
    #ifdef PARA_ON_NODE
    for(nodes_index = 0; nodes_index < numBranchPairs*3; nodes_index += 3){
       int inode = nodesIndexs[nodes_index], jnode = nodesIndexs[nodes_index+1];
       int pairCount = nodes_index/3;
-      for(h=0; h < lst; h++){
+      for(h=h0; h < h1; h++){
          hp=(!com.readpattern ? com.pose[h] : h);
-         double probDiverge = pDivergentOnSite[pairCount*lst+h];
-         double probConverge_liberal = pAllConvergentOnSite[pairCount*lst+h];
+         double probDiverge = pDivergentOnSite[pairCount*nsb+h-h0];
+         double probConverge_liberal = pAllConvergentOnSite[pairCount*nsb+h-h0];
          if ((nodesIndexs[nodes_index+2] == 1) && (probDiverge > 0.001 || probConverge_liberal > 0.001)){
             fprintf(branchP, "%d\t%d\t%d..%d\t%d..%d\t", h, hp, nodes[inode].father, inode, nodes[jnode].father, jnode);
             fprintf(branchP, "%.4f\t%.4f\n", probDiverge, probConverge_liberal);
@@ -6329,13 +6833,13 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
    #endif
 
    #ifdef PARA_ON_SITE
-   for(h=0; h < lst; h++){
+   for(h=h0; h < h1; h++){
       hp=(!com.readpattern ? com.pose[h] : h);
       for(nodes_index = 0; nodes_index < numBranchPairs*3; nodes_index += 3){
          int inode = nodesIndexs[nodes_index], jnode = nodesIndexs[nodes_index+1];
          int pairCount = nodes_index/3;
-         double probDiverge = pDivergentOnSite[h*numBranchPairs+pairCount];
-         double probConverge_liberal = pAllConvergentOnSite[h*numBranchPairs+pairCount];
+         double probDiverge = pDivergentOnSite[(h-h0)*numBranchPairs+pairCount];
+         double probConverge_liberal = pAllConvergentOnSite[(h-h0)*numBranchPairs+pairCount];
          if ((nodesIndexs[nodes_index+2] == 1) && (probDiverge > 0.001 ||probConverge_liberal > 0.001)){
             fprintf(branchP, "%d\t%d\t%d..%d\t%d..%d\t", h, hp, nodes[inode].father, inode, nodes[jnode].father, jnode);
             fprintf(branchP, "%.4f\t%.4f\n", probDiverge, probConverge_liberal);
@@ -6347,8 +6851,13 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
       }
    }
    #endif
+   }  // h0, blocks of sites
+   StageEnd(StagePairs);
 
    // Calculate the site-specific posterior number of substitutions
+   unsigned int *siteStates = (unsigned int*)malloc(com.npatt*sizeof(unsigned int));
+   if (siteStates == NULL) error2("oom siteStates");
+   SiteStateSets(siteStates);
    for (h=0; h < lst; h++) {
       for (inode = 0; inode < tree.nnode; inode++) {
          if (nodes[inode].father == -1) continue;
@@ -6360,14 +6869,16 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
          }
       }
       hp=(!com.readpattern ? com.pose[h] : h);
-      siteClass[h] = getSiteClass(hp);
+      siteClass[h] = BitCount(siteStates[hp]);
    }
+   free(siteStates);
 
    fclose(branchP);
-   free(pDivergentOnSite);
+   free(pDivergentOnSite);  free(pAllConvergentOnSite);
 
 
    // Output expected convergent and divergent counts for each branch-pair that passed filters
+   StageBegin(StageOutput);
    FILE *branchTotals;
    branchTotals = fopen("branch-totals.out", "w");
    fprintf(branchTotals, "Branch1\tBranch2\tE-Num-Diverge\tE-Num-Converge\n");
@@ -6377,6 +6888,16 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
    }
    
    fclose(branchTotals);
+   if (siteGene) {
+      branchTotals = fopen("branch-totals-genes.out", "w");
+      fprintf(branchTotals, "Gene\tBranch1\tBranch2\tE-Num-Diverge\tE-Num-Converge\n");
+      for (ig=0; ig<com.ngene; ig++)
+         for (j=0; j<numBranchPairs; j++)
+            fprintf(branchTotals,"%d\t%d\t%d\t%f\t%f\n", ig+1, node1[j], node2[j], 
+               pDivergentG[ig*numBranchPairs+j], pAllConvergentG[ig*numBranchPairs+j]);
+      fclose(branchTotals);
+      free(pDivergentG);  free(siteGene);
+   }
 
    // Replace estimated x values by user defined values
    if (com.userDivDist == 1)
@@ -6384,11 +6905,12 @@ int AncestralMarginal (FILE *fout, double x[], double fhsiteAnc[], double Sir[])
       SetUserDefDivergeDist(node1, node2, numBranchPairs, pDivergent);
    }
 
+   StageBegin(StageOutputJS);
    outputDataInJS(node1, node2, pDivergent, pAllConvergent, 
       siteSpecificMap, com.selectedBranchPairs, com.numOfSelectedBranchPairs, numBranchPairs, lst,
       postNumSub, siteClass);
-
-   free(pAllConvergentOnSite);
+   StageEnd(StageOutputJS);
+   StageEnd(StageOutput);
 #endif
 // End of JDKLAB code
 
@@ -6447,23 +6969,32 @@ double CalcDistance(int n1, int n2)
    return sqrt(nodes[n1].divDistance * nodes[n2].divDistance);
 }
 
-int getSiteClass(int hp)
+int BitCount (unsigned long long x)
 {
-   int numAA = 20;
-   int i, index, count=0;
-   int AAs[numAA];
-
-   for (i=0; i< numAA; i++) AAs[i] = 0;
+#if defined(__GNUC__)
+   return __builtin_popcountll(x);
+#else
+   int n;
+   for(n=0; x; n++) x &= x-1;
+   return n;
+#endif
+}
 
-   for (i=0; i < com.ns; i++) {
-      index = (int)com.z[i][hp];
+void SiteStateSets (unsigned int set[])
+{
+/* set[hp] has bit k on if amino acid k is found at site pattern hp in any of 
+   the sequences, with ambiguities (>=20) ignored, so that the number of 
+   distinct amino acids at the site is BitCount(set[hp]).  The sequences are 
+   swept one at a time rather than one site at a time, so that the inner loop 
+   runs over contiguous bytes and is vectorized by the compiler.
+*/
+   int i, hp, numAA=20;
+   unsigned char *z;
 
-      if (index < numAA){
-         if (AAs[index] == 0) count++; 
-         AAs[index]++;
-      }
-   }
-   return count;
+   for(hp=0; hp<com.npatt; hp++) set[hp] = 0;
+   for(i=0; i<com.ns; i++)
+      for(hp=0,z=com.z[i]; hp<com.npatt; hp++)
+         set[hp] |= (z[hp]<numAA ? 1u<<z[hp] : 0u);
 }
 
 
@@ -6999,6 +7530,7 @@ int AncestralSeqs (FILE *fout, double x[])
 
 int SetNodeScale(int inode);
 int NodeScale(int inode, int pos0, int pos1);
+int NodeScaleConP(int inode, int pos0, int pos1, double conP[], double scaleF[]);
 
 void InitializeNodeScale(void)
 {
@@ -7020,7 +7552,7 @@ void InitializeNodeScale(void)
    for(i=0; i<tree.nnode; i++) com.nodeScale[i] = 0;
    SetNodeScale(tree.root);
    nS = com.NnodeScale*com.npatt;
-   if(com.conPSiteClass) nS *= com.ncatG;
+   if(com.conPSiteClass || com.conPSiteClassPar) nS *= com.ncatG;
    if(com.NnodeScale) {
       if((com.nodeScaleF=(double*)realloc(com.nodeScaleF, nS*sizeof(double)))==NULL)
          error2("oom nscale");
@@ -7067,9 +7599,17 @@ int SetNodeScale (int inode)
 int NodeScale (int inode, int pos0, int pos1)
 {
 /* scale to avoid underflow
+*/
+   return NodeScaleConP(inode, pos0, pos1, nodes[inode].conP, com.nodeScaleF);
+}
+
+int NodeScaleConP (int inode, int pos0, int pos1, double conP[], double scaleF[])
+{
+/* This scales conP[] for inode, which may be in a copy other than 
+   nodes[inode].conP, and stores the scale factors in scaleF[].
 */
    int h,k,j, n=com.ncode;
-   double t, smallw=1e-12;
+   double t;
 
    for(j=0,k=0; j<tree.nnode; j++)   /* k-th node for scaling */
       if(j==inode) break;
@@ -7077,18 +7617,18 @@ int NodeScale (int inode, int pos0, int pos1)
 
    for(h=pos0; h<pos1; h++) {
       for(j=0,t=0;j<n;j++)
-         if(nodes[inode].conP[h*n+j]>t)
-            t = nodes[inode].conP[h*n+j];
+         if(conP[h*n+j]>t)
+            t = conP[h*n+j];
 
       if(t<1e-300) {
          for(j=0;j<n;j++)
-            nodes[inode].conP[h*n+j]=1;  /* both 0 and 1 fine */
-         com.nodeScaleF[k*com.npatt+h] = -800;  /* this is problematic? */
+            conP[h*n+j]=1;  /* both 0 and 1 fine */
+         scaleF[k*com.npatt+h] = -800;  /* this is problematic? */
       }
       else {  
          for(j=0;j<n;j++)
-            nodes[inode].conP[h*n+j]/=t;
-         com.nodeScaleF[k*com.npatt+h] = log(t);
+            conP[h*n+j]/=t;
+         scaleF[k*com.npatt+h] = log(t);
       }
    }
    return(0);
@@ -7103,6 +7643,29 @@ int fx_r(double x[], int np);
 
 #if (BASEML || CODEML)
 
+static double *HessianSKT2004_x;
+
+static void HessianSKT2004Point (int ipoint, double out[])
+{
+/* out[0] has lnL and out[1+h] has log(f_h) at xmle[] with x[i] moved down 
+   (ipoint=i) or up (ipoint=com.np+i).  This is one of the 2*np points done 
+   by FunPoints().
+*/
+   int i=ipoint%com.np, lastround0=LASTROUND;
+   double *x=(double*)malloc(com.np*sizeof(double)), eh;
+
+   if(x==NULL) error2("oom HessianSKT2004Point");
+   xtoy(HessianSKT2004_x, x, com.np);
+   eh = Small_Diff*2*(fabs(x[i]) + 1);
+   if(ipoint<com.np) x[i] -= eh;
+   else              x[i] += eh;
+   LASTROUND = 2;
+   dfsites = out+1;
+   out[0] = -com.plfun(x, com.np);
+   LASTROUND = lastround0;
+   free(x);
+}
+
 int HessianSKT2004 (double xmle[], double lnLm, double g[], double H[])
 {
 /* this calculates the hessian matrix of branch lengths using the approximation 
@@ -7117,60 +7680,44 @@ int HessianSKT2004 (double xmle[], double lnLm, double g[], double H[])
    available for other parameters.  Right now with method = 0, H and the SEs are 
    calculated for all parameters although the H matrix in rst2 is a subset for 
    branch lengths only.  More thought about what to do.  Ziheng's note on 8 March 2010.
+   The 2*np likelihood calculations are independent and are done by FunPoints(),
+   which shares them among the NFunProcesses processes.  out[(backforth*np+i)*(npatt+1)] 
+   has lnL and is followed by log(f_h) for the npatt patterns.
 */
-   int method=0, backforth, h, i, j, lastround0=LASTROUND, nzero=0;
-   double *x, *lnL[2], *df[2], eh0=Small_Diff*2, eh, small;
+   int method=0, h, i, j, np=com.np, npatt=com.npatt, nzero=0;
+   double *out, *df[2], eh0=Small_Diff*2, eh;
 
    if(com.np!=tree.nbranch && method==1)
       error2("I think HessianSKT2004 works for branch lengths only");
-   df[0] = (double*)malloc((com.npatt*2+1)*com.np*sizeof(double));
-   if(df[0]==NULL) error2("oom space in HessianSKT2004");
-   df[1] = df[0] + com.npatt*com.np;
-   x     = df[1] + com.npatt*com.np;
-   lnL[0] = (double*)malloc(com.np*2*sizeof(double));
-   lnL[1] = lnL[0]+com.np;
-
-   LASTROUND = 2;
+   out = (double*)malloc((size_t)(npatt+1)*np*2*sizeof(double));
+   if(out==NULL) error2("oom space in HessianSKT2004");
 
-   for(backforth=0; backforth<2; backforth++) {
-      for(i=0; i<com.np; i++) {
-         xtoy(xmle, x, com.np);
-         eh = eh0*(fabs(xmle[i]) + 1);
-         if(backforth==0) x[i] = xmle[i] - eh;
-         else             x[i] = xmle[i] + eh;
-         if(x[i] <= 4e-6)
-            nzero ++;
-         dfsites = df[backforth] + i*com.npatt;
-         lnL[backforth][i] = -com.plfun(x, com.np);
-      }
-   }
+   for(i=0; i<np; i++)
+      if(xmle[i] - eh0*(fabs(xmle[i]) + 1) <= 4e-6)  nzero ++;
+   HessianSKT2004_x = xmle;
+   FunPoints(np*2, npatt+1, out, HessianSKT2004Point, "Hessian");
 
-   for(i=0; i<com.np; i++) {
-      eh = eh0*(fabs(xmle[i]) + 1);    
-      g[i] = (lnL[1][i] - lnL[0][i])/(eh*2);
-   }
-   /*
-   printf("\nx gL g H");
-   matout(F0, xmle, 1, com.np);
-   matout(F0, g, 1, com.np);
-   */
-   zero(H, com.np*com.np);
-   for(i=0; i<com.np; i++) {
+   for(i=0; i<np; i++) {
       eh = eh0*(fabs(xmle[i]) + 1);
-      for(h=0; h<com.npatt; h++)
-         df[0][i*com.npatt+h] = (df[1][i*com.npatt+h] - df[0][i*com.npatt+h])/(eh*2);
+      df[0] = out+(size_t)i*(npatt+1);
+      df[1] = out+(size_t)(np+i)*(npatt+1);
+      g[i] = (df[1][0] - df[0][0])/(eh*2);
+      for(h=1; h<=npatt; h++)
+         df[0][h] = (df[1][h] - df[0][h])/(eh*2);
    }
 
-   for(i=0; i<com.np; i++) {
-      for(j=0; j<com.np; j++)
-         for(h=0; h<com.npatt; h++)
-            H[i*com.np+j] -= df[0][i*com.npatt+h] * df[0][j*com.npatt+h] * com.fpatt[h];
+   zero(H, np*np);
+   for(i=0; i<np; i++) {
+      df[0] = out+(size_t)i*(npatt+1)+1;
+      for(j=0; j<np; j++) {
+         df[1] = out+(size_t)j*(npatt+1)+1;
+         for(h=0; h<npatt; h++)
+            H[i*np+j] -= df[0][h] * df[1][h] * com.fpatt[h];
+      }
    }
 
    if(nzero) printf("\nWarning: Hessian matrix may be unreliable for zero branch lengths\n");
-   LASTROUND = lastround0;
-   free(df[0]);
-   free(lnL[0]);
+   free(out);
    return(0);
 }
 
@@ -7391,6 +7938,217 @@ int GetPMatBranch (double Pt[], double x[], double t, int inode)
 
 #elif (defined(CODEML))
 
+#ifndef NEIGENCACHE
+#define NEIGENCACHE  16  /* eigen solutions kept */
+#endif
+#ifndef PMATCACHE_MB
+#define PMATCACHE_MB 32  /* space for cached P(t) */
+#endif
+
+static struct EIGENCACHE {
+   int n, nused, nroot;
+   unsigned long nextid, hit, miss, id[NEIGENCACHE], use[NEIGENCACHE];
+   double *key[NEIGENCACHE], *UVRoot[NEIGENCACHE];
+   double *root[NBTYPE+4];
+   unsigned long rootid[NBTYPE+4];
+}  eigenCache;
+
+static struct PMATCACHE {
+   int n, size, *bucket, *next, *older, *newer, newest, oldest;
+   unsigned long hit, miss, *id;
+   double *t, *P;
+}  pmatCache;
+
+static void EigenCacheForget (void)
+{
+/* This forgets which solutions are in which Root[] arrays, when the arrays
+   are reallocated.
+*/
+   eigenCache.nroot = 0;
+}
+
+static int EigenQREVCache (double Q[], double pi[], int n, double mr,
+       double Root[], double U[], double V[], double space[])
+{
+/* This does eigenQREV() followed by Root[] /= mr, keeping the solutions for
+   the last NEIGENCACHE different (Q, pi, mr), so that revisiting kappa, omega
+   and pi, as when only branch lengths change or when moving between genes or
+   site classes, costs a copy.  The key is Q itself rather than the parameters,
+   so that everything that goes into Q (codon frequencies, AAClasses omegas,
+   FMutSel etc.) is covered.  Every new solution gets a new id, which is
+   recorded for Root[] and used by PMatCacheGet() and PMatCachePut().
+*/
+   int i, k, nk=n*n+n+1, nv=n*n*2+n, status=0;
+   double *key;
+
+   #pragma omp critical (EigenQREVCache)
+   {
+   if(eigenCache.n != n) {
+      for(k=0; k<NEIGENCACHE; k++) {
+         free(eigenCache.key[k]);
+         eigenCache.key[k] = (double*)malloc((nk+nv)*sizeof(double));
+         if(eigenCache.key[k]==NULL) error2("oom EigenQREVCache");
+         eigenCache.UVRoot[k] = eigenCache.key[k]+nk;
+      }
+      eigenCache.n = n;  eigenCache.nused = eigenCache.nroot = 0;
+   }
+   for(k=0; k<eigenCache.nused; k++) {
+      key = eigenCache.key[k];
+      if(key[nk-1]==mr && memcmp(key, Q, n*n*sizeof(double))==0
+         && memcmp(key+n*n, pi, n*sizeof(double))==0)
+         break;
+   }
+   if(k<eigenCache.nused) {
+      eigenCache.hit++;
+      memcpy(U, eigenCache.UVRoot[k], n*n*sizeof(double));
+      memcpy(V, eigenCache.UVRoot[k]+n*n, n*n*sizeof(double));
+      memcpy(Root, eigenCache.UVRoot[k]+n*n*2, n*sizeof(double));
+   }
+   else {
+      eigenCache.miss++;
+      if(eigenCache.nused<NEIGENCACHE)
+         k = eigenCache.nused++;
+      else
+         for(i=1,k=0; i<NEIGENCACHE; i++)
+            if(eigenCache.use[i] < eigenCache.use[k]) k = i;
+      status = eigenQREV(Q, pi, n, Root, U, V, space);
+      for(i=0; i<n; i++)
+         Root[i] /= mr;
+      key = eigenCache.key[k];
+      memcpy(key, Q, n*n*sizeof(double));
+      memcpy(key+n*n, pi, n*sizeof(double));
+      key[nk-1] = mr;
+      memcpy(eigenCache.UVRoot[k], U, n*n*sizeof(double));
+      memcpy(eigenCache.UVRoot[k]+n*n, V, n*n*sizeof(double));
+      memcpy(eigenCache.UVRoot[k]+n*n*2, Root, n*sizeof(double));
+      eigenCache.id[k] = ++eigenCache.nextid;
+   }
+   eigenCache.use[k] = eigenCache.hit + eigenCache.miss;
+
+   for(i=0; i<eigenCache.nroot; i++)
+      if(eigenCache.root[i]==Root) break;
+   if(i==eigenCache.nroot && i<NBTYPE+4) eigenCache.nroot++;
+   if(i<eigenCache.nroot) {
+      eigenCache.root[i] = Root;
+      eigenCache.rootid[i] = eigenCache.id[k];
+   }
+   }
+   return(status);
+}
+
+static unsigned long EigenId (double Root[])
+{
+/* The id of the eigen solution in Root[], U[] and V[], 0 if unknown.
+*/
+   int i;
+   unsigned long id=0;
+
+   #pragma omp critical (EigenQREVCache)
+   for(i=0; i<eigenCache.nroot; i++)
+      if(eigenCache.root[i]==Root) { id = eigenCache.rootid[i];  break; }
+   return(id);
+}
+
+static int PMatCacheHash (unsigned long id, double t)
+{
+   unsigned long long h;
+
+   memcpy(&h, &t, sizeof(double));
+   h ^= id*0x9E3779B97F4A7C15ULL;
+   h ^= h>>29;
+   return((int)(h % (unsigned long long)(2*pmatCache.size)));
+}
+
+static void PMatCacheLRU (int i, int unlink)
+{
+/* This takes entry i out of the LRU list if(unlink), and puts it at the
+   front as the newest.
+*/
+   if(unlink) {
+      if(pmatCache.newer[i]!=-1) pmatCache.older[pmatCache.newer[i]] = pmatCache.older[i];
+      else                       pmatCache.newest = pmatCache.older[i];
+      if(pmatCache.older[i]!=-1) pmatCache.newer[pmatCache.older[i]] = pmatCache.newer[i];
+      else                       pmatCache.oldest = pmatCache.newer[i];
+   }
+   pmatCache.older[i] = pmatCache.newest;
+   pmatCache.newer[i] = -1;
+   if(pmatCache.newest!=-1) pmatCache.newer[pmatCache.newest] = i;
+   pmatCache.newest = i;
+   if(pmatCache.oldest==-1) pmatCache.oldest = i;
+}
+
+static int PMatCacheGet (double P[], unsigned long id, double t)
+{
+/* This copies P(t) for eigen solution id into P[] if it is in the cache, and
+   returns 1 if so.  The cache holds the most recently used P matrices, up to
+   PMATCACHE_MB, so that ConditionalPNode() and the ancestral and conP_part1
+   passes that follow it share the same matrices, and branches that have not
+   changed since the last likelihood evaluation are not recalculated.
+*/
+   int n=com.ncode, i=-1;
+
+   if(id==0 || pmatCache.n!=n) return(0);
+   #pragma omp critical (PMatCache)
+   {
+   for(i=pmatCache.bucket[PMatCacheHash(id,t)]; i!=-1; i=pmatCache.next[i])
+      if(pmatCache.id[i]==id && pmatCache.t[i]==t) break;
+   if(i!=-1) {
+      memcpy(P, pmatCache.P+(size_t)i*n*n, n*n*sizeof(double));
+      if(i!=pmatCache.newest) PMatCacheLRU(i, 1);
+      pmatCache.hit++;
+   }
+   else
+      pmatCache.miss++;
+   }
+   return(i!=-1);
+}
+
+static void PMatCachePut (double P[], unsigned long id, double t)
+{
+/* This adds P(t) for eigen solution id, replacing the least recently used
+   entry when the cache is full.  Space is allocated at the first call but is
+   touched only as the cache fills.
+*/
+   int n=com.ncode, i, *p;
+
+   if(id==0 || PMATCACHE_MB<=0) return;
+   #pragma omp critical (PMatCache)
+   {
+   if(pmatCache.n!=n) {
+      free(pmatCache.bucket);  free(pmatCache.id);  free(pmatCache.t);  free(pmatCache.P);
+      pmatCache.size = (int)max2(1, PMATCACHE_MB*1024.*1024/(n*n*sizeof(double)));
+      pmatCache.bucket = (int*)malloc(pmatCache.size*5*sizeof(int));
+      pmatCache.id = (unsigned long*)malloc(pmatCache.size*sizeof(unsigned long));
+      pmatCache.t = (double*)malloc(pmatCache.size*sizeof(double));
+      pmatCache.P = (double*)malloc((size_t)pmatCache.size*n*n*sizeof(double));
+      if(!pmatCache.bucket || !pmatCache.id || !pmatCache.t || !pmatCache.P)
+         error2("oom PMatCache");
+      pmatCache.next  = pmatCache.bucket+pmatCache.size*2;
+      pmatCache.older = pmatCache.next+pmatCache.size;
+      pmatCache.newer = pmatCache.older+pmatCache.size;
+      for(i=0; i<pmatCache.size*2; i++) pmatCache.bucket[i] = -1;
+      pmatCache.newest = pmatCache.oldest = -1;
+      for(i=0; i<pmatCache.size; i++) {
+         pmatCache.id[i] = 0;  pmatCache.t[i] = 0;  pmatCache.next[i] = -1;
+         PMatCacheLRU(pmatCache.size-1-i, 0);
+      }
+      pmatCache.n = n;
+   }
+   i = pmatCache.oldest;
+   if(pmatCache.id[i]) {       /* take the old entry out of its bucket */
+      for(p=&pmatCache.bucket[PMatCacheHash(pmatCache.id[i],pmatCache.t[i])]; *p!=i; p=&pmatCache.next[*p]) ;
+      *p = pmatCache.next[i];
+   }
+   pmatCache.id[i] = id;
+   pmatCache.t[i] = t;
+   memcpy(pmatCache.P+(size_t)i*n*n, P, n*n*sizeof(double));
+   p = &pmatCache.bucket[PMatCacheHash(id,t)];
+   pmatCache.next[i] = *p;
+   *p = i;
+   PMatCacheLRU(i, 1);
+   }
+}
+
 int GetPMatBranch (double Pt[], double x[], double t, int inode)
 {
 /* P(t) for branch leading to inode, called by routines ConditionalPNode()
@@ -7400,6 +8158,7 @@ int GetPMatBranch (double Pt[], double x[], double t, int inode)
    Qfactor scaling is applied here and not inside eigenQcodon().
 */
    int iUVR=0, nUVR=NBTYPE+2, ib = (int)nodes[inode].label, updateUVR=0;
+   unsigned long id;
    double *pkappa, w, mr=1, Qfactor=1;
    double *pomega = com.pomega; /* x+com.ntime+com.nrgene+com.nkappa; */
 
@@ -7446,12 +8205,54 @@ int GetPMatBranch (double Pt[], double x[], double t, int inode)
       PMatJC69like(Pt, t, com.ncode);
    else {
       t *= Qfactor;
-      PMatUVRoot(Pt, t, com.ncode, U, V, Root);
+      id = EigenId(Root);
+      if(!PMatCacheGet(Pt, id, t)) {
+         PMatUVRoot(Pt, t, com.ncode, U, V, Root);
+         PMatCachePut(Pt, id, t);
+      }
    }
 
    return(0);
 }
 
+int GetPMatBranches (double P[], double x[], int nt, double t[], int inode[])
+{
+/* P(t) for a batch of nt branches, inode[i] with time t[i], into P[nt*n*n], 
+   such as all branches and rate classes.  When the branches share the 
+   global U, V & Root (see GetPMatBranchThreadSafe()), the matrices not in 
+   the P(t) cache are calculated together by PMatUVRootBatch(); otherwise 
+   GetPMatBranch() is called for each branch.
+*/
+   int n=com.ncode, i, nmiss=0, *miss;
+   unsigned long id;
+   double *tmiss, *Pmiss;
+
+   if(!GetPMatBranchThreadSafe() || (com.seqtype==AAseq && com.model==Poisson)) {
+      for(i=0; i<nt; i++)
+         GetPMatBranch(P+(size_t)i*n*n, x, t[i], inode[i]);
+      return(0);
+   }
+   miss = (int*)malloc(nt*sizeof(int));
+   tmiss = (double*)malloc(nt*(n*n+n+1)*sizeof(double));
+   if(miss==NULL || tmiss==NULL) error2("oom GetPMatBranches");
+   Pmiss = tmiss+nt;
+   id = EigenId(Root);
+   for(i=0; i<nt; i++)
+      if(!PMatCacheGet(P+(size_t)i*n*n, id, t[i])) {
+         tmiss[nmiss] = t[i];
+         miss[nmiss++] = i;
+      }
+   if(nmiss) {
+      PMatUVRootBatch(Pmiss, tmiss, nmiss, n, U, V, Root, Pmiss+(size_t)nmiss*n*n);
+      for(i=0; i<nmiss; i++) {
+         memcpy(P+(size_t)miss[i]*n*n, Pmiss+(size_t)i*n*n, n*n*sizeof(double));
+         PMatCachePut(Pmiss+(size_t)i*n*n, id, tmiss[i]);
+      }
+   }
+   free(miss);  free(tmiss);
+   return(0);
+}
+
 #endif
 
 
@@ -7553,6 +8354,64 @@ int SetPSiteClass(int iclass, double x[])
 extern int prt, Locus, Ir;
 
 
+static struct CONPCACHE {
+   int on, valid, np;
+   double *x;
+}  conPCache;
+
+void ConPCache (int on)
+{
+/* This turns on or off the conP cache used by lfun() and fx_r() during 
+   optimization by ming2().  When on, the parameters of the last evaluation are 
+   remembered, and if only branch lengths have changed since, only the nodes 
+   on the paths from the changed branches to the root are updated, while 
+   nodes[].conP for the other nodes are reused.  Perturbing one branch for the 
+   numerical derivatives then costs O(depth) instead of O(nnode).  
+   The caller is responsible for turning the cache off before anything else 
+   changes the tree or nodes[].conP.
+*/
+   conPCache.on = on;
+   conPCache.valid = 0;
+}
+
+static int ConPCacheBegin (double x[], int np, int reuse)
+{
+/* This sets com.oldconP[] for a partial update if the cache can be used, and 
+   returns 1 if so.  reuse=1 if nodes[].conP from the last evaluation are 
+   still intact, which is not the case when site classes share conP.
+*/
+   int i, j;
+
+   if(!conPCache.on || !conPCache.valid || !reuse || np!=conPCache.np 
+      || com.clock || BayesEB || com.ntime!=tree.nbranch)
+      return(0);
+   for(i=com.ntime; i<np; i++)
+      if(x[i] != conPCache.x[i]) return(0);
+   for(i=0; i<tree.nnode; i++) com.oldconP[i] = 1;
+   for(i=0; i<com.ntime; i++) {
+      if(x[i] == conPCache.x[i]) continue;
+      for(j=nodes[tree.branches[i][1]].father; j!=-1 && com.oldconP[j]; j=nodes[j].father)
+         com.oldconP[j] = 0;
+   }
+   return(1);
+}
+
+static void ConPCacheEnd (double x[], int np, int reuse, int partial)
+{
+   int i;
+
+   if(partial)
+      for(i=0; i<tree.nnode; i++) com.oldconP[i] = 0;
+   if(!conPCache.on) return;
+   if(np>conPCache.np || conPCache.x==NULL)
+      if((conPCache.x=(double*)realloc(conPCache.x, max2(np,1)*sizeof(double)))==NULL)
+         error2("oom ConPCache");
+   for(i=0; i<np; i++) conPCache.x[i] = x[i];
+   conPCache.np = np;
+   conPCache.valid = reuse;
+}
+
+
 int fx_r (double x[], int np)
 {
 /* This calculates f(x|r) if(com.NnodeScale==0) or log{f(x|r)} 
@@ -7563,30 +8422,46 @@ int fx_r (double x[], int np)
    The results are stored in com.fhK[com.ncatG*com.npatt].
    This deals with underflows with large trees using global variables 
    com.nodeScale and com.nodeScaleF[com.NnodeScale*com.npatt].
+   If(com.conPSiteClassPar), conP for all the rate classes are calculated 
+   at the same time by ConditionalPNodeSiteClasses(), with class ir in 
+   slice (ir+1)%ncatG of conP and com.nodeScaleF.
 */
-   int  h, ir, i,k, ig, FPE=0;
+   int  h, ir, is, i,k, ig, FPE=0;
+   int  par = (com.conPSiteClassPar && !com.conPSiteClass && !BayesEB), partial;
    double fh, smallw=1e-12; /* for testing site class with w=0 */
+   double *conP, *scaleF;
+   size_t sconP = (tree.nnode-com.ns)*com.ncode*(size_t)com.npatt;
 
    if(!BayesEB)
       if(SetParameters(x)) puts("\npar err..");
+   partial = ConPCacheBegin(x, np, par);
 
    for(ig=0; ig<com.ngene; ig++) { /* alpha may differ over ig */
       if(com.Mgene>1 || com.nalpha>1)
          SetPGene(ig, com.Mgene>1, com.Mgene>1, com.nalpha>1, x);
+      if(par)
+         ConditionalPNodeSiteClasses(tree.root, ig, x);
       for(ir=0; ir<com.ncatG; ir++) {
-         if(ir && com.conPSiteClass) {  /* shift com.nodeScaleF & conP */
-            if(com.NnodeScale) 
-               com.nodeScaleF += (size_t)com.npatt*com.NnodeScale;
-            for(i=com.ns; i<tree.nnode; i++)
-               nodes[i].conP += (tree.nnode-com.ns)*com.ncode*(size_t)com.npatt;
+         if(par)
+            is = (ir+1)%com.ncatG;
+         else {
+            if(ir && com.conPSiteClass) {  /* shift com.nodeScaleF & conP */
+               if(com.NnodeScale) 
+                  com.nodeScaleF += (size_t)com.npatt*com.NnodeScale;
+               for(i=com.ns; i<tree.nnode; i++)
+                  nodes[i].conP += sconP;
+            }
+            SetPSiteClass(ir,x);
+            ConditionalPNode(tree.root,ig, x);
+            is = 0;
          }
-         SetPSiteClass(ir,x);
-         ConditionalPNode(tree.root,ig, x);
+         conP = nodes[tree.root].conP + is*sconP;
+         scaleF = com.nodeScaleF + is*com.NnodeScale*(size_t)com.npatt;
 
          for (h=com.posG[ig]; h<com.posG[ig+1]; h++) {
             if (com.fpatt[h]<=0 && com.print>=0) continue;
             for (i=0,fh=0; i<com.ncode; i++)
-               fh += com.pi[i]*nodes[tree.root].conP[h*com.ncode+i];
+               fh += com.pi[i]*conP[h*com.ncode+i];
             if (fh<=0) {
                if(fh<-1e-10 /* && !FPE */) { /* note that 0 may be o.k. here */
                   FPE=1; matout(F0,x,1,np);
@@ -7603,7 +8478,7 @@ int fx_r (double x[], int np)
                com.fhK[ir*com.npatt+h] = fh;
             else
                for(k=0,com.fhK[ir*com.npatt+h]=log(fh); k<com.NnodeScale; k++)
-                  com.fhK[ir*com.npatt+h] += com.nodeScaleF[k*com.npatt+h];
+                  com.fhK[ir*com.npatt+h] += scaleF[k*com.npatt+h];
          }  /* for (h) */
       }     /* for (ir) */
 
@@ -7611,9 +8486,10 @@ int fx_r (double x[], int np)
          if(com.NnodeScale) 
             com.nodeScaleF -= (com.ncatG-1)*com.NnodeScale*(size_t)com.npatt;
          for(i=com.ns; i<tree.nnode; i++)
-            nodes[i].conP -= (com.ncatG-1)*(tree.nnode-com.ns)*com.ncode*(size_t)com.npatt;
+            nodes[i].conP -= (com.ncatG-1)*sconP;
       }
    }  /* for(ig) */
+   ConPCacheEnd(x, np, par, partial);
    return(0);
 }
 
@@ -7623,11 +8499,12 @@ double lfun (double x[], int np)
 /* likelihood function for models of one rate for all sites including 
    Mgene models.
 */
-   int  h,i,k, ig, FPE=0;
+   int  h,i,k, ig, FPE=0, partial;
    double lnL=0, fh;
 
    NFunCall++;
    if(SetParameters(x)) puts ("\npar err..");
+   partial = ConPCacheBegin(x, np, 1);
    for(ig=0; ig<com.ngene; ig++) {
       if(com.Mgene>1) 
          SetPGene(ig,1,1,0,x);
@@ -7660,6 +8537,7 @@ double lfun (double x[], int np)
             print_lnf_site(h,fh);
       }
    }
+   ConPCacheEnd(x, np, 1, partial);
    return (lnL);
 }
 
@@ -8942,6 +9820,7 @@ int GetMemPUVR(int nc, int nUVR)
    PMat=(double*)malloc((nc*nc+nUVR*nc*nc*2+nUVR*nc)*sizeof(double));
    if(PMat==NULL) error2("oom getting P&U&V&Root");
    U=_UU[0]=PMat+nc*nc;  V=_VV[0]=_UU[0]+nc*nc; Root=_Root[0]=_VV[0]+nc*nc;
+   EigenCacheForget();
    for(i=1; i<nUVR; i++) {
       _UU[i]=_UU[i-1]+nc*nc*2+nc; _VV[i]=_VV[i-1]+nc*nc*2+nc; 
       _Root[i]=_Root[i-1]+nc*nc*2+nc;
@@ -8952,6 +9831,7 @@ int GetMemPUVR(int nc, int nUVR)
 void FreeMemPUVR(void)
 {   
    free(PMat); 
+   EigenCacheForget();
 }
 
 